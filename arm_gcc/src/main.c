@@ -40,6 +40,22 @@ int uart_sendchar(char ch)                 /* Write character to Serial Port
     return (SERIAL_THR = ch);
 }
 
+#ifdef SEMIHOSTING
+/* armemulator -H, make C_DEFS=-DSEMIHOSTING, one SYS_WRITE per buffer */
+static int semihost_call(int op, void *arg)
+{
+    register int r0 __asm__("r0") = op;
+    register void *r1 __asm__("r1") = arg;
+    __asm__ volatile ("swi 0x123456" : "+r"(r0) : "r"(r1) : "memory");
+    return r0;
+}
+
+int _write( int file, char *ptr, int len)
+{
+    int arg[3] = { 2, (int)ptr, len };  //handle 2 is stdout
+    return len - semihost_call(0x05, arg);
+}
+#else
 int _write( int file, char *ptr, int len)
 {
     int n;
@@ -49,6 +65,7 @@ int _write( int file, char *ptr, int len)
     
     return len;
 }
+#endif
 
 
 //systick
@@ -0,0 +1,64 @@
+/*
+ * armimage.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <image.h>
+
+/* image tool, the image must not be in use by an emulator */
+
+static void usage(const char *file)
+{
+    printf("%s\n\n", file);
+    printf("  usage:\n\n");
+    printf("  armimage\n");
+    printf(
+        "       create <overlay> <base>    Create an empty copy-on-write overlay on a base image.\n");
+    printf(
+        "       commit <overlay>           Write the overlay blocks into its base, then empty it.\n");
+    printf(
+        "       discard <overlay>          Drop the overlay blocks.\n");
+    printf(
+        "       convert <raw> <compressed> Compress a raw image, read-only, may be an overlay base.\n");
+    printf(
+        "       info <image>               Print the image format and usage.\n");
+    printf("\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    int ret = -1;
+
+    if(argc == 4 && strcmp(argv[1], "create") == 0) {
+        ret = image_cow_create(argv[2], argv[3]);
+    } else if(argc == 3 && strcmp(argv[1], "commit") == 0) {
+        ret = image_cow_commit(argv[2]);
+    } else if(argc == 3 && strcmp(argv[1], "discard") == 0) {
+        ret = image_cow_discard(argv[2]);
+    } else if(argc == 4 && strcmp(argv[1], "convert") == 0) {
+        ret = image_cz_convert(argv[2], argv[3]);
+    } else if(argc == 3 && strcmp(argv[1], "info") == 0) {
+        ret = image_info(argv[2]);
+    } else {
+        usage(argv[0]);
+    }
+    return ret < 0 ? 1 : 0;
+}
+
+/*****************************END OF FILE***************************/
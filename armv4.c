@@ -125,6 +125,8 @@ static inline uint32_t cp15_write(struct mmu_t *mmu, uint32_t Rd_val, uint8_t CR
     case 5:
     case 6:
         mmu->reg[CRn] = Rd_val;
+        if(mmu->reg_mirror)
+            mmu->reg_mirror[CRn] = Rd_val;
         break;
     case 7:
         //Cache functions
@@ -463,6 +465,29 @@ static inline uint32_t mmu_transfer(struct armv4_cpu_t *cpu, uint32_t vaddr,
 }
 
 
+/*
+ * mmu_translate: physical address of vaddr for the current mode, for
+ * host code working on guest buffers, a fault takes no abort and leaves
+ * FSR and FAR as the guest last saw them, return: 0 done, -1 fault
+ */
+int mmu_translate(struct armv4_cpu_t *cpu, uint32_t vaddr, uint8_t wr, uint32_t *paddr)
+{
+    struct mmu_t *mmu = &cpu->mmu;
+    uint32_t fsr = cp15_fsr(mmu);
+    uint32_t far = cp15_far(mmu);
+    uint8_t fault = mmu->mmu_fault;
+
+    *paddr = mmu_transfer(cpu, vaddr, 0, is_privileged(cpu), wr);
+    if(mmu_check_status(mmu)) {
+        cp15_fsr(mmu) = fsr;
+        cp15_far(mmu) = far;
+        mmu->mmu_fault = fault;
+        return -1;
+    }
+    return 0;
+}
+
+
 /****cp15 end***********************************************************/
 
 /*
@@ -104,6 +104,8 @@ struct armv4_cpu_t {
 
     struct mmu_t {
         uint32_t reg[16];
+        //if set, writes of reg are mirrored for external tools
+        uint32_t *reg_mirror;
         uint8_t mmu_fault;
 #define   cp15_ctl(mmu)            (mmu)->reg[1]
 #define   cp15_ttb(mmu)            (mmu)->reg[2]
@@ -257,6 +259,7 @@ void reg_show(struct armv4_cpu_t *cpu);
 
 uint32_t read_mem(struct armv4_cpu_t *cpu, uint8_t privileged, uint32_t address, uint8_t mmu, uint8_t mask);
 void write_mem(struct armv4_cpu_t *cpu, uint8_t privileged, uint32_t address, uint32_t data,  uint8_t mask);
+int mmu_translate(struct armv4_cpu_t *cpu, uint32_t vaddr, uint8_t wr, uint32_t *paddr);
 
 /*  memory */
 #define  is_privileged(cpu)            (cpsr_m(cpu) != CPSR_M_USR)
@@ -0,0 +1,259 @@
+/*
+ * batch.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <batch.h>
+#include <config.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#define LOG_NAME   "batch"
+#define PRINTF(...)           printf(LOG_NAME ": " __VA_ARGS__)
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+/*
+ * Batch runner for test programmes.
+ * The parent reads the job list and forks a worker for every job, at
+ * most workers at a time. It does so before any machine is built, so
+ * a worker starts from a small process with no threads, skips exec and
+ * dynamic linking, and goes on in main() as a normal run of its image
+ * with the options of the batch. The job ends when the guest writes the
+ * power off device or semihosting SYS_EXIT, or its -L budget runs out,
+ * the exit status is the result. The parent records one line per job
+ * in the results file as jobs complete:
+ *   <job> <status> <wall ms> <cpu ms> <image>
+ * status is the exit status, or "sig<n>" if the worker was killed.
+ */
+
+struct batch_job_t {
+    char *image;
+    pid_t pid;               //0 not started or done
+    struct timespec start;
+};
+
+struct batch_t {
+    struct batch_job_t *jobs;
+    uint32_t count;
+    uint32_t next;           //first job not started
+    uint32_t running;
+
+    FILE *results;
+    uint32_t passed;
+    uint32_t failed;
+};
+
+static struct batch_t batch;
+
+
+static int64_t batch_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000LL + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+/* one image per line, blank lines and lines starting with '#' are skipped */
+static int batch_load(const char *list)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ret = 0;
+
+    fp = fopen(list, "r");
+    if(!fp) {
+        ERROR_PRINTF("open %s err\n", list);
+        return -1;
+    }
+    while((len = getline(&line, &size, fp)) >= 0) {
+        struct batch_job_t *jobs;
+        char *p = line;
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+         line[len - 1] == ' ' || line[len - 1] == '\t'))
+            line[--len] = '\0';
+        while(*p == ' ' || *p == '\t')
+            p++;
+        if(*p == '\0' || *p == '#')
+            continue;
+        jobs = realloc(batch.jobs, (batch.count + 1) * sizeof(struct batch_job_t));
+        if(jobs) {
+            batch.jobs = jobs;
+            memset(&jobs[batch.count], 0, sizeof(struct batch_job_t));
+            jobs[batch.count].image = strdup(p);
+        }
+        if(!jobs || !jobs[batch.count].image) {
+            ERROR_PRINTF("job alloc err\n");
+            ret = -1;
+            break;
+        }
+        batch.count++;
+    }
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+
+/* in the worker, the console and the messages of the emulator go to the job log */
+static int batch_worker_init(uint32_t id, const char *dir)
+{
+    char log_path[PATH_MAX];
+    int fd;
+
+#ifdef __linux__
+    //do not outlive the batch
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    snprintf(log_path, sizeof(log_path), BATCH_LOG_FORMAT, dir, id);
+    fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        ERROR_PRINTF("job %u open %s err\n", id, log_path);
+        return -1;
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    fd = open("/dev/null", O_RDWR);
+    if(fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if(batch.results)
+        fclose(batch.results);
+    return 0;
+}
+
+
+static void batch_done(struct batch_job_t *job, int status, const struct rusage *ru)
+{
+    struct timespec end;
+    char result[16];
+    int64_t cpu_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    cpu_ms = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000LL +
+     (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000;
+    if(WIFEXITED(status)) {
+        snprintf(result, sizeof(result), "%d", WEXITSTATUS(status));
+    } else {
+        snprintf(result, sizeof(result), "sig%d", WTERMSIG(status));
+    }
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        batch.passed++;
+    } else {
+        batch.failed++;
+        PRINTF("job %u %s: %s\n", (uint32_t)(job - batch.jobs), job->image, result);
+    }
+    fprintf(batch.results, "%u\t%s\t%lld\t%lld\t%s\n", (uint32_t)(job - batch.jobs), result,
+     (long long)batch_ms(&job->start, &end), (long long)cpu_ms, job->image);
+    fflush(batch.results);
+    job->pid = 0;
+}
+
+
+char *batch_start(const char *list, int workers, const char *dir)
+{
+    char path[PATH_MAX];
+    struct timespec start, end;
+
+    memset(&batch, 0, sizeof(batch));
+    if(batch_load(list) < 0)
+        exit(-1);
+    if(workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers <= 0)
+        workers = 1;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        ERROR_PRINTF("mkdir %s err\n", dir);
+        exit(-1);
+    }
+    snprintf(path, sizeof(path), "%s/" BATCH_RESULTS, dir);
+    batch.results = fopen(path, "w");
+    if(!batch.results) {
+        ERROR_PRINTF("open %s err\n", path);
+        exit(-1);
+    }
+    fprintf(batch.results, "#job\tstatus\twall_ms\tcpu_ms\timage\n");
+    fflush(batch.results);
+    PRINTF("%u jobs, %d workers, results in %s\n", batch.count, workers, path);
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(batch.next < batch.count || batch.running) {
+        struct rusage ru;
+        int status;
+        pid_t pid;
+
+        while(batch.next < batch.count && batch.running < (uint32_t)workers) {
+            struct batch_job_t *job = &batch.jobs[batch.next];
+            fflush(stdout);
+            clock_gettime(CLOCK_MONOTONIC, &job->start);
+            pid = fork();
+            if(pid == 0) {
+                if(batch_worker_init(batch.next, dir) < 0)
+                    _exit(-1);
+                return job->image;
+            } else if(pid < 0) {
+                ERROR_PRINTF("job %u fork err\n", batch.next);
+                if(!batch.running)
+                    exit(-1);
+                break;
+            }
+            job->pid = pid;
+            batch.next++;
+            batch.running++;
+        }
+
+        pid = wait4(-1, &status, 0, &ru);
+        if(pid < 0) {
+            if(errno == EINTR)
+                continue;
+            ERROR_PRINTF("wait err\n");
+            exit(-1);
+        }
+        for(uint32_t i=0; i<batch.next; i++) {
+            if(batch.jobs[i].pid == pid) {
+                batch_done(&batch.jobs[i], status, &ru);
+                batch.running--;
+                break;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(batch.results);
+    PRINTF("%u jobs, %u passed, %u failed, %lld ms\n", batch.count, batch.passed, batch.failed,
+     (long long)batch_ms(&start, &end));
+    exit(batch.failed ? 1 : 0);
+}
+
+/*****************************END OF FILE***************************/
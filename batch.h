@@ -0,0 +1,36 @@
+/*
+ * batch.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#define BATCH_DEFAULT_DIR    "batch"
+#define BATCH_RESULTS        "results"     /* in the output directory */
+#define BATCH_LOG_FORMAT     "%s/%u.log"   /* output of job n */
+
+/*
+ * batch_start: run every image of list, one path per line, in a forked
+ * worker each, at most workers at a time, 0 one per host cpu, results
+ * and logs go to dir. Call before the machine is built, the parent
+ * exits when all jobs are done, status 0 if all of them exited with 0,
+ * return: in a worker, the image of its job
+ */
+char *batch_start(const char *list, int workers, const char *dir);
+
+#endif
+/*****************************END OF FILE***************************/
@@ -22,10 +22,19 @@
 #ifdef __linux__
 #define USE_PRCTL_SET_THREAD_NAME
 #define USE_TUN_SUPPORT
+#define USE_MEMFD_SUPPORT
+#define USE_EPOLL_SUPPORT
+#define USE_THREAD_AFFINITY
+#define USE_FALLOCATE_SUPPORT
+#define USE_GETRANDOM_SUPPORT
 #endif
 
 #define FS_MMAP_MODE
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_X86_CRYPTO_SUPPORT
+#endif
+
 #ifndef _WIN32
 #define USE_UNIX_TERMINAL_API
 #endif
@@ -16,10 +16,12 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#define _GNU_SOURCE  /* posix_openpt, ptsname */
 #include <console.h>
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <config.h>
 
@@ -31,41 +33,144 @@
 
 #ifdef USE_UNIX_TERMINAL_API
 #include <stdlib.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <loop.h>
 #include <kfifo.h>
 
 
-#define CONSOLE_FIFO_SIZE   (512)
+#define CONSOLE_FIFO_SIZE   (4096)
+/* output waits this long, or for half a fifo, to leave in one writev */
+#define CONSOLE_FLUSH_NS    (2000000)
+/* log file lines per writev, each takes a timestamp and a text iovec */
+#define CONSOLE_IOV_MAX     (64)
+#define CONSOLE_STAMP_SIZE  (32)
+
+enum {
+    CONSOLE_STDIO = 0,  //raw terminal on stdin/stdout
+    CONSOLE_PTY,        //new pseudo terminal, path printed at start
+    CONSOLE_UNIX,       //unix socket server, one client at a time
+    CONSOLE_FILE,       //append-only log with timestamps, no input
+};
 
 static struct termios stdin_orig_termios;
 static int conio_oldf;
+static uint8_t stdin_is_tty = 0;
 static uint8_t term_escape_char = 'b' & 0x9f; /* ctrl-b is used for escape */
 
 struct console_status_t {
-    int idx_r;
+    struct loop_fd_t in;
+    struct loop_fd_t out;
     struct __kfifo recv;
     uint8_t recv_buf[CONSOLE_FIFO_SIZE];
     struct __kfifo send;
     uint8_t send_buf[CONSOLE_FIFO_SIZE];
-    uint32_t send_time_cnt;
+    uint8_t stdin_eof;
+    /* stdio backend is open, the loop thread owns stdin */
+    uint8_t stdin_owned;
+    /* recv fifo was full, stdin is parked until the guest reads */
+    uint8_t stdin_blocked;
     uint8_t term_got_escape;
     int (*term)(uint8_t escape_char, uint8_t ch);
+    /* output pattern watch, from cpu thread */
+    const char *match_pattern;
+    int match_idx;
+    void (*match)(void);
+
+    struct loop_t *loop;
+    int backend;
+    char path[108];             //socket or log file, sun_path size
+    struct loop_fd_t listen;    //unix backend server socket
+    int pty_slave;              //held open so the master never hangs up
+    struct loop_timer_t *flush_timer;
+    uint8_t line_start;         //log file, next byte begins a line
 };
 
 
+static void console_stdin_callback(void *opaque, int revents);
+static void console_stdout_callback(void *opaque, int revents);
+static void console_listen_callback(void *opaque, int revents);
+static void console_send_flush(struct console_status_t *c);
+
 static struct console_status_t con_default = {
-    .idx_r = 0,
+    .in = {
+        .fd = STDIN_FILENO,
+        .cb = console_stdin_callback,
+        .opaque = &con_default,
+    },
+    .out = {
+        .fd = STDOUT_FILENO,
+        .cb = console_stdout_callback,
+        .opaque = &con_default,
+    },
+    .listen = {
+        .fd = -1,
+        .cb = console_listen_callback,
+        .opaque = &con_default,
+    },
+    .pty_slave = -1,
     .term = NULL,
+    .match_pattern = NULL,
+    .backend = CONSOLE_STDIO,
 };
 
+/* unix backend, drop the client and wait for the next one */
+static void console_client_close(struct console_status_t *c)
+{
+    if(c->in.fd < 0)
+        return;
+    loop_del_fd(c->loop, &c->in);
+    loop_del_fd(c->loop, &c->out);
+    close(c->in.fd);
+    close(c->out.fd);
+    c->in.fd = c->out.fd = -1;
+    c->stdin_blocked = 0;
+}
+
 static void disable_raw_mode(void)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &stdin_orig_termios);
-    fcntl(STDIN_FILENO, F_SETFL, conio_oldf);
+    struct console_status_t *c = &con_default;
+    loop_timer_free(c->loop, c->flush_timer);
+    c->flush_timer = NULL;
+    //output the guest printed just before the emulator exits
+    console_send_flush(c);
+    switch(c->backend) {
+    case CONSOLE_STDIO:
+        c->stdin_owned = 0;
+        loop_del_fd(c->loop, &c->in);
+        loop_del_fd(c->loop, &c->out);
+        if(stdin_is_tty)
+            tcsetattr(STDIN_FILENO, TCSANOW, &stdin_orig_termios);
+        fcntl(STDIN_FILENO, F_SETFL, conio_oldf);
+        break;
+    case CONSOLE_PTY:
+        loop_del_fd(c->loop, &c->in);
+        loop_del_fd(c->loop, &c->out);
+        close(c->in.fd);
+        close(c->out.fd);
+        close(c->pty_slave);
+        c->in.fd = c->out.fd = c->pty_slave = -1;
+        break;
+    case CONSOLE_UNIX:
+        console_client_close(c);
+        //the path is left alone, a cloned machine shares it with the template
+        loop_del_fd(c->loop, &c->listen);
+        close(c->listen.fd);
+        c->listen.fd = -1;
+        break;
+    case CONSOLE_FILE:
+        loop_del_fd(c->loop, &c->out);
+        close(c->out.fd);
+        c->out.fd = -1;
+        break;
+    }
 }
 
 static int console_escape_proc_byte(struct console_status_t *c, uint8_t ch)
@@ -86,58 +191,223 @@ send_char:
     return 0;
 }
 
-static void console_prepare_callback(void *opaque)
+/* return: iovecs filled with the queued bytes, both ring segments */
+static int console_send_iov(struct console_status_t *c, struct iovec *iov)
 {
-    struct console_status_t *c = (struct console_status_t *)opaque;
-    int events = POLLIN;
-    if(c->send.in != c->send.out) {
-        events |= POLLOUT;
-        loop_set_timeout(&loop_default, 0);
-        c->send_time_cnt = loop_get_clock_ms(&loop_default);
-    } else {
-        if(loop_get_clock_ms(&loop_default) - c->send_time_cnt >= 2) {
-            loop_set_timeout(&loop_default, 1);
-        } else {
-            loop_set_timeout(&loop_default, 0);
+    void *buf;
+    unsigned int len = __kfifo_out_linear(&c->send, &buf);
+    unsigned int total = kfifo_len(&c->send);
+    int cnt = 0;
+    if(!len)
+        return 0;
+    iov[cnt].iov_base = buf;
+    iov[cnt++].iov_len = len;
+    //the ring wrapped, the rest starts at the buffer head
+    if((uint8_t *)buf + len == c->send_buf + CONSOLE_FIFO_SIZE && total > len) {
+        iov[cnt].iov_base = c->send_buf;
+        iov[cnt++].iov_len = total - len;
+    }
+    return cnt;
+}
+
+/* log file, every line gets "YYYY-mm-dd HH:MM:SS.mmm " in front */
+static int console_log_iov(struct console_status_t *c, struct iovec *iov, int cnt,
+    char *stamp, struct iovec *out)
+{
+    struct timespec ts;
+    struct tm tm;
+    int n = 0, lines = 0;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    int slen = strftime(stamp, CONSOLE_STAMP_SIZE, "%Y-%m-%d %H:%M:%S", &tm);
+    slen += snprintf(stamp + slen, CONSOLE_STAMP_SIZE - slen, ".%03ld ", ts.tv_nsec / 1000000);
+
+    for(int i = 0; i < cnt; i++) {
+        uint8_t *p = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while(left && n + 2 <= CONSOLE_IOV_MAX * 2) {
+            uint8_t *nl = memchr(p, '\n', left);
+            size_t l = nl ? (size_t)(nl - p) + 1 : left;
+            if(c->line_start) {
+                if(lines == CONSOLE_IOV_MAX)
+                    return n;
+                out[n].iov_base = stamp;
+                out[n++].iov_len = slen;
+                lines++;
+            }
+            out[n].iov_base = p;
+            out[n++].iov_len = l;
+            c->line_start = (nl != NULL);
+            p += l;
+            left -= l;
         }
     }
-    c->idx_r = loop_add_poll(&loop_default, STDIN_FILENO, events);
+    return n;
 }
 
-static void console_poll_callback(void *opaque)
+/*
+ * stdout shares the O_NONBLOCK file status with a tty stdin, a byte
+ * leaves the fifo only once written, the rest waits for POLLOUT
+ */
+static void console_send_flush(struct console_status_t *c)
 {
-    struct console_status_t *c = (struct console_status_t *)opaque;
-    int revents = loop_get_revents(&loop_default, c->idx_r);
-    if(revents & POLLIN) {
-        int ch;
-        if(read(STDIN_FILENO, &ch, 1) == 1) {
-            if(!console_escape_proc_byte(c, ch))
+    struct iovec iov[2];
+    struct iovec log_iov[CONSOLE_IOV_MAX * 2];
+    char stamp[CONSOLE_STAMP_SIZE];
+    int cnt;
+    while((cnt = console_send_iov(c, iov)) != 0) {
+        size_t len = iov[0].iov_len + (cnt > 1 ? iov[1].iov_len : 0);
+        ssize_t r;
+        if(c->out.fd < 0) {
+            //unix backend without a client
+            __kfifo_out_commit(&c->send, len);
+            continue;
+        }
+        if(c->backend == CONSOLE_FILE) {
+            uint8_t line_start = c->line_start;
+            int n = console_log_iov(c, iov, cnt, stamp, log_iov);
+            r = writev(c->out.fd, log_iov, n);
+            //text bytes written, the stamps do not come from the fifo
+            len = 0;
+            for(int i = 0; i < n && r > 0; i++) {
+                size_t l = (r < (ssize_t)log_iov[i].iov_len) ? (size_t)r : log_iov[i].iov_len;
+                if(log_iov[i].iov_base != stamp)
+                    len += l;
+                r -= l;
+            }
+            if(r < 0)
+                c->line_start = line_start;
+            else
+                r = len;
+        } else {
+            r = writev(c->out.fd, iov, cnt);
+        }
+        if(r < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN) {
+                loop_mod_fd(c->loop, &c->out, POLLOUT);
                 return;
-            while(__kfifo_in(&c->recv, &ch, 1) == 0 && LOOP_IS_RUN(&loop_default)) {
-                poll(NULL, 0, 1);
             }
+            if(c->backend == CONSOLE_UNIX) {
+                console_client_close(c);
+                continue;
+            }
+            /* stdout is gone, drop what is queued */
+            r = len;
         }
+        __kfifo_out_commit(&c->send, r);
     }
-    if(revents & POLLOUT) {
-        int ch;
-        while(__kfifo_out(&c->send, &ch, 1) == 1) {
-            write(STDOUT_FILENO, &ch, 1);
+    loop_mod_fd(c->loop, &c->out, 0);
+}
+
+static void console_flush_timer(void *opaque)
+{
+    struct console_status_t *c = (struct console_status_t *)opaque;
+    if(!c->out.events)
+        console_send_flush(c);
+}
+
+/* cpu thread queued output or read input, the doorbell woke the loop up */
+static void console_prepare_callback(void *opaque)
+{
+    struct console_status_t *c = (struct console_status_t *)opaque;
+    if(c->stdin_blocked && kfifo_unused(&c->recv)) {
+        c->stdin_blocked = 0;
+        loop_mod_fd(c->loop, &c->in, POLLIN);
+    }
+    if(!kfifo_len(&c->send) || c->out.events)
+        return;
+    //let a short burst of output gather, a full half goes out at once
+    if(kfifo_len(&c->send) < CONSOLE_FIFO_SIZE / 2) {
+        if(c->flush_timer->idx < 0)
+            loop_timer_mod(c->loop, c->flush_timer,
+                loop_get_clock_ns(c->loop) + CONSOLE_FLUSH_NS);
+        return;
+    }
+    loop_timer_del(c->loop, c->flush_timer);
+    console_send_flush(c);
+    fflush(stdout);
+}
+
+static void console_stdout_callback(void *opaque, int revents)
+{
+    console_send_flush((struct console_status_t *)opaque);
+}
+
+static void console_stdin_callback(void *opaque, int revents)
+{
+    struct console_status_t *c = (struct console_status_t *)opaque;
+    uint8_t buf[CONSOLE_FIFO_SIZE];
+    /* never read more than the guest can take, the rest stays in the host fd */
+    int r = kfifo_unused(&c->recv);
+    if(r)
+        r = read(c->in.fd, buf, r);
+    else
+        r = -1;
+    if(r == 0 || (r < 0 && c->backend == CONSOLE_UNIX && errno != EAGAIN && errno != EINTR)) {
+        if(c->backend == CONSOLE_UNIX) {
+            console_client_close(c);
+            return;
         }
-        fflush(stdout);
+        /* redirected stdin reached end of file */
+        __atomic_store_n(&c->stdin_eof, 1, __ATOMIC_RELEASE);
+        loop_mod_fd(c->loop, &c->in, 0);
+        return;
+    }
+    int n = 0;
+    for(int i = 0; i < r; i++) {
+        if(console_escape_proc_byte(c, buf[i]))
+            buf[n++] = buf[i];
+    }
+    __kfifo_in(&c->recv, buf, n);
+    if(!kfifo_unused(&c->recv)) {
+        c->stdin_blocked = 1;
+        loop_mod_fd(c->loop, &c->in, 0);
+    }
+}
+
+/* unix backend, a client connected, a second one is turned away */
+static void console_listen_callback(void *opaque, int revents)
+{
+    struct console_status_t *c = (struct console_status_t *)opaque;
+    int fd = accept(c->listen.fd, NULL, NULL);
+    if(fd < 0)
+        return;
+    if(c->in.fd >= 0) {
+        close(fd);
+        return;
     }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    //epoll keeps one entry per fd, the write side gets its own
+    c->in.fd = fd;
+    c->out.fd = dup(fd);
+    c->in.events = POLLIN;
+    c->out.events = 0;
+    if(c->out.fd < 0) {
+        close(fd);
+        c->in.fd = -1;
+        return;
+    }
+    if(loop_add_fd(c->loop, &c->in) < 0 || loop_add_fd(c->loop, &c->out) < 0)
+        console_client_close(c);
 }
 
 
 static const struct loopcb_t loop_console_cb = {
     .prepare = console_prepare_callback,
-    .poll = console_poll_callback,
+    .poll = NULL,
     .timer = NULL,
     .opaque = &con_default,
 };
 
 
-static uint8_t enable_raw_mode(void)
+static int console_stdio_open(struct console_status_t *c)
 {
+    /* stdin may be redirected, e.g. in a cloned machine */
+    stdin_is_tty = isatty(STDIN_FILENO);
+    if(!stdin_is_tty)
+        goto no_tty;
     tcgetattr(STDIN_FILENO, &stdin_orig_termios);
     struct termios term = stdin_orig_termios;
     term.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
@@ -151,27 +421,144 @@ static uint8_t enable_raw_mode(void)
     term.c_lflag &= ~ISIG;
     if(tcsetattr(STDIN_FILENO, TCSANOW, &term) < 0) {
         ERROR_PRINTF("set attr err\n");
-        return 0;
+        return -1;
     }
 
+no_tty:
     conio_oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, conio_oldf | O_NONBLOCK);
+    c->in.fd = STDIN_FILENO;
+    c->out.fd = STDOUT_FILENO;
+    return 0;
+}
+
+static int console_pty_open(struct console_status_t *c)
+{
+    struct termios term;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        ERROR_PRINTF("open pty err\n");
+        goto err;
+    }
+    tcgetattr(fd, &term);
+    cfmakeraw(&term);
+    tcsetattr(fd, TCSANOW, &term);
+    c->pty_slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    if(c->pty_slave < 0) {
+        ERROR_PRINTF("open %s err\n", ptsname(fd));
+        goto err;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    //epoll keeps one entry per fd, the write side gets its own
+    c->in.fd = fd;
+    c->out.fd = dup(fd);
+    if(c->out.fd < 0)
+        goto err;
+    DEBUG_PRINTF("console on %s\n", ptsname(fd));
+    fflush(stdout);
+    return 0;
+err:
+    if(c->pty_slave >= 0)
+        close(c->pty_slave);
+    if(fd >= 0)
+        close(fd);
+    c->in.fd = c->out.fd = c->pty_slave = -1;
+    return -1;
+}
 
-    __kfifo_init(&con_default.recv, con_default.recv_buf, CONSOLE_FIFO_SIZE, 1);
-    __kfifo_init(&con_default.send, con_default.send_buf, CONSOLE_FIFO_SIZE, 1);
-    loop_register(&loop_default, &loop_console_cb);
+static int console_unix_open(struct console_status_t *c)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    memcpy(addr.sun_path, c->path, sizeof(addr.sun_path));
+    unlink(c->path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        ERROR_PRINTF("listen on %s err\n", c->path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    c->listen.fd = fd;
+    c->listen.events = POLLIN;
+    if(loop_add_fd(c->loop, &c->listen) < 0)
+        return -1;
+    c->in.fd = c->out.fd = -1;
+    DEBUG_PRINTF("console on unix:%s\n", c->path);
+    fflush(stdout);
+    return 0;
+}
+
+static int console_file_open(struct console_status_t *c)
+{
+    c->out.fd = open(c->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(c->out.fd < 0) {
+        ERROR_PRINTF("open %s err\n", c->path);
+        return -1;
+    }
+    c->in.fd = -1;
+    c->line_start = 1;
+    DEBUG_PRINTF("console on file:%s\n", c->path);
+    return 0;
+}
+
+static uint8_t enable_raw_mode(void)
+{
+    struct console_status_t *c = &con_default;
+    int r = -1;
+    switch(c->backend) {
+    case CONSOLE_STDIO:
+        r = console_stdio_open(c);
+        break;
+    case CONSOLE_PTY:
+        r = console_pty_open(c);
+        break;
+    case CONSOLE_UNIX:
+        r = console_unix_open(c);
+        break;
+    case CONSOLE_FILE:
+        r = console_file_open(c);
+        break;
+    }
+    if(r < 0)
+        return 0;
+
+    c->stdin_eof = 0;
+    c->stdin_blocked = 0;
+    __kfifo_init(&c->recv, c->recv_buf, CONSOLE_FIFO_SIZE, 1);
+    __kfifo_init(&c->send, c->send_buf, CONSOLE_FIFO_SIZE, 1);
+    c->flush_timer = loop_timer_new(c->loop, console_flush_timer, c);
+    loop_register(c->loop, &loop_console_cb);
+    c->in.events = POLLIN;
+    if(c->in.fd >= 0 && loop_add_fd(c->loop, &c->in) < 0)
+        return 0;
+    c->out.events = 0;
+    if(c->out.fd >= 0 && loop_add_fd(c->loop, &c->out) < 0)
+        return 0;
+    c->stdin_owned = c->backend == CONSOLE_STDIO;
     return 1;
 }
 
 static uint8_t console_readable(void)
 {
-    return (con_default.recv.in != con_default.recv.out);
+    return kfifo_len(&con_default.recv) != 0;
+}
+
+static uint32_t console_read_buf(uint8_t *buf, uint32_t len)
+{
+    len = __kfifo_out(&con_default.recv, buf, len);
+    if(len && __atomic_load_n(&con_default.stdin_blocked, __ATOMIC_RELAXED))
+        loop_notify(con_default.loop);
+    return len;
 }
 
 static uint8_t console_read(void)
 {
-    uint8_t ch;
-    __kfifo_out(&con_default.recv, &ch, 1);
+    uint8_t ch = 0;
+    console_read_buf(&ch, 1);
     return ch;
 }
 
@@ -183,12 +570,100 @@ static uint8_t console_writeable(void)
         return 0;
 }
 
+static void console_match_byte(struct console_status_t *c, uint8_t ch)
+{
+    if(c->match_pattern[c->match_idx] != ch)
+        c->match_idx = 0;
+    if(c->match_pattern[c->match_idx] == ch && !c->match_pattern[++c->match_idx]) {
+        c->match_idx = 0;
+        c->match();
+    }
+}
+
+static uint32_t console_write_buf(const uint8_t *buf, uint32_t len)
+{
+    uint32_t used;
+    len = __kfifo_in(&con_default.send, buf, len);
+    /*
+     * wake the loop for the first bytes, it arms the flush timer, and at
+     * half full. Decided after the push: the loop may have emptied the
+     * fifo meanwhile, then nothing else is queued but these bytes.
+     */
+    used = kfifo_len(&con_default.send);
+    if(used <= len || (used >= CONSOLE_FIFO_SIZE / 2 && used - len < CONSOLE_FIFO_SIZE / 2))
+        loop_notify(con_default.loop);
+    if(con_default.match_pattern) {
+        for(uint32_t i = 0; i < len; i++)
+            console_match_byte(&con_default, buf[i]);
+    }
+    return len;
+}
+
 static uint8_t console_write(uint8_t ch)
 {
-    __kfifo_in(&con_default.send, &ch, 1);
+    console_write_buf(&ch, 1);
+    return 0;
+}
+
+/*
+ * console_backend_select: "stdio", "pty", "unix:<path>" or
+ * "file:<path>", before the console is initialised.
+ */
+int console_backend_select(const char *spec)
+{
+    struct console_status_t *c = &con_default;
+    const char *path = NULL;
+    if(!strcmp(spec, "stdio")) {
+        c->backend = CONSOLE_STDIO;
+    } else if(!strcmp(spec, "pty")) {
+        c->backend = CONSOLE_PTY;
+    } else if(!strncmp(spec, "unix:", 5)) {
+        c->backend = CONSOLE_UNIX;
+        path = spec + 5;
+    } else if(!strncmp(spec, "file:", 5)) {
+        c->backend = CONSOLE_FILE;
+        path = spec + 5;
+    } else {
+        return -1;
+    }
+    if(path) {
+        if(!*path || strlen(path) >= sizeof(c->path))
+            return -1;
+        strcpy(c->path, path);
+    }
     return 0;
 }
 
+/*
+ * console_stdin_read: from cpu thread, for semihosting, wait for bytes
+ * the console took from stdin,
+ * return: bytes read, 0 end of file, -1 the console does not read stdin
+ */
+int console_stdin_read(uint8_t *buf, uint32_t len)
+{
+    struct console_status_t *c = &con_default;
+    if(!c->stdin_owned)
+        return -1;
+    for(;;) {
+        uint8_t eof = __atomic_load_n(&c->stdin_eof, __ATOMIC_ACQUIRE);
+        if(kfifo_len(&c->recv))
+            return console_read_buf(buf, len);
+        if(eof)
+            return 0;
+        usleep(1000);
+    }
+}
+
+/* a cloned machine gets its own socket or log file, "<path>.<id>" */
+void console_fork_child(int id)
+{
+    struct console_status_t *c = &con_default;
+    size_t len = strlen(c->path);
+    if(c->backend != CONSOLE_UNIX && c->backend != CONSOLE_FILE)
+        return;
+    snprintf(c->path + len, sizeof(c->path) - len, ".%d", id);
+}
+
 
 #else /* !USE_UNIX_TERMINAL_API */
 
@@ -224,6 +699,33 @@ static uint8_t console_write(uint8_t ch)
     return putchar(ch);
 }
 
+static uint32_t console_read_buf(uint8_t *buf, uint32_t len)
+{
+    uint32_t n = 0;
+    while(n < len && kbhit())
+        buf[n++] = getch();
+    return n;
+}
+
+static uint32_t console_write_buf(const uint8_t *buf, uint32_t len)
+{
+    return fwrite(buf, 1, len, stdout);
+}
+
+int console_backend_select(const char *spec)
+{
+    return strcmp(spec, "stdio") ? -1 : 0;
+}
+
+int console_stdin_read(uint8_t *buf, uint32_t len)
+{
+    return -1;
+}
+
+void console_fork_child(int id)
+{
+}
+
 #endif /* USE_UNIX_TERMINAL_API */
 
 
@@ -236,10 +738,15 @@ const static struct charwr_interface console_interface = {
     .read = console_read,
     .writeable = console_writeable,
     .write = console_write,
+    .read_buf = console_read_buf,
+    .write_buf = console_write_buf,
 };
 
-int console_register(const struct charwr_interface **interface)
+int console_register(const struct charwr_interface **interface, struct loop_t *lo)
 {
+#ifdef USE_UNIX_TERMINAL_API
+    con_default.loop = lo;
+#endif
     *interface = &console_interface;
     return 0;
 }
@@ -248,4 +755,15 @@ void console_term_register(int (*term)(uint8_t escape_char, uint8_t ch))
 {
     con_default.term = term;
 }
+
+/*
+ * console_match_register: call match() from cpu thread each time
+ * the guest prints pattern, pattern = NULL disables the watch.
+ */
+void console_match_register(const char *pattern, void (*match)(void))
+{
+    con_default.match_idx = 0;
+    con_default.match = match;
+    con_default.match_pattern = (pattern && *pattern) ? pattern : NULL;
+}
 /*****************************END OF FILE***************************/
@@ -22,8 +22,12 @@
 #include <stdint.h>
 #include <peripheral.h>
 
-int console_register(const struct charwr_interface **interface);
+int console_register(const struct charwr_interface **interface, struct loop_t *lo);
 void console_term_register(int (*term)(uint8_t escape_char, uint8_t ch));
+void console_match_register(const char *pattern, void (*match)(void));
+int console_backend_select(const char *spec);
+void console_fork_child(int id);
+int console_stdin_read(uint8_t *buf, uint32_t len);
 
 #endif
 /*****************************END OF FILE***************************/
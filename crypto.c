@@ -0,0 +1,902 @@
+/*
+ * crypto.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <string.h>
+#include <pthread.h>
+#include <crypto.h>
+#include <config.h>
+
+#ifdef USE_X86_CRYPTO_SUPPORT
+#include <immintrin.h>
+#include <cpuid.h>
+#ifndef bit_SHA
+#define bit_SHA   (1 << 29)
+#endif
+#define X86_TARGET(s)   __attribute__((target(s)))
+#endif
+
+/*
+ * Primitives for the crypto device. Every algorithm has a portable
+ * version, on x86 AES-NI, PCLMULQDQ and SHA-NI are used when the host
+ * cpu has them, the choice is made once at the first call.
+ */
+
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+static uint8_t has_aesni = 0;
+static uint8_t has_pclmul = 0;
+static uint8_t has_shani = 0;
+static char accel_str[32] = "";
+static uint32_t crc32_table[8][256];
+
+
+static void crypto_init(void)
+{
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for(uint32_t i = 0; i < 256; i++) {
+        for(int t = 1; t < 8; t++) {
+            uint32_t c = crc32_table[t - 1][i];
+            crc32_table[t][i] = (c >> 8) ^ crc32_table[0][c & 0xff];
+        }
+    }
+#ifdef USE_X86_CRYPTO_SUPPORT
+    unsigned int a, b, c, d;
+    if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1)) {
+        has_aesni = (c & bit_AES) ? 1 : 0;
+        has_pclmul = (c & bit_PCLMUL) ? 1 : 0;
+        if(__get_cpuid_count(7, 0, &a, &b, &c, &d))
+            has_shani = (b & bit_SHA) ? 1 : 0;
+    }
+#endif
+    strcat(accel_str, has_aesni ? "aes " : "");
+    strcat(accel_str, has_pclmul ? "pclmul " : "");
+    strcat(accel_str, has_shani ? "sha " : "");
+    strcat(accel_str, accel_str[0] ? "" : "none");
+}
+
+
+const char *crypto_accel(void)
+{
+    pthread_once(&crypto_once, crypto_init);
+    return accel_str;
+}
+
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+    return (uint64_t)load_be32(p) << 32 | load_be32(p + 4);
+}
+
+
+static inline void store_be64(uint8_t *p, uint64_t v)
+{
+    store_be32(p, v >> 32);
+    store_be32(p + 4, v);
+}
+
+
+static inline void xor_block(uint8_t *d, const uint8_t *a, const uint8_t *b)
+{
+    for(int i = 0; i < AES_BLOCK_SIZE; i++)
+        d[i] = a[i] ^ b[i];
+}
+
+
+/* increment the last n bytes as a big endian counter */
+static inline void ctr_inc(uint8_t *ctr, int n)
+{
+    for(int i = AES_BLOCK_SIZE - 1; i >= AES_BLOCK_SIZE - n; i--) {
+        if(++ctr[i])
+            break;
+    }
+}
+
+
+/******************************aes*****************************************/
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t aes_inv_sbox[256] = {
+    0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+    0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+    0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+    0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+    0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+    0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+    0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+    0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+    0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+    0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+    0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+    0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+    0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+    0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+    0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+
+static inline uint8_t xtime(uint8_t a)
+{
+    return (a << 1) ^ ((a & 0x80) ? 0x1b : 0);
+}
+
+
+static inline uint8_t gmul(uint8_t a, uint8_t b)
+{
+    uint8_t r = 0;
+    while(b) {
+        if(b & 1)
+            r ^= a;
+        a = xtime(a);
+        b >>= 1;
+    }
+    return r;
+}
+
+
+/* state is column major, s[row + 4 * column] */
+static void aes_encrypt_block(const struct aes_key_t *k, const uint8_t *in, uint8_t *out)
+{
+    uint8_t s[16], t[16];
+    xor_block(s, in, k->rk);
+    for(int r = 1; r <= k->rounds; r++) {
+        //SubBytes, ShiftRows
+        for(int c = 0; c < 4; c++)
+            for(int i = 0; i < 4; i++)
+                t[i + 4 * c] = aes_sbox[s[i + 4 * ((c + i) & 3)]];
+        if(r == k->rounds) {
+            xor_block(out, t, k->rk + 16 * r);
+            return;
+        }
+        //MixColumns
+        for(int c = 0; c < 4; c++) {
+            uint8_t *a = t + 4 * c;
+            uint8_t x = a[0] ^ a[1] ^ a[2] ^ a[3];
+            s[4 * c + 0] = a[0] ^ x ^ xtime(a[0] ^ a[1]);
+            s[4 * c + 1] = a[1] ^ x ^ xtime(a[1] ^ a[2]);
+            s[4 * c + 2] = a[2] ^ x ^ xtime(a[2] ^ a[3]);
+            s[4 * c + 3] = a[3] ^ x ^ xtime(a[3] ^ a[0]);
+        }
+        xor_block(s, s, k->rk + 16 * r);
+    }
+}
+
+
+static void aes_decrypt_block(const struct aes_key_t *k, const uint8_t *in, uint8_t *out)
+{
+    uint8_t s[16], t[16];
+    xor_block(s, in, k->rk + 16 * k->rounds);
+    for(int r = k->rounds - 1; r >= 0; r--) {
+        //InvShiftRows, InvSubBytes
+        for(int c = 0; c < 4; c++)
+            for(int i = 0; i < 4; i++)
+                t[i + 4 * ((c + i) & 3)] = aes_inv_sbox[s[i + 4 * c]];
+        xor_block(t, t, k->rk + 16 * r);
+        if(r == 0) {
+            memcpy(out, t, 16);
+            return;
+        }
+        //InvMixColumns
+        for(int c = 0; c < 4; c++) {
+            uint8_t *a = t + 4 * c;
+            s[4 * c + 0] = gmul(a[0], 14) ^ gmul(a[1], 11) ^ gmul(a[2], 13) ^ gmul(a[3], 9);
+            s[4 * c + 1] = gmul(a[0], 9) ^ gmul(a[1], 14) ^ gmul(a[2], 11) ^ gmul(a[3], 13);
+            s[4 * c + 2] = gmul(a[0], 13) ^ gmul(a[1], 9) ^ gmul(a[2], 14) ^ gmul(a[3], 11);
+            s[4 * c + 3] = gmul(a[0], 11) ^ gmul(a[1], 13) ^ gmul(a[2], 9) ^ gmul(a[3], 14);
+        }
+    }
+}
+
+
+#ifdef USE_X86_CRYPTO_SUPPORT
+static X86_TARGET("aes,sse4.1") void aesni_decrypt_keys(struct aes_key_t *k)
+{
+    int n = k->rounds;
+    _mm_storeu_si128((__m128i *)k->drk, _mm_loadu_si128((const __m128i *)(k->rk + 16 * n)));
+    for(int i = 1; i < n; i++)
+        _mm_storeu_si128((__m128i *)(k->drk + 16 * i),
+         _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)(k->rk + 16 * (n - i)))));
+    _mm_storeu_si128((__m128i *)(k->drk + 16 * n), _mm_loadu_si128((const __m128i *)k->rk));
+}
+
+
+static inline X86_TARGET("aes,sse4.1") void aesni_load_keys(__m128i *key, const uint8_t *rk, int n)
+{
+    for(int i = 0; i <= n; i++)
+        key[i] = _mm_loadu_si128((const __m128i *)(rk + 16 * i));
+}
+
+
+static inline X86_TARGET("aes,sse4.1") __m128i aesni_enc(const __m128i *key, int n, __m128i b)
+{
+    b = _mm_xor_si128(b, key[0]);
+    for(int i = 1; i < n; i++)
+        b = _mm_aesenc_si128(b, key[i]);
+    return _mm_aesenclast_si128(b, key[n]);
+}
+
+
+/* four blocks at a time keep the AES units busy */
+static inline X86_TARGET("aes,sse4.1") void aesni_enc4(const __m128i *key, int n, __m128i *b)
+{
+    for(int j = 0; j < 4; j++)
+        b[j] = _mm_xor_si128(b[j], key[0]);
+    for(int i = 1; i < n; i++)
+        for(int j = 0; j < 4; j++)
+            b[j] = _mm_aesenc_si128(b[j], key[i]);
+    for(int j = 0; j < 4; j++)
+        b[j] = _mm_aesenclast_si128(b[j], key[n]);
+}
+
+
+static inline X86_TARGET("aes,sse4.1") void aesni_dec4(const __m128i *key, int n, __m128i *b)
+{
+    for(int j = 0; j < 4; j++)
+        b[j] = _mm_xor_si128(b[j], key[0]);
+    for(int i = 1; i < n; i++)
+        for(int j = 0; j < 4; j++)
+            b[j] = _mm_aesdec_si128(b[j], key[i]);
+    for(int j = 0; j < 4; j++)
+        b[j] = _mm_aesdeclast_si128(b[j], key[n]);
+}
+
+
+static X86_TARGET("aes,sse4.1") void aesni_cbc_encrypt(const struct aes_key_t *k, uint8_t *iv,
+ const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i key[AES_ROUNDS_MAX + 1];
+    __m128i v = _mm_loadu_si128((const __m128i *)iv);
+    aesni_load_keys(key, k->rk, k->rounds);
+    for(; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        v = aesni_enc(key, k->rounds, _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)in)));
+        _mm_storeu_si128((__m128i *)out, v);
+    }
+    _mm_storeu_si128((__m128i *)iv, v);
+}
+
+
+static X86_TARGET("aes,sse4.1") void aesni_cbc_decrypt(const struct aes_key_t *k, uint8_t *iv,
+ const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i key[AES_ROUNDS_MAX + 1];
+    __m128i v = _mm_loadu_si128((const __m128i *)iv);
+    aesni_load_keys(key, k->drk, k->rounds);
+    while(len >= AES_BLOCK_SIZE) {
+        int n = len >= 4 * AES_BLOCK_SIZE ? 4 : 1;
+        __m128i c[4], b[4];
+        for(int j = 0; j < n; j++)
+            b[j] = c[j] = _mm_loadu_si128((const __m128i *)(in + 16 * j));
+        if(n == 4) {
+            aesni_dec4(key, k->rounds, b);
+        } else {
+            b[0] = _mm_xor_si128(b[0], key[0]);
+            for(int i = 1; i < k->rounds; i++)
+                b[0] = _mm_aesdec_si128(b[0], key[i]);
+            b[0] = _mm_aesdeclast_si128(b[0], key[k->rounds]);
+        }
+        for(int j = 0; j < n; j++) {
+            _mm_storeu_si128((__m128i *)(out + 16 * j), _mm_xor_si128(b[j], v));
+            v = c[j];
+        }
+        in += 16 * n;
+        out += 16 * n;
+        len -= 16 * n;
+    }
+    _mm_storeu_si128((__m128i *)iv, v);
+}
+
+
+static X86_TARGET("aes,sse4.1") void aesni_ctr(const struct aes_key_t *k, uint8_t *ctr, int inc,
+ const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i key[AES_ROUNDS_MAX + 1];
+    aesni_load_keys(key, k->rk, k->rounds);
+    while(len) {
+        uint8_t blk[4 * AES_BLOCK_SIZE];
+        __m128i b[4];
+        size_t n = len < sizeof(blk) ? len : sizeof(blk);
+        for(int j = 0; j < 4; j++) {
+            b[j] = _mm_loadu_si128((const __m128i *)ctr);
+            ctr_inc(ctr, inc);
+        }
+        aesni_enc4(key, k->rounds, b);
+        if(n == sizeof(blk)) {
+            for(int j = 0; j < 4; j++)
+                _mm_storeu_si128((__m128i *)(out + 16 * j),
+                 _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)(in + 16 * j))));
+        } else {
+            //tail, counters past it are given back
+            for(int j = 0; j < 4; j++)
+                _mm_storeu_si128((__m128i *)(blk + 16 * j), b[j]);
+            for(size_t i = 0; i < n; i++)
+                out[i] = in[i] ^ blk[i];
+            memcpy(blk, ctr, AES_BLOCK_SIZE);
+            for(size_t j = (n + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE; j < 4; j++) {
+                for(int i = AES_BLOCK_SIZE - 1; i >= AES_BLOCK_SIZE - inc; i--) {
+                    if(ctr[i]--)
+                        break;
+                }
+            }
+        }
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+#endif
+
+
+int aes_setkey(struct aes_key_t *k, const uint8_t *key, int len)
+{
+    static const uint8_t rcon[11] = {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+    int nk = len / 4;
+    uint8_t *w = k->rk;
+
+    pthread_once(&crypto_once, crypto_init);
+    if(len != 16 && len != 24 && len != 32)
+        return -1;
+    k->rounds = nk + 6;
+    memcpy(w, key, len);
+    for(int i = nk; i < 4 * (k->rounds + 1); i++) {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if(i % nk == 0) {
+            uint8_t t0 = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon[i / nk];
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[t0];
+        } else if(nk > 6 && i % nk == 4) {
+            for(int j = 0; j < 4; j++)
+                t[j] = aes_sbox[t[j]];
+        }
+        for(int j = 0; j < 4; j++)
+            w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+    }
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_aesni)
+        aesni_decrypt_keys(k);
+#endif
+    return 0;
+}
+
+
+void aes_cbc_encrypt(const struct aes_key_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len)
+{
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_aesni) {
+        aesni_cbc_encrypt(k, iv, in, out, len);
+        return;
+    }
+#endif
+    for(; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        xor_block(iv, iv, in);
+        aes_encrypt_block(k, iv, iv);
+        memcpy(out, iv, AES_BLOCK_SIZE);
+    }
+}
+
+
+void aes_cbc_decrypt(const struct aes_key_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len)
+{
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_aesni) {
+        aesni_cbc_decrypt(k, iv, in, out, len);
+        return;
+    }
+#endif
+    for(; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        uint8_t c[AES_BLOCK_SIZE], p[AES_BLOCK_SIZE];
+        memcpy(c, in, AES_BLOCK_SIZE);
+        aes_decrypt_block(k, c, p);
+        xor_block(out, p, iv);
+        memcpy(iv, c, AES_BLOCK_SIZE);
+    }
+}
+
+
+/* inc: counter bytes, 16 for CTR mode, 4 for GCM */
+static void aes_ctr_inc(const struct aes_key_t *k, uint8_t *ctr, int inc,
+ const uint8_t *in, uint8_t *out, size_t len)
+{
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_aesni) {
+        aesni_ctr(k, ctr, inc, in, out, len);
+        return;
+    }
+#endif
+    while(len) {
+        uint8_t ks[AES_BLOCK_SIZE];
+        size_t n = len < AES_BLOCK_SIZE ? len : AES_BLOCK_SIZE;
+        aes_encrypt_block(k, ctr, ks);
+        ctr_inc(ctr, inc);
+        for(size_t i = 0; i < n; i++)
+            out[i] = in[i] ^ ks[i];
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+
+void aes_ctr(const struct aes_key_t *k, uint8_t *ctr, const uint8_t *in, uint8_t *out, size_t len)
+{
+    aes_ctr_inc(k, ctr, AES_BLOCK_SIZE, in, out, len);
+}
+
+
+/******************************gcm*****************************************/
+struct ghash_t {
+    uint8_t h[AES_BLOCK_SIZE];
+    uint8_t x[AES_BLOCK_SIZE];
+    uint64_t hh[16];          //4 bit multiples of h, portable version
+    uint64_t hl[16];
+};
+
+
+/* multiples of h for every 4 bit value, bit 0 is the msb of byte 0 */
+static void ghash_table(struct ghash_t *g)
+{
+    uint64_t vh = load_be64(g->h), vl = load_be64(g->h + 8);
+    g->hh[0] = g->hl[0] = 0;
+    g->hh[8] = vh;
+    g->hl[8] = vl;
+    for(int i = 4; i > 0; i >>= 1) {
+        uint64_t lsb = vl & 1;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (lsb ? 0xe100000000000000ULL : 0);
+        g->hh[i] = vh;
+        g->hl[i] = vl;
+    }
+    for(int i = 2; i <= 8; i <<= 1) {
+        for(int j = 1; j < i; j++) {
+            g->hh[i + j] = g->hh[i] ^ g->hh[j];
+            g->hl[i + j] = g->hl[i] ^ g->hl[j];
+        }
+    }
+}
+
+
+/* x = x * h in GF(2^128), four bits at a time, Shoup's method */
+static void ghash_mul(struct ghash_t *g)
+{
+    static const uint64_t last4[16] = {
+        0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+        0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0,
+    };
+    uint8_t *x = g->x;
+    uint64_t zh = 0, zl = 0;
+    for(int i = 15; i >= 0; i--) {
+        for(int nibble = 0; nibble < 2; nibble++) {
+            uint8_t v = nibble ? x[i] >> 4 : x[i] & 0xf;
+            if(i != 15 || nibble) {
+                uint8_t rem = zl & 0xf;
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (last4[rem] << 48);
+            }
+            zh ^= g->hh[v];
+            zl ^= g->hl[v];
+        }
+    }
+    store_be64(x, zh);
+    store_be64(x + 8, zl);
+}
+
+
+#ifdef USE_X86_CRYPTO_SUPPORT
+/* carry-less multiply and reduce, operands byte reflected, Intel GCM white paper */
+static inline X86_TARGET("pclmul,sse4.1") __m128i clmul_gfmul(__m128i a, __m128i b)
+{
+    __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+    t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    t6 = _mm_clmulepi64_si128(a, b, 0x11);
+    t4 = _mm_xor_si128(t4, t5);
+    t5 = _mm_slli_si128(t4, 8);
+    t4 = _mm_srli_si128(t4, 8);
+    t3 = _mm_xor_si128(t3, t5);
+    t6 = _mm_xor_si128(t6, t4);
+    //shift the 256 bit product left by one
+    t7 = _mm_srli_epi32(t3, 31);
+    t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+    //reduce modulo x^128 + x^7 + x^2 + x + 1
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+    t2 = _mm_srli_epi32(t3, 1);
+    t4 = _mm_srli_epi32(t3, 2);
+    t5 = _mm_srli_epi32(t3, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+
+static X86_TARGET("pclmul,sse4.1") void clmul_ghash(struct ghash_t *g, const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)g->h), bswap);
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)g->x), bswap);
+    for(; blocks; blocks--, data += AES_BLOCK_SIZE)
+        x = clmul_gfmul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap)), h);
+    _mm_storeu_si128((__m128i *)g->x, _mm_shuffle_epi8(x, bswap));
+}
+#endif
+
+
+/* a partial last block is padded with zeros */
+static void ghash_update(struct ghash_t *g, const uint8_t *data, size_t len)
+{
+    size_t blocks = len / AES_BLOCK_SIZE;
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_pclmul) {
+        clmul_ghash(g, data, blocks);
+    } else
+#endif
+    for(size_t i = 0; i < blocks; i++) {
+        xor_block(g->x, g->x, data + AES_BLOCK_SIZE * i);
+        ghash_mul(g);
+    }
+    len -= blocks * AES_BLOCK_SIZE;
+    if(len) {
+        uint8_t pad[AES_BLOCK_SIZE] = {0};
+        memcpy(pad, data + blocks * AES_BLOCK_SIZE, len);
+        ghash_update(g, pad, AES_BLOCK_SIZE);
+    }
+}
+
+
+#define GCM_CHUNK   (4096)  /* hash and encrypt in steps, in may be out */
+
+int aes_gcm(const struct aes_key_t *k, const uint8_t *iv, size_t iv_len,
+ const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+ uint8_t *tag, int decrypt)
+{
+    struct ghash_t g;
+    uint8_t j0[AES_BLOCK_SIZE], ctr[AES_BLOCK_SIZE], s[AES_BLOCK_SIZE], lens[AES_BLOCK_SIZE];
+
+    memset(&g, 0, sizeof(g));
+    memset(j0, 0, sizeof(j0));
+    aes_ctr_inc(k, j0, AES_BLOCK_SIZE, g.x, g.h, AES_BLOCK_SIZE); //H = E(K, 0)
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(!has_pclmul)
+#endif
+    ghash_table(&g);
+    memset(j0, 0, sizeof(j0));
+    if(iv_len == 12) {
+        memcpy(j0, iv, 12);
+        j0[15] = 1;
+    } else {
+        ghash_update(&g, iv, iv_len);
+        store_be64(lens, 0);
+        store_be64(lens + 8, (uint64_t)iv_len * 8);
+        ghash_update(&g, lens, AES_BLOCK_SIZE);
+        memcpy(j0, g.x, AES_BLOCK_SIZE);
+        memset(g.x, 0, AES_BLOCK_SIZE);
+    }
+
+    ghash_update(&g, aad, aad_len);
+    memcpy(ctr, j0, AES_BLOCK_SIZE);
+    ctr_inc(ctr, 4);
+    for(size_t off = 0; off < len; off += GCM_CHUNK) {
+        size_t n = len - off < GCM_CHUNK ? len - off : GCM_CHUNK;
+        if(decrypt)
+            ghash_update(&g, in + off, n);
+        aes_ctr_inc(k, ctr, 4, in + off, out + off, n);
+        if(!decrypt)
+            ghash_update(&g, out + off, n);
+    }
+    store_be64(lens, (uint64_t)aad_len * 8);
+    store_be64(lens + 8, (uint64_t)len * 8);
+    ghash_update(&g, lens, AES_BLOCK_SIZE);
+    aes_ctr_inc(k, j0, 4, g.x, s, AES_BLOCK_SIZE);
+
+    if(!decrypt) {
+        memcpy(tag, s, GCM_TAG_SIZE);
+        return 0;
+    }
+    uint8_t diff = 0;
+    for(int i = 0; i < GCM_TAG_SIZE; i++)
+        diff |= s[i] ^ tag[i];
+    if(diff) {
+        memset(out, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************sha*****************************************/
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x,n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROL32(x,n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_blocks(uint32_t *st, const uint8_t *p, size_t blocks)
+{
+    for(; blocks; blocks--, p += 64) {
+        uint32_t w[80];
+        uint32_t a = st[0], b = st[1], c = st[2], d = st[3], e = st[4];
+        for(int i = 0; i < 16; i++)
+            w[i] = load_be32(p + 4 * i);
+        for(int i = 16; i < 80; i++)
+            w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        for(int i = 0; i < 80; i++) {
+            uint32_t f, kt;
+            if(i < 20) {
+                f = (b & c) | (~b & d);
+                kt = 0x5a827999;
+            } else if(i < 40) {
+                f = b ^ c ^ d;
+                kt = 0x6ed9eba1;
+            } else if(i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                kt = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                kt = 0xca62c1d6;
+            }
+            uint32_t t = ROL32(a, 5) + f + e + kt + w[i];
+            e = d;
+            d = c;
+            c = ROL32(b, 30);
+            b = a;
+            a = t;
+        }
+        st[0] += a;
+        st[1] += b;
+        st[2] += c;
+        st[3] += d;
+        st[4] += e;
+    }
+}
+
+
+static void sha256_blocks(uint32_t *st, const uint8_t *p, size_t blocks)
+{
+    for(; blocks; blocks--, p += 64) {
+        uint32_t w[64];
+        uint32_t a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7];
+        for(int i = 0; i < 16; i++)
+            w[i] = load_be32(p + 4 * i);
+        for(int i = 16; i < 64; i++) {
+            uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        for(int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        st[0] += a;
+        st[1] += b;
+        st[2] += c;
+        st[3] += d;
+        st[4] += e;
+        st[5] += f;
+        st[6] += g;
+        st[7] += h;
+    }
+}
+
+
+#ifdef USE_X86_CRYPTO_SUPPORT
+static X86_TARGET("sha,sse4.1") void shani_sha1_blocks(uint32_t *st, const uint8_t *p, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)st), 0x1b);
+    __m128i e0 = _mm_set_epi32(st[4], 0, 0, 0);
+    for(; blocks; blocks--, p += 64) {
+        __m128i abcd_save = abcd, e0_save = e0;
+        __m128i w[4], e[2];
+        for(int i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+        e[0] = e0;
+        //four rounds per step, e of a step is a of four rounds before
+        for(int g = 0; g < 20; g++) {
+            if(g == 0)
+                e[0] = _mm_add_epi32(e[0], w[0]);
+            else
+                e[g & 1] = _mm_sha1nexte_epu32(e[g & 1], w[g & 3]);
+            e[(g + 1) & 1] = abcd;
+            switch(g / 5) {
+            case 0: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 0); break;
+            case 1: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 1); break;
+            case 2: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 2); break;
+            default: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 3); break;
+            }
+            if(g < 16)
+                w[g & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+                 w[(g + 2) & 3]), w[(g + 3) & 3]);
+        }
+        e0 = _mm_sha1nexte_epu32(e[0], e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    _mm_storeu_si128((__m128i *)st, _mm_shuffle_epi32(abcd, 0x1b));
+    st[4] = _mm_extract_epi32(e0, 3);
+}
+
+
+static X86_TARGET("sha,sse4.1") void shani_sha256_blocks(uint32_t *st, const uint8_t *p, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)st), 0xb1);         //cdab
+    __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(st + 4)), 0x1b); //efgh
+    __m128i s0 = _mm_alignr_epi8(t, s1, 8);                                          //abef
+    s1 = _mm_blend_epi16(s1, t, 0xf0);                                               //cdgh
+    for(; blocks; blocks--, p += 64) {
+        __m128i s0_save = s0, s1_save = s1;
+        __m128i w[4];
+        for(int i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+        for(int g = 0; g < 16; g++) {
+            __m128i m = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, m);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(m, 0x0e));
+            if(g < 12) {
+                __m128i x = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(x, w[(g + 3) & 3]);
+            }
+        }
+        s0 = _mm_add_epi32(s0, s0_save);
+        s1 = _mm_add_epi32(s1, s1_save);
+    }
+    t = _mm_shuffle_epi32(s0, 0x1b);                                                 //feba
+    s1 = _mm_shuffle_epi32(s1, 0xb1);                                                //dchg
+    _mm_storeu_si128((__m128i *)st, _mm_blend_epi16(t, s1, 0xf0));                    //dcba
+    _mm_storeu_si128((__m128i *)(st + 4), _mm_alignr_epi8(s1, t, 8));                 //hgfe
+}
+#endif
+
+
+/* Merkle-Damgard padding, 64 byte blocks, big endian bit length */
+static void sha_digest(uint32_t *st, int words, void (* blocks)(uint32_t *, const uint8_t *, size_t),
+ const uint8_t *in, size_t len, uint8_t *digest)
+{
+    uint8_t tail[128];
+    size_t full = len / 64;
+    size_t rest = len - full * 64;
+    size_t n = rest < 56 ? 64 : 128;
+
+    blocks(st, in, full);
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, in + full * 64, rest);
+    tail[rest] = 0x80;
+    store_be64(tail + n - 8, (uint64_t)len * 8);
+    blocks(st, tail, n / 64);
+    for(int i = 0; i < words; i++)
+        store_be32(digest + 4 * i, st[i]);
+}
+
+
+void sha1(const uint8_t *in, size_t len, uint8_t *digest)
+{
+    uint32_t st[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    void (* blocks)(uint32_t *, const uint8_t *, size_t) = sha1_blocks;
+    pthread_once(&crypto_once, crypto_init);
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_shani)
+        blocks = shani_sha1_blocks;
+#endif
+    sha_digest(st, 5, blocks, in, len, digest);
+}
+
+
+void sha256(const uint8_t *in, size_t len, uint8_t *digest)
+{
+    uint32_t st[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    void (* blocks)(uint32_t *, const uint8_t *, size_t) = sha256_blocks;
+    pthread_once(&crypto_once, crypto_init);
+#ifdef USE_X86_CRYPTO_SUPPORT
+    if(has_shani)
+        blocks = shani_sha256_blocks;
+#endif
+    sha_digest(st, 8, blocks, in, len, digest);
+}
+
+
+/******************************crc32*****************************************/
+/* slicing by 8, eight table lookups per 8 bytes */
+uint32_t crc32_ieee(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    pthread_once(&crypto_once, crypto_init);
+    crc = ~crc;
+    for(; len >= 8; len -= 8, buf += 8) {
+        uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+         crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+         crc32_table[3][buf[4]] ^ crc32_table[2][buf[5]] ^
+         crc32_table[1][buf[6]] ^ crc32_table[0][buf[7]];
+    }
+    for(; len; len--)
+        crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*****************************END OF FILE***************************/
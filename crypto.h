@@ -0,0 +1,62 @@
+/*
+ * crypto.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _CRYPTO_H_
+#define _CRYPTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AES_BLOCK_SIZE       (16)
+#define AES_ROUNDS_MAX       (14)
+#define SHA1_DIGEST_SIZE     (20)
+#define SHA256_DIGEST_SIZE   (32)
+#define GCM_TAG_SIZE         (16)
+
+/* round keys in the byte order of FIPS-197, as AES-NI takes them */
+struct aes_key_t {
+    uint8_t rk[(AES_ROUNDS_MAX + 1) * AES_BLOCK_SIZE];
+    uint8_t drk[(AES_ROUNDS_MAX + 1) * AES_BLOCK_SIZE]; //AES-NI decryption keys
+    int rounds;
+};
+
+/* len: 16, 24 or 32, return: 0 done, -1 bad length */
+int aes_setkey(struct aes_key_t *k, const uint8_t *key, int len);
+/* len is a multiple of 16, in may be out, iv is updated for the next call */
+void aes_cbc_encrypt(const struct aes_key_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len);
+void aes_cbc_decrypt(const struct aes_key_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len);
+/* 128 bit big endian counter, updated past the last block used */
+void aes_ctr(const struct aes_key_t *k, uint8_t *ctr, const uint8_t *in, uint8_t *out, size_t len);
+/*
+ * aes_gcm: encrypt and write tag, or decrypt and check tag, in may be out,
+ * return: 0 done, -1 tag mismatch, out is cleared
+ */
+int aes_gcm(const struct aes_key_t *k, const uint8_t *iv, size_t iv_len,
+ const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+ uint8_t *tag, int decrypt);
+
+void sha1(const uint8_t *in, size_t len, uint8_t *digest);
+void sha256(const uint8_t *in, size_t len, uint8_t *digest);
+/* IEEE 802.3, as zlib crc32(): start with 0, chain with the last result */
+uint32_t crc32_ieee(uint32_t crc, const uint8_t *buf, size_t len);
+
+/* host instructions in use, e.g. "aes pclmul sha" */
+const char *crypto_accel(void);
+
+#endif
+/*****************************END OF FILE***************************/
@@ -23,11 +23,20 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <sys/wait.h>
 #include <console.h>
 #include <slip_tun.h>
 #include <slip_user.h>
 #include <config.h>
 #include <loop.h>
+#include <migration.h>
+#include <ksm.h>
+#include <semihost.h>
+#include <batch.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #define LOG_NAME   "emulator"
 #define PRINTF(...)           printf(LOG_NAME ": " __VA_ARGS__)
@@ -40,6 +49,7 @@
 #define USE_LINUX          0
 #define USE_BINARY         1
 #define USE_DISASSEMBLY    2
+#define USE_INCOMING       3
 
 #define USE_NET_USER       0
 #define USE_NET_TUN        1
@@ -55,6 +65,25 @@
 
 static uint8_t step_by_step = 0;
 
+#define CLONE_LOG_FORMAT      "clone%d.log"
+#define CLONE_DEFAULT_PATTERN "login:"
+
+static int clone_number = 0;
+static uint8_t ksm_enable = 0;
+static uint8_t nic_enable = 0;
+static uint8_t semihost_enable = 0;
+
+/* requests to the cpu thread, served between two instructions */
+#define VM_REQUEST_CLONE      (1 << 0)
+#define VM_REQUEST_MIGRATE    (1 << 1)
+#define VM_REQUEST_BUDGET     (1 << 2)
+static volatile uint8_t vm_request = 0;
+
+/* -L, the run stops with RUN_BUDGET_STATUS, as timeout(1) */
+#define RUN_BUDGET_STATUS     (124)
+static uint64_t run_budget_insns = 0;
+static int64_t run_budget_ns = 0;
+
 
 //peripheral register
 struct peripheral_t peripheral_reg_base = {
@@ -65,12 +94,52 @@ struct peripheral_t peripheral_reg_base = {
         {
             .interrupt_id = 1,
             .interface_register_cb = console_register,
+            .loop = &loop_default,
         },
         {
             .interrupt_id = 2,
             .interface_register_cb = slip_user_register,
+            .loop = &loop_net,
         },
     },
+    .balloon = {
+        .interrupt_id = 3,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+    },
+    .nic = {
+        .interrupt_id = 4,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+        .loop = &loop_net,
+    },
+    .blk = {
+        .interrupt_id = 5,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+        .fs = &peripheral_reg_base.fs,
+    },
+    .dma = {
+        .interrupt_id = 6,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+        .fs = &peripheral_reg_base.fs,
+    },
+    .crypto = {
+        .interrupt_id = 7,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+    },
+    .rng = {
+        .interrupt_id = 8,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+    },
+    .share = {
+        .interrupt_id = 9,
+        .irq_req = &peripheral_reg_base.irq_req,
+        .mem = &peripheral_reg_base.mem,
+    },
 };
 
 #define SIZEOF_PERIPHERAL_CONFIG(cfg)    (sizeof(cfg)/sizeof(struct peripheral_link_t))
@@ -129,7 +198,79 @@ struct peripheral_link_t peripheral_config[] = {
         .reset = uart_8250_reset,
         .read = uart_8250_read,
         .write = uart_8250_write,
-    }
+    },
+    {
+        .name = "Balloon",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021000,
+        .reg_base = &peripheral_reg_base.balloon,
+        .reset = balloon_reset,
+        .read = balloon_read,
+        .write = balloon_write,
+    },
+    {
+        .name = "Nic",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021100,
+        .reg_base = &peripheral_reg_base.nic,
+        .reset = nic_reset,
+        .read = nic_read,
+        .write = nic_write,
+    },
+    {
+        .name = "Blk",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021200,
+        .reg_base = &peripheral_reg_base.blk,
+        .reset = blk_reset,
+        .read = blk_read,
+        .write = blk_write,
+    },
+    {
+        .name = "Dma",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021300,
+        .reg_base = &peripheral_reg_base.dma,
+        .reset = dma_reset,
+        .read = dma_read,
+        .write = dma_write,
+    },
+    {
+        .name = "Crypto",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021400,
+        .reg_base = &peripheral_reg_base.crypto,
+        .reset = crypto_reset,
+        .read = crypto_read,
+        .write = crypto_write,
+    },
+    {
+        .name = "Rng",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021500,
+        .reg_base = &peripheral_reg_base.rng,
+        .reset = rng_reset,
+        .read = rng_read,
+        .write = rng_write,
+    },
+    {
+        .name = "Share",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021600,
+        .reg_base = &peripheral_reg_base.share,
+        .reset = share_reset,
+        .read = share_read,
+        .write = share_write,
+    },
+    {
+        .name = "Power",
+        .mask = ~(256-1), //8bit
+        .prefix = 0x40021700,
+        .reg_base = &peripheral_reg_base.power,
+        .reset = power_reset,
+        .read = power_read,
+        .write = power_write,
+    },
 };
 
 /* from loop thread */
@@ -141,6 +282,9 @@ static int term_process(uint8_t escape_char, uint8_t ch)
         step_by_step = 1;
         PRINTF("[%s] step by step mode\n", step_by_step ? "x" : " ");
         break;
+    case 'm':
+        migration_start();
+        break;
     case 'd':
     case 'g':
     case 'p':
@@ -152,6 +296,7 @@ static int term_process(uint8_t escape_char, uint8_t ch)
         ERROR_PRINTF("undefined escape option '%c', 0x%x\n", ch, ch);
         printf("ctrl+b q         quit program\n");
         printf("ctrl+b s         enable step by step mode\n");
+        printf("ctrl+b m         migrate machine to -M destination\n");
         printf("ctrl+b ctrl+b    sends ctrl+b\n");
         break;
     }
@@ -162,11 +307,211 @@ static int term_process(uint8_t escape_char, uint8_t ch)
 static void peripheral_exit(void)
 {
     loop_exit(&loop_default);
+    loop_exit(&loop_net);
+    blk_exit(0, &peripheral_reg_base.blk);
+    crypto_exit(0, &peripheral_reg_base.crypto);
+    rng_exit(0, &peripheral_reg_base.rng);
+    share_exit(0, &peripheral_reg_base.share);
     fs_exit(0, &peripheral_reg_base.fs);
     tim_exit(0, &peripheral_reg_base.tim);
     memory_exit(0, &peripheral_reg_base.mem);
     uart_8250_exit(0, &peripheral_reg_base.uart[0]);
     uart_8250_exit(0, &peripheral_reg_base.uart[1]);
+    nic_exit(0, &peripheral_reg_base.nic);
+}
+
+
+/* -A <console cpu>[,<network cpu>], the network loop follows the console by default */
+static int io_affinity_parse(const char *arg)
+{
+    char *end;
+    long cpu = strtol(arg, &end, 10);
+    if(end == arg || loop_set_affinity(&loop_default, cpu) < 0)
+        return -1;
+    if(*end == ',') {
+        arg = end + 1;
+        cpu = strtol(arg, &end, 10);
+        if(end == arg)
+            return -1;
+    }
+    if(*end != '\0' || loop_set_affinity(&loop_net, cpu) < 0)
+        return -1;
+    return 0;
+}
+
+
+/* from cpu thread, console printed the template pattern */
+static void clone_match(void)
+{
+    console_match_register(NULL, NULL);
+    __atomic_or_fetch(&vm_request, VM_REQUEST_CLONE, __ATOMIC_RELEASE);
+}
+
+
+/* from migration thread, pre-copy converged */
+static void migrate_stop_request(void)
+{
+    __atomic_or_fetch(&vm_request, VM_REQUEST_MIGRATE, __ATOMIC_RELEASE);
+}
+
+
+/* from cpu thread, the guest wrote the power off device */
+static void vm_poweroff(int status)
+{
+    fflush(stdout);
+    DEBUG_PRINTF("power off, status %d\n", status);
+    exit(status);
+}
+
+
+/* -L <n> instructions, <n>s or <n>ms of run time, return: 0 done, -1 error */
+static int run_budget_parse(const char *arg)
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if(end == arg || n == 0)
+        return -1;
+    if(*end == '\0') {
+        run_budget_insns = n;
+    } else if(strcmp(end, "s") == 0) {
+        run_budget_ns = n * 1000000000LL;
+    } else if(strcmp(end, "ms") == 0) {
+        run_budget_ns = n * 1000000LL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* from loop thread */
+static void run_budget_timeout(void *opaque)
+{
+    __atomic_or_fetch(&vm_request, VM_REQUEST_BUDGET, __ATOMIC_RELEASE);
+}
+
+
+static void run_budget_exit(struct armv4_cpu_t *cpu)
+{
+    fflush(stdout);
+    ERROR_PRINTF("run budget exhausted, pc 0x%08x\n", cpu->reg[CPU_MODE_USER][15]);
+    exit(RUN_BUDGET_STATUS);
+}
+
+
+/*
+ * clone_child_init: runs in the forked clone, threads do not survive
+ * fork(), so the loop, the timer and every backend are re-created.
+ */
+static int clone_child_init(int id)
+{
+    char log_path[64];
+    int fd;
+
+#ifdef __linux__
+    //do not outlive the template
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    //give back the terminal before the console is redirected
+    uart_8250_exit(0, &peripheral_reg_base.uart[0]);
+    snprintf(log_path, sizeof(log_path), CLONE_LOG_FORMAT, id);
+    fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        ERROR_PRINTF("clone %d open %s err\n", id, log_path);
+        return -1;
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    fd = open("/dev/null", O_RDWR);
+    if(fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    loop_exit(&loop_default);
+    loop_exit(&loop_net);
+    if(loop_init(&loop_default) < 0 || loop_init(&loop_net) < 0)
+        return -1;
+    console_fork_child(id);
+    if(!peripheral_reg_base.uart[0].interface->init())
+        return -1;
+    if(uart_8250_fork_child(&peripheral_reg_base.uart[1]) < 0)
+        return -1;
+    if(nic_fork_child(&peripheral_reg_base.nic) < 0)
+        return -1;
+    if(tim_fork_child(&peripheral_reg_base.tim) < 0)
+        return -1;
+    if(fs_fork_child(&peripheral_reg_base.fs) < 0)
+        return -1;
+    if(blk_fork_child(&peripheral_reg_base.blk) < 0)
+        return -1;
+    if(crypto_fork_child(&peripheral_reg_base.crypto) < 0)
+        return -1;
+    if(rng_fork_child(&peripheral_reg_base.rng) < 0)
+        return -1;
+    if(share_fork_child(&peripheral_reg_base.share) < 0)
+        return -1;
+    if(memory_fork_child(&peripheral_reg_base.mem) < 0)
+        return -1;
+    if(loop_start(&loop_default) < 0 || loop_start(&loop_net) < 0)
+        return -1;
+    DEBUG_PRINTF("clone %d, pid %d\n", id, getpid());
+    return 0;
+}
+
+
+/*
+ * vm_clone: hold this machine as a template and fork clone_number
+ * copy-on-write clones of it, returns only in the clones.
+ */
+static void vm_clone(void)
+{
+    pid_t *pids;
+    int status, failed = 0;
+
+    //quiesce the loop threads so that fifos and backends are consistent
+    loop_stop(&loop_default);
+    loop_stop(&loop_net);
+    //requests in flight complete before the image is shared
+    blk_exit(0, &peripheral_reg_base.blk);
+    crypto_exit(0, &peripheral_reg_base.crypto);
+    share_exit(0, &peripheral_reg_base.share);
+    fflush(stdout);
+
+    pids = calloc(clone_number, sizeof(pid_t));
+    if(!pids) {
+        ERROR_PRINTF("clone alloc err\n");
+        exit(-1);
+    }
+    for(int i=0; i<clone_number; i++) {
+        pids[i] = fork();
+        if(pids[i] == 0) {
+            free(pids);
+            if(clone_child_init(i) < 0) {
+                ERROR_PRINTF("clone %d init err\n", i);
+                _exit(-1);
+            }
+            return;
+        } else if(pids[i] < 0) {
+            ERROR_PRINTF("clone %d fork err\n", i);
+            clone_number = i;
+            break;
+        }
+    }
+    PRINTF("template holds, %d clones running\n", clone_number);
+
+    for(int i=0; i<clone_number; i++) {
+        if(waitpid(pids[i], &status, 0) < 0)
+            continue;
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+        PRINTF("clone %d, pid %d exit, status 0x%x\n", i, pids[i], status);
+    }
+    free(pids);
+    PRINTF("%d clones exit, %d failed\n", clone_number, failed);
+    exit(failed ? -1 : 0);
 }
 
 
@@ -235,15 +580,45 @@ void usage(const char *file)
     printf(
         "       -f <image_path>            Set image or binary programme file path.\n");
     printf(
-        "       [-r <romfs_path>]          Set ROM filesystem path.\n");
+        "       [-r <romfs_path>]          Set ROM filesystem path, a raw, compressed or overlay image.\n");
     printf(
         "       [-t <device_tree_path>]    Set Devices tree path.\n");
     printf(
-        "       [-n <net_mode>]            Select 'user' or 'tun' network mode, default is 'user'.\n");
+        "       [-F <directory>]           Share a host directory with the guest over 9P.\n");
+    printf(
+        "       [-n <net_mode>]            Select 'user' or 'tun[,queues=<n>]' network mode, default is 'user'.\n");
+    printf(
+        "       [-N]                       Attach the network to the Nic device instead of Uart1 slip.\n");
+    printf(
+        "       [-C <console>]             Attach Uart0 to 'stdio', 'pty', 'unix:<path>' or 'file:<path>', default is 'stdio'.\n");
+    printf(
+        "       [-A <cpu>[,<cpu>]]         Pin the console loop and the network loop to host cpus.\n");
     printf(
         "       [-d]                       Display debug message.\n");
     printf(
         "       [-s]                       Step by step mode.\n");
+    printf(
+        "       [-c <clones>]              Hold a template and fork copy-on-write clones.\n");
+    printf(
+        "       [-w <pattern>]             Clone once console prints pattern, default is '" CLONE_DEFAULT_PATTERN "'.\n");
+    printf(
+        "       [-S <name>]                Share RAM as shm <name> or 'memfd' for external tools.\n");
+    printf(
+        "       [-k]                       Merge same pages of guest RAM.\n");
+    printf(
+        "       [-M <uri>]                 Live migrate to 'unix:<path>' or 'fd:<n>' on ctrl+b m.\n");
+    printf(
+        "       [-I <uri>]                 Receive a migrated machine instead of loading an image.\n");
+    printf(
+        "       [-H]                       Serve ARM semihosting calls, swi 0x123456.\n");
+    printf(
+        "       [-L <n>[s|ms]]             Stop with status 124 after n instructions or seconds or ms.\n");
+    printf(
+        "       [-B <list>]                Run each image of list in a batch, instead of -f.\n");
+    printf(
+        "       [-j <workers>]             Run this many batch jobs at a time, default one per cpu.\n");
+    printf(
+        "       [-o <directory>]           Write batch results and job logs to directory, default is '" BATCH_DEFAULT_DIR "'.\n");
     printf("\n");
     printf(
         "       [-v]                       Verbose mode.\n");
@@ -286,6 +661,24 @@ void usage_s(void)
         "       p[p|v] [a]       Print physical/virtual address at 0x[a]\n");
     printf(
         "       t[s]             Print run time and speed, set/clear realtime show flag\n");
+    printf(
+        "       k                Print same page merging statistics\n");
+    printf(
+        "       b [n]            Print balloon status, ask the guest to give up n pages\n");
+    printf(
+        "       n                Print network device status\n");
+    printf(
+        "       o                Print block device status\n");
+    printf(
+        "       a                Print DMA engine status\n");
+    printf(
+        "       c                Print crypto device status\n");
+    printf(
+        "       e                Print entropy device status\n");
+    printf(
+        "       f                Print shared directory status\n");
+    printf(
+        "       i                Print semihosting statistics\n");
     printf(
         "       h                Print this message\n");
     printf(
@@ -364,10 +757,18 @@ int main(int argc, char **argv)
     char *image_path = NULL;
     char *dtb_path = NULL;
     char *hostfwd_cmd = NULL;
+    char *tun_opts = NULL;
+    char *clone_pattern = CLONE_DEFAULT_PATTERN;
+    char *migrate_uri = NULL;
+    char *incoming_uri = NULL;
+    char *batch_list = NULL;
+    char *batch_dir = BATCH_DEFAULT_DIR;
+    int batch_workers = 0;
     int ch;
 
     peripheral_reg_base.fs.filename = NULL;
-    while((ch = getopt(argc, argv, "m:n:f:r:t:dshv")) != -1) {
+    peripheral_reg_base.mem.shm_name = NULL;
+    while((ch = getopt(argc, argv, "m:n:f:r:t:F:c:w:M:I:S:C:A:L:B:j:o:NHkdshv")) != -1) {
         switch(ch) {
         case 't':
             dtb_path = optarg;
@@ -375,6 +776,9 @@ int main(int argc, char **argv)
         case 'r':
             peripheral_reg_base.fs.filename = optarg;
             break;
+        case 'F':
+            peripheral_reg_base.share.root = optarg;
+            break;
         case 'f':
             image_path = optarg;
             break;
@@ -403,8 +807,11 @@ int main(int argc, char **argv)
                     }
                     r++;
                 }
-            } else if(optarg[0] == 't' || strcmp(optarg, "tun") == 0) {
+            } else if(optarg[0] == 't' || strncmp(optarg, "tun", 3) == 0) {
                 net_mode = USE_NET_TUN;
+                tun_opts = strchr(optarg, ',');
+                if(tun_opts)
+                    tun_opts++;
             } else {
                 ERROR_PRINTF("unknown net mode option :%s\n", optarg);
                 usage(argv[0]);
@@ -414,6 +821,71 @@ int main(int argc, char **argv)
         case 's':
             step_by_step = 1;
             break;
+        case 'c':
+            clone_number = atoi(optarg);
+            if(clone_number <= 0) {
+                ERROR_PRINTF("unknown clones option :%s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'w':
+            clone_pattern = optarg;
+            break;
+        case 'k':
+            ksm_enable = 1;
+            break;
+        case 'N':
+            nic_enable = 1;
+            break;
+        case 'H':
+            semihost_enable = 1;
+            break;
+        case 'L':
+            if(run_budget_parse(optarg) < 0) {
+                ERROR_PRINTF("unknown budget option :%s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'B':
+            batch_list = optarg;
+            break;
+        case 'j':
+            batch_workers = atoi(optarg);
+            if(batch_workers <= 0) {
+                ERROR_PRINTF("unknown workers option :%s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'o':
+            batch_dir = optarg;
+            break;
+        case 'C':
+            if(console_backend_select(optarg) < 0) {
+                ERROR_PRINTF("unknown console option :%s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'A':
+            if(io_affinity_parse(optarg) < 0) {
+                ERROR_PRINTF("unknown affinity option :%s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'S':
+            peripheral_reg_base.mem.shm_name = optarg;
+            break;
+        case 'M':
+            migrate_uri = optarg;
+            break;
+        case 'I':
+            incoming_uri = optarg;
+            mode = USE_INCOMING;
+            break;
         case 'd':
             global_debug_flag = 1;
             break;
@@ -427,7 +899,11 @@ int main(int argc, char **argv)
             exit(-1);
         }
     }
-    if(!image_path) {
+    if(batch_list) {
+        //returns in the workers only, one per image
+        image_path = batch_start(batch_list, batch_workers, batch_dir);
+    }
+    if(!image_path && !incoming_uri) {
         ERROR_PRINTF("parameter error \n");
         usage(argv[0]);
         exit(-1);
@@ -440,22 +916,45 @@ int main(int argc, char **argv)
     switch(net_mode) {
     case USE_NET_USER:
         peripheral_reg_base.uart[1].interface_register_cb = slip_user_register;
+        peripheral_reg_base.nic.interface_register_cb = slip_user_netdev_register;
         break;
     case USE_NET_TUN:
         peripheral_reg_base.uart[1].interface_register_cb = slip_tun_register;
+        peripheral_reg_base.nic.interface_register_cb = slip_tun_netdev_register;
         break;
     default:
         exit(-1);
     }
+    if(net_mode == USE_NET_TUN && tun_opts && slip_tun_options(tun_opts) < 0) {
+        exit(-1);
+    }
+    if(nic_enable) {
+        peripheral_reg_base.uart[1].interface_register_cb = uart_null_register;
+    } else {
+        peripheral_reg_base.nic.interface_register_cb = NULL;
+    }
 
     signal(SIGPIPE, SIG_IGN);
-    if(loop_init(&loop_default) < 0)
+    if(loop_init(&loop_default) < 0 || loop_init(&loop_net) < 0)
         exit(-1);
 
     cpu_init(cpu);
+    peripheral_reg_base.dma.bus = &cpu->peripheral;
+    peripheral_reg_base.power.poweroff_cb = vm_poweroff;
     peripheral_register(cpu, peripheral_config, SIZEOF_PERIPHERAL_CONFIG(peripheral_config));
+    if(peripheral_reg_base.mem.shm) {
+        cpu->mmu.reg_mirror = peripheral_reg_base.mem.shm->cp15;
+        memcpy(cpu->mmu.reg_mirror, cpu->mmu.reg, sizeof(cpu->mmu.reg));
+    }
     atexit(peripheral_exit);
     console_term_register(term_process);
+    if(clone_number)
+        console_match_register(clone_pattern, clone_match);
+    migration_register(migrate_uri, &peripheral_reg_base, migrate_stop_request);
+    if(ksm_enable && ksm_init(&peripheral_reg_base.mem) < 0)
+        exit(-1);
+    if(semihost_enable && semihost_init(&peripheral_reg_base.mem, image_path) < 0)
+        exit(-1);
 
 #ifdef USE_SLIRP_SUPPORT
     if(net_mode == USE_NET_USER && hostfwd_cmd && slip_user_hostfwd(hostfwd_cmd) < 0) {
@@ -465,7 +964,14 @@ int main(int argc, char **argv)
     (void)hostfwd_cmd;
 #endif
 
-    if(loop_start(&loop_default) < 0)
+    if(run_budget_ns) {
+        struct loop_timer_t *t = loop_timer_new(&loop_default, run_budget_timeout, NULL);
+        if(!t)
+            exit(-1);
+        loop_timer_mod(&loop_default, t, loop_get_clock_ns(&loop_default) + run_budget_ns);
+    }
+
+    if(loop_start(&loop_default) < 0 || loop_start(&loop_net) < 0)
         exit(-1);
 
     switch(mode) {
@@ -485,6 +991,10 @@ int main(int argc, char **argv)
     case USE_BINARY:
         load_program_memory(cpu, image_path, 0);
         break;
+    case USE_INCOMING:
+        if(migration_incoming(incoming_uri, cpu, &peripheral_reg_base) < 0)
+            exit(-1);
+        break;
     default:
         exit(-1);
     }
@@ -576,6 +1086,41 @@ int main(int argc, char **argv)
                     break;
                 }
                 break;
+            case 'k':
+                ksm_show();
+                break;
+            case 'b':
+                {
+                    uint32_t pages;
+                    while(*ps == ' ')
+                        ps++;
+                    if(sscanf(ps, "%u", &pages) == 1) {
+                        balloon_set_target(&peripheral_reg_base.balloon, pages);
+                    }
+                    balloon_show(&peripheral_reg_base.balloon);
+                }
+                break;
+            case 'n':
+                nic_show(&peripheral_reg_base.nic);
+                break;
+            case 'o':
+                blk_show(&peripheral_reg_base.blk);
+                break;
+            case 'a':
+                dma_show(&peripheral_reg_base.dma);
+                break;
+            case 'c':
+                crypto_show(&peripheral_reg_base.crypto);
+                break;
+            case 'e':
+                rng_show(&peripheral_reg_base.rng);
+                break;
+            case 'f':
+                share_show(&peripheral_reg_base.share);
+                break;
+            case 'i':
+                semihost_show();
+                break;
             case 'h':
             case '?':
                 usage_s();
@@ -594,6 +1139,20 @@ int main(int argc, char **argv)
             continue;
         }
 RUN:
+        if(vm_request) {
+            if(vm_request & VM_REQUEST_CLONE) {
+                __atomic_and_fetch(&vm_request, ~VM_REQUEST_CLONE, __ATOMIC_ACQUIRE);
+                vm_clone();
+            }
+            if(vm_request & VM_REQUEST_MIGRATE) {
+                __atomic_and_fetch(&vm_request, ~VM_REQUEST_MIGRATE, __ATOMIC_ACQUIRE);
+                migration_complete(cpu);
+            }
+            if(vm_request & VM_REQUEST_BUDGET)
+                run_budget_exit(cpu);
+        }
+        if(run_budget_insns && !--run_budget_insns)
+            run_budget_exit(cpu);
         cpu->code_counter++;
         cpu->decoder.event_id = EVENT_ID_IDLE;
 
@@ -607,6 +1166,8 @@ RUN:
             DEBUG_PRINTF("undef:%08x\n", cpu->decoder.instruction_word);
             break;
         case EVENT_ID_SWI:
+            if(semihost_enable && semihost_swi(cpu))
+                break;
             interrupt_exception(cpu, INT_EXCEPTION_SWI);
             break;
         case EVENT_ID_DATAABT:
@@ -616,7 +1177,7 @@ RUN:
             interrupt_exception(cpu, INT_EXCEPTION_PREABT);
             break;
         case EVENT_ID_WFI:
-            while(!user_event(&peripheral_reg_base, EVENT_TYPE_DETECT)) {
+            while(!user_event(&peripheral_reg_base, EVENT_TYPE_DETECT) && !vm_request) {
                 usleep(10);
             }
             //miss break
@@ -626,6 +1187,8 @@ RUN:
             }
         }
         clock_speed_detect(cpu, realtime_speed_show);
+        if(ksm_enable && !(cpu->code_counter & KSM_SCAN_RATE))
+            ksm_scan(&peripheral_reg_base.mem);
     }
 
     return 0;
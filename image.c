@@ -0,0 +1,1128 @@
+/*
+ * image.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE  /* fallocate */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <image.h>
+#include <config.h>
+
+#ifdef USE_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+
+#define LOG_NAME   "image"
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+#define IMAGE_BLOCK_MASK     ((uint64_t)IMAGE_BLOCK_SIZE - 1)
+
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off)
+{
+    while(len) {
+        ssize_t r = pread(fd, buf, len, off);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return -1;
+        buf = (uint8_t *)buf + r;
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off)
+{
+    while(len) {
+        ssize_t r = pwrite(fd, buf, len, off);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return -1;
+        buf = (const uint8_t *)buf + r;
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+
+int image_fd_rw(int fd, struct iovec *iov, int cnt, uint64_t off, int write)
+{
+    uint64_t end = off;
+    for(int i = 0; i < cnt; i++)
+        end += iov[i].iov_len;
+    while(off < end) {
+        ssize_t r = write ? pwritev(fd, iov, cnt, off) : preadv(fd, iov, cnt, off);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return -1;
+        off += r;
+        //short transfer, skip what is done
+        while(cnt && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt) {
+            iov->iov_base = (uint8_t *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+
+/* range reads as zero afterwards, holes where the file system can */
+int image_fd_zero(int fd, uint64_t off, uint64_t len)
+{
+    static const uint8_t zero[64 * 1024];
+#ifdef USE_FALLOCATE_SUPPORT
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+        return 0;
+#endif
+    while(len) {
+        size_t n = len < sizeof(zero) ? len : sizeof(zero);
+        if(pwrite_full(fd, zero, n, off) < 0)
+            return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int image_fd_sync(int fd)
+{
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+
+/******************************compressed*****************************************/
+
+struct image_cz_slot_t {
+    uint32_t chunk;
+    uint64_t used;            //LRU tick, 0 free
+    uint8_t *buf;
+};
+
+struct image_cz_t {
+    int fd;
+    struct image_cz_header_t h;
+    uint64_t *index;
+    uint32_t *slot_of;        //chunk -> slot + 1, 0 not cached
+    struct image_cz_slot_t slot[IMAGE_CZ_CACHE];
+    uint64_t tick;
+    uint8_t *zbuf;            //compressed chunk
+    uint64_t zbuf_len;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;     //cache, zbuf
+};
+
+
+static void image_cz_close(struct image_cz_t *cz)
+{
+    for(int i = 0; i < IMAGE_CZ_CACHE; i++)
+        free(cz->slot[i].buf);
+    free(cz->index);
+    free(cz->slot_of);
+    free(cz->zbuf);
+    close(cz->fd);
+    free(cz);
+}
+
+
+/* image_cz_open: takes fd, the header is checked by the caller's magic */
+static struct image_cz_t *image_cz_open(int fd, const char *filename)
+{
+    struct image_cz_t *cz = calloc(1, sizeof(struct image_cz_t));
+    uint64_t chunk_size, end;
+
+    if(!cz) {
+        close(fd);
+        return NULL;
+    }
+    cz->fd = fd;
+    if(pread_full(fd, &cz->h, sizeof(cz->h), 0) < 0 || cz->h.version != IMAGE_CZ_VERSION ||
+     cz->h.chunk_shift < IMAGE_BLOCK_SHIFT || cz->h.chunk_shift > 24 ||
+     cz->h.chunks != (cz->h.size + (1ULL << cz->h.chunk_shift) - 1) >> cz->h.chunk_shift) {
+        ERROR_PRINTF("%s: unsupported compressed image\n", filename);
+        goto err;
+    }
+#ifndef USE_ZLIB_SUPPORT
+    ERROR_PRINTF("%s: built without zlib\n", filename);
+    goto err;
+#endif
+    chunk_size = 1ULL << cz->h.chunk_shift;
+    cz->index = malloc((cz->h.chunks + 1ULL) * sizeof(uint64_t));
+    cz->slot_of = calloc(cz->h.chunks, sizeof(uint32_t));
+    if(!cz->index || !cz->slot_of)
+        goto err;
+    if(pread_full(fd, cz->index, (cz->h.chunks + 1ULL) * sizeof(uint64_t), cz->h.index_offset) < 0) {
+        ERROR_PRINTF("%s: read index err\n", filename);
+        goto err;
+    }
+    end = lseek(fd, 0L, SEEK_END);
+    for(uint32_t i = 0; i < cz->h.chunks; i++) {
+        uint64_t clen = cz->index[i + 1] - cz->index[i];
+        if(cz->index[i + 1] < cz->index[i] || cz->index[i + 1] > end || clen > chunk_size) {
+            ERROR_PRINTF("%s: chunk %u index err\n", filename, i);
+            goto err;
+        }
+        if(clen > cz->zbuf_len)
+            cz->zbuf_len = clen;
+    }
+    cz->zbuf = malloc(cz->zbuf_len ? cz->zbuf_len : 1);
+    if(!cz->zbuf)
+        goto err;
+    pthread_mutex_init(&cz->lock, NULL);
+    return cz;
+err:
+    image_cz_close(cz);
+    return NULL;
+}
+
+
+/* lock held, return: decompressed chunk, NULL on error */
+static uint8_t *image_cz_chunk(struct image_cz_t *cz, uint32_t chunk)
+{
+    uint64_t chunk_size = 1ULL << cz->h.chunk_shift;
+    uint64_t start = (uint64_t)chunk << cz->h.chunk_shift;
+    uint64_t ulen = cz->h.size - start < chunk_size ? cz->h.size - start : chunk_size;
+    uint64_t clen = cz->index[chunk + 1] - cz->index[chunk];
+    struct image_cz_slot_t *slot = &cz->slot[0];
+
+    if(cz->slot_of[chunk]) {
+        slot = &cz->slot[cz->slot_of[chunk] - 1];
+        slot->used = ++cz->tick;
+        cz->hits++;
+        return slot->buf;
+    }
+    cz->misses++;
+    //least recently used, free slots have used 0
+    for(int i = 1; i < IMAGE_CZ_CACHE && slot->used; i++) {
+        if(cz->slot[i].used < slot->used)
+            slot = &cz->slot[i];
+    }
+    if(slot->used) {
+        cz->slot_of[slot->chunk] = 0;
+        slot->used = 0;
+    }
+    if(!slot->buf) {
+        slot->buf = malloc(chunk_size);
+        if(!slot->buf)
+            return NULL;
+    }
+    if(clen == ulen) {
+        //stored, did not shrink
+        if(pread_full(cz->fd, slot->buf, ulen, cz->index[chunk]) < 0)
+            return NULL;
+    } else {
+#ifdef USE_ZLIB_SUPPORT
+        uLongf dlen = ulen;
+        if(pread_full(cz->fd, cz->zbuf, clen, cz->index[chunk]) < 0 ||
+         uncompress(slot->buf, &dlen, cz->zbuf, clen) != Z_OK || dlen != ulen)
+            return NULL;
+#else
+        return NULL;
+#endif
+    }
+    slot->chunk = chunk;
+    slot->used = ++cz->tick;
+    cz->slot_of[chunk] = slot - cz->slot + 1;
+    return slot->buf;
+}
+
+
+/* from any thread, return: 0 done, -1 error */
+static int image_cz_read(struct image_cz_t *cz, void *buf, size_t len, uint64_t off)
+{
+    uint64_t mask = (1ULL << cz->h.chunk_shift) - 1;
+    int ret = 0;
+
+    pthread_mutex_lock(&cz->lock);
+    while(len) {
+        size_t n = mask + 1 - (off & mask);
+        uint8_t *p = image_cz_chunk(cz, off >> cz->h.chunk_shift);
+        if(!p) {
+            ERROR_PRINTF("chunk %llu err\n", (unsigned long long)(off >> cz->h.chunk_shift));
+            ret = -1;
+            break;
+        }
+        if(n > len)
+            n = len;
+        memcpy(buf, p + (off & mask), n);
+        buf = (uint8_t *)buf + n;
+        off += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&cz->lock);
+    return ret;
+}
+
+/******************************compressed*****************************************/
+
+
+/******************************window*****************************************/
+
+static int image_win_init(struct image_win_t *w, int fd, uint64_t offset, uint64_t len, int prot)
+{
+    w->fd = fd;
+    w->offset = offset;
+    w->len = len;
+    w->prot = prot;
+    w->is_private = 0;
+    w->count = (len + IMAGE_WINDOW_SIZE - 1) >> IMAGE_WINDOW_SHIFT;
+    w->mapped = 0;
+    w->tick = 0;
+    w->last = UINT32_MAX;
+    w->maps = w->evictions = 0;
+    w->map = calloc(w->count + 1, sizeof(uint8_t *));
+    w->used = calloc(w->count + 1, sizeof(uint64_t));
+    pthread_mutex_init(&w->lock, NULL);
+    if(!w->map || !w->used) {
+        free(w->map);
+        free(w->used);
+        w->map = NULL;
+        w->used = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+static uint64_t image_win_len(struct image_win_t *w, uint32_t i)
+{
+    uint64_t start = (uint64_t)i << IMAGE_WINDOW_SHIFT;
+    return w->len - start < IMAGE_WINDOW_SIZE ? w->len - start : IMAGE_WINDOW_SIZE;
+}
+
+
+static void image_win_exit(struct image_win_t *w)
+{
+    if(!w->map)
+        return;
+    for(uint32_t i = 0; i < w->count; i++) {
+        if(w->map[i])
+            munmap(w->map[i], image_win_len(w, i));
+    }
+    free(w->map);
+    free(w->used);
+    w->map = NULL;
+    w->used = NULL;
+}
+
+
+/*
+ * image_win_map: slow path of image_win_ptr, map the window of off,
+ * return: pointer to off, NULL on error
+ */
+uint8_t *image_win_map(struct image_win_t *w, uint64_t off)
+{
+    uint32_t i = off >> IMAGE_WINDOW_SHIFT;
+    uint64_t len = image_win_len(w, i);
+    uint8_t *p;
+
+    pthread_mutex_lock(&w->lock);
+    p = w->map[i];
+    if(p)
+        goto out;
+    if(!w->is_private && w->mapped >= IMAGE_WINDOWS) {
+        uint32_t lru = UINT32_MAX;
+        for(uint32_t j = 0; j < w->count; j++) {
+            if(w->map[j] && (lru == UINT32_MAX || w->used[j] < w->used[lru]))
+                lru = j;
+        }
+        munmap(w->map[lru], image_win_len(w, lru));
+        __atomic_store_n(&w->map[lru], NULL, __ATOMIC_RELEASE);
+        w->mapped--;
+        w->evictions++;
+    }
+    p = mmap(0, len, w->prot, w->is_private ? MAP_PRIVATE : MAP_SHARED, w->fd,
+     w->offset + ((uint64_t)i << IMAGE_WINDOW_SHIFT));
+    if(p == MAP_FAILED) {
+        ERROR_PRINTF("mmap window %u err\n", i);
+        p = NULL;
+        goto out;
+    }
+    //the next window after the last one, the guest streams the image
+    if(w->last != UINT32_MAX && i == w->last + 1) {
+        madvise(p, len, MADV_SEQUENTIAL);
+        madvise(p, len < IMAGE_READAHEAD ? len : IMAGE_READAHEAD, MADV_WILLNEED);
+    }
+    w->last = i;
+    w->mapped++;
+    w->maps++;
+    __atomic_store_n(&w->map[i], p, __ATOMIC_RELEASE);
+out:
+    pthread_mutex_unlock(&w->lock);
+    return p ? p + (off & (IMAGE_WINDOW_SIZE - 1)) : NULL;
+}
+
+
+/* cloned machine, the mapped windows become private, none is unmapped again */
+static int image_win_fork_child(struct image_win_t *w)
+{
+    pthread_mutex_init(&w->lock, NULL);
+    w->is_private = 1;
+    if(!w->map)
+        return 0;
+    for(uint32_t i = 0; i < w->count; i++) {
+        if(!w->map[i])
+            continue;
+        if(mmap(w->map[i], image_win_len(w, i), w->prot, MAP_PRIVATE | MAP_FIXED, w->fd,
+         w->offset + ((uint64_t)i << IMAGE_WINDOW_SHIFT)) == MAP_FAILED)
+            return -1;
+    }
+    return 0;
+}
+
+/******************************window*****************************************/
+
+
+/*
+ * image_base_open: a raw image is mapped, writable unless it is the
+ * base of an overlay, a compressed image (found by its magic) is
+ * read through the chunk cache.
+ */
+static int image_base_open(struct image_t *img, const char *path, int writable)
+{
+    uint32_t magic = 0;
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+
+    if(fd < 0) {
+        ERROR_PRINTF("%s: open err\n", path);
+        return -1;
+    }
+    if(pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == IMAGE_CZ_MAGIC) {
+        img->cz = image_cz_open(fd, path);
+        if(!img->cz)
+            return -1;
+        img->len = img->cz->h.size;
+        img->read_only = 1;
+        return 0;
+    }
+    img->fd = fd;
+    img->len = lseek(fd, 0L, SEEK_END);
+    if(image_win_init(&img->win, fd, 0, img->len, writable ? PROT_READ | PROT_WRITE : PROT_READ) < 0) {
+        ERROR_PRINTF("%s: alloc err\n", path);
+        return -1;
+    }
+    img->read_only = !writable;
+    return 0;
+}
+
+
+/* base blocks of an overlay, or a compressed image, from any thread */
+static int image_base_read(struct image_t *img, void *buf, size_t len, uint64_t off)
+{
+    if(img->cz)
+        return image_cz_read(img->cz, buf, len, off);
+    return pread_full(img->fd, buf, len, off);
+}
+
+
+static uint32_t image_cow_header_size(uint64_t size)
+{
+    uint64_t blocks = (size + IMAGE_BLOCK_MASK) >> IMAGE_BLOCK_SHIFT;
+    uint64_t bitmap = (blocks + 63) / 64 * 8;
+    return IMAGE_BLOCK_SIZE + ((bitmap + IMAGE_BLOCK_MASK) & ~IMAGE_BLOCK_MASK);
+}
+
+
+static int image_cow_header_check(const struct image_cow_header_t *h, const char *filename)
+{
+    if(h->version != IMAGE_COW_VERSION || h->block_shift != IMAGE_BLOCK_SHIFT ||
+     h->header_size != image_cow_header_size(h->size) || memchr(h->base, 0, IMAGE_COW_BASE_MAX) == NULL) {
+        ERROR_PRINTF("%s: unsupported overlay\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* base path of an overlay, relative paths start at the overlay directory */
+static void image_cow_base_path(char *path, size_t size, const char *filename, const char *base)
+{
+    const char *slash = strrchr(filename, '/');
+    if(base[0] == '/' || !slash)
+        snprintf(path, size, "%s", base);
+    else
+        snprintf(path, size, "%.*s/%s", (int)(slash - filename), filename, base);
+}
+
+
+static int image_cow_open(struct image_t *img)
+{
+    struct image_cow_header_t h;
+    char path[PATH_MAX];
+
+    if(pread_full(img->cow_fd, &h, sizeof(h), 0) < 0 || image_cow_header_check(&h, img->filename) < 0)
+        return -1;
+    image_cow_base_path(path, sizeof(path), img->filename, h.base);
+    //the base is shared by every guest on it, never written
+    if(image_base_open(img, path, 0) < 0)
+        return -1;
+    if(img->len != h.size) {
+        ERROR_PRINTF("%s: base %s size changed\n", img->filename, path);
+        return -1;
+    }
+    if(ftruncate(img->cow_fd, h.header_size + h.size) < 0) {
+        ERROR_PRINTF("%s: truncate err\n", img->filename);
+        return -1;
+    }
+    img->cow_map_len = h.header_size;
+    img->cow_map = mmap(0, img->cow_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, img->cow_fd, 0);
+    if(img->cow_map == MAP_FAILED) {
+        img->cow_map = NULL;
+        ERROR_PRINTF("%s: mmap err\n", img->filename);
+        return -1;
+    }
+    img->cow = (struct image_cow_header_t *)img->cow_map;
+    img->bitmap = (uint64_t *)(img->cow_map + IMAGE_BLOCK_SIZE);
+    if(image_win_init(&img->cow_win, img->cow_fd, h.header_size, h.size, PROT_READ | PROT_WRITE) < 0) {
+        ERROR_PRINTF("%s: alloc err\n", img->filename);
+        return -1;
+    }
+    img->read_only = 0;
+    pthread_mutex_init(&img->cow_lock, NULL);
+    DEBUG_PRINTF("%s: overlay on %s, %llu blocks allocated\n", img->filename, path,
+     (unsigned long long)img->cow->allocated);
+    return 0;
+}
+
+
+/*
+ * image_open: a raw image is mapped read-write, a compressed image is
+ * read-only, an overlay (found by its magic) maps the overlay
+ * read-write on top of its base opened read-only.
+ */
+int image_open(struct image_t *img, const char *filename)
+{
+    uint32_t magic = 0;
+    int fd;
+
+    memset(img, 0, sizeof(struct image_t));
+    img->filename = filename;
+    img->fd = img->cow_fd = -1;
+    fd = open(filename, O_RDONLY);
+    if(fd >= 0) {
+        if(pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+            magic = 0;
+        close(fd);
+    }
+    if(magic == IMAGE_COW_MAGIC) {
+        img->cow_fd = open(filename, O_RDWR);
+        if(img->cow_fd < 0)
+            ERROR_PRINTF("%s: open err\n", filename);
+        if(img->cow_fd < 0 || image_cow_open(img) < 0) {
+            image_close(img);
+            return -1;
+        }
+        return 0;
+    }
+    if(image_base_open(img, filename, magic != IMAGE_CZ_MAGIC) < 0) {
+        image_close(img);
+        return -1;
+    }
+    return 0;
+}
+
+
+void image_close(struct image_t *img)
+{
+    image_win_exit(&img->win);
+    image_win_exit(&img->cow_win);
+    if(img->cow_map)
+        munmap(img->cow_map, img->cow_map_len);
+    if(img->fd >= 0)
+        close(img->fd);
+    if(img->cow_fd >= 0)
+        close(img->cow_fd);
+    if(img->cz)
+        image_cz_close(img->cz);
+    img->cow_map = NULL;
+    img->cz = NULL;
+    img->cow = NULL;
+    img->fd = img->cow_fd = -1;
+    img->len = 0;
+}
+
+
+int image_fork_child(struct image_t *img)
+{
+    if(img->cow) {
+        if(mmap(img->cow_map, img->cow_map_len, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_FIXED, img->cow_fd, 0) == MAP_FAILED ||
+         image_win_fork_child(&img->cow_win) < 0)
+            goto err;
+        pthread_mutex_init(&img->cow_lock, NULL);
+    }
+    //a read-only base too, the pool threads use its windows from now on
+    if(image_win_fork_child(&img->win) < 0)
+        goto err;
+    //compressed, nothing is written
+    if(img->cz)
+        pthread_mutex_init(&img->cz->lock, NULL);
+    img->is_private = 1;
+    return 0;
+err:
+    ERROR_PRINTF("%s: remap err\n", img->filename);
+    return -1;
+}
+
+
+/* from any thread, copy the block of off up from the base, return: 0 done, -1 error */
+static int image_cow_alloc(struct image_t *img, uint64_t off)
+{
+    uint64_t blk = off >> IMAGE_BLOCK_SHIFT;
+    uint64_t bit = 1ULL << (blk & 63);
+    uint64_t start = off & ~IMAGE_BLOCK_MASK;
+    uint64_t len = img->len - start < IMAGE_BLOCK_SIZE ? img->len - start : IMAGE_BLOCK_SIZE;
+    uint8_t buf[IMAGE_BLOCK_SIZE];
+    uint8_t *p;
+    int ret = 0;
+
+    pthread_mutex_lock(&img->cow_lock);
+    if(img->bitmap[blk >> 6] & bit)
+        goto out;
+    ret = -1;
+    if(image_base_read(img, buf, len, start) < 0)
+        goto out;
+    if(img->is_private) {
+        p = image_win_ptr(&img->cow_win, start);
+        if(!p)
+            goto out;
+        memcpy(p, buf, len);
+    } else if(pwrite_full(img->cow_fd, buf, len, img->cow->header_size + start) < 0) {
+        //out of space, report it instead of SIGBUS on the store
+        ERROR_PRINTF("%s: copy block %llu err\n", img->filename, (unsigned long long)blk);
+        goto out;
+    }
+    __atomic_fetch_or(&img->bitmap[blk >> 6], bit, __ATOMIC_RELEASE);
+    img->cow->allocated++;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&img->cow_lock);
+    return ret;
+}
+
+
+/*
+ * image_cow_copy: first write to a block of an overlay, copy the
+ * block up from the base, then publish the bitmap bit.
+ */
+uint8_t *image_cow_copy(struct image_t *img, uint64_t off)
+{
+    if(image_cow_alloc(img, off) < 0)
+        return NULL;
+    return image_win_ptr(&img->cow_win, off);
+}
+
+
+static inline int image_cow_test(struct image_t *img, uint64_t off)
+{
+    uint64_t blk = off >> IMAGE_BLOCK_SHIFT;
+    return (__atomic_load_n(&img->bitmap[blk >> 6], __ATOMIC_ACQUIRE) >> (blk & 63)) & 1;
+}
+
+
+/*
+ * image_block_rw: from any thread, n bytes within one block, a clone
+ * goes through its private windows, a shared image through the files,
+ * whose page cache the windows of the cpu thread see.
+ */
+static int image_block_rw(struct image_t *img, void *buf, size_t n, uint64_t off, int write)
+{
+    if(img->is_private) {
+        uint8_t *p = image_ptr(img, off, write);
+        if(!p)
+            return write ? -1 : image_base_read(img, buf, n, off);
+        if(write)
+            memcpy(p, buf, n);
+        else
+            memcpy(buf, p, n);
+        return 0;
+    }
+    if(img->cow) {
+        if(!image_cow_test(img, off)) {
+            if(!write)
+                return image_base_read(img, buf, n, off);
+            if(image_cow_alloc(img, off) < 0)
+                return -1;
+        }
+        off += img->cow->header_size;
+        return write ? pwrite_full(img->cow_fd, buf, n, off) : pread_full(img->cow_fd, buf, n, off);
+    }
+    if(img->cz)
+        return write ? -1 : image_cz_read(img->cz, buf, n, off);
+    return write ? pwrite_full(img->fd, buf, n, off) : pread_full(img->fd, buf, n, off);
+}
+
+
+int image_read(struct image_t *img, void *buf, size_t len, uint64_t off)
+{
+    if(off > img->len || len > img->len - off)
+        return -1;
+    while(len) {
+        size_t n = IMAGE_BLOCK_SIZE - (off & IMAGE_BLOCK_MASK);
+        if(n > len)
+            n = len;
+        if(image_block_rw(img, buf, n, off, 0) < 0)
+            return -1;
+        buf = (uint8_t *)buf + n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* sequential requests, ask the host to read ahead of the next one */
+static void image_readahead(struct image_t *img, uint64_t off, uint64_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t next = __atomic_exchange_n(&img->next_off, off + len, __ATOMIC_RELAXED);
+    if(off != next || img->cz || off + len >= img->len)
+        return;
+    off += len;
+    len = img->len - off < IMAGE_READAHEAD ? img->len - off : IMAGE_READAHEAD;
+    if(img->cow && image_cow_test(img, off))
+        posix_fadvise(img->cow_fd, img->cow->header_size + off, len, POSIX_FADV_WILLNEED);
+    else
+        posix_fadvise(img->fd, off, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+int image_rw(struct image_t *img, struct iovec *iov, int cnt, uint64_t off, int write)
+{
+    uint64_t len = 0;
+    for(int i = 0; i < cnt; i++)
+        len += iov[i].iov_len;
+    if(off > img->len || len > img->len - off)
+        return -1;
+    if(write && img->read_only)
+        return -1;
+    if(!write)
+        image_readahead(img, off, len);
+
+    if(!img->cow && !img->cz && !img->is_private)
+        return image_fd_rw(img->fd, iov, cnt, off, write);
+
+    //an overlay, compressed or a private mapping, a block at a time
+    for(int i = 0; i < cnt; i++) {
+        uint8_t *buf = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while(left) {
+            size_t n = IMAGE_BLOCK_SIZE - (off & IMAGE_BLOCK_MASK);
+            if(n > left)
+                n = left;
+            if(image_block_rw(img, buf, n, off, write) < 0)
+                return -1;
+            buf += n;
+            off += n;
+            left -= n;
+        }
+    }
+    return 0;
+}
+
+
+int image_flush(struct image_t *img)
+{
+    if(img->is_private || (img->read_only && !img->cow))
+        return 0;
+    //also writes back the pages stored through the windows
+    return image_fd_sync(img->cow ? img->cow_fd : img->fd);
+}
+
+
+int image_discard(struct image_t *img, uint64_t off, uint64_t len)
+{
+    static const uint8_t zero[IMAGE_BLOCK_SIZE];
+
+    if(off > img->len || len > img->len - off || (img->read_only && !img->cow))
+        return -1;
+    if(!img->cow && !img->is_private)
+        return image_fd_zero(img->fd, off, len);
+
+    while(len) {
+        uint64_t n = IMAGE_BLOCK_SIZE - (off & IMAGE_BLOCK_MASK);
+        if(n > len)
+            n = len;
+        if(img->cow && !img->is_private && n == IMAGE_BLOCK_SIZE) {
+            //whole block, a hole in the overlay that hides the base
+            uint64_t blk = off >> IMAGE_BLOCK_SHIFT;
+            pthread_mutex_lock(&img->cow_lock);
+            if(image_fd_zero(img->cow_fd, img->cow->header_size + off, n) < 0) {
+                pthread_mutex_unlock(&img->cow_lock);
+                return -1;
+            }
+            if(!(__atomic_fetch_or(&img->bitmap[blk >> 6], 1ULL << (blk & 63), __ATOMIC_RELEASE) &
+             (1ULL << (blk & 63))))
+                img->cow->allocated++;
+            pthread_mutex_unlock(&img->cow_lock);
+        } else if(image_block_rw(img, (void *)zero, n, off, 1) < 0) {
+            return -1;
+        }
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+void image_show(struct image_t *img)
+{
+    struct image_win_t *w = img->cow ? &img->cow_win : &img->win;
+    if(img->cow)
+        DEBUG_PRINTF("%s: overlay, %llu blocks allocated\n", img->filename,
+         (unsigned long long)img->cow->allocated);
+    if(img->cz)
+        DEBUG_PRINTF("%s: compressed, %u chunks, cache %llu hits, %llu misses\n", img->filename,
+         img->cz->h.chunks, (unsigned long long)img->cz->hits, (unsigned long long)img->cz->misses);
+    if(w->map)
+        DEBUG_PRINTF("%s: %u of %u windows mapped, %llu maps, %llu evictions\n", img->filename,
+         w->mapped, w->count, (unsigned long long)w->maps, (unsigned long long)w->evictions);
+}
+
+
+/******************************tools*****************************************/
+
+/* image size seen by the guest, raw or compressed */
+static int image_size(const char *path, uint64_t *size)
+{
+    struct image_t img = {
+        .fd = -1,
+        .cow_fd = -1,
+    };
+    if(image_base_open(&img, path, 0) < 0) {
+        image_close(&img);
+        return -1;
+    }
+    *size = img.len;
+    image_close(&img);
+    return 0;
+}
+
+
+int image_cow_create(const char *filename, const char *base)
+{
+    struct image_cow_header_t h;
+    char path[PATH_MAX];
+    uint64_t size;
+    int fd;
+
+    if(image_size(base, &size) < 0)
+        return -1;
+    if(size == 0) {
+        ERROR_PRINTF("%s: empty base\n", base);
+        return -1;
+    }
+    //an absolute path, the overlay may be opened from anywhere
+    if(!realpath(base, path) || strlen(path) >= IMAGE_COW_BASE_MAX) {
+        ERROR_PRINTF("%s: base path err\n", base);
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = IMAGE_COW_MAGIC;
+    h.version = IMAGE_COW_VERSION;
+    h.block_shift = IMAGE_BLOCK_SHIFT;
+    h.size = size;
+    h.header_size = image_cow_header_size(h.size);
+    strcpy(h.base, path);
+
+    fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+        ERROR_PRINTF("%s: create err\n", filename);
+        return -1;
+    }
+    if(pwrite_full(fd, &h, sizeof(h), 0) < 0 || ftruncate(fd, h.header_size + h.size) < 0) {
+        ERROR_PRINTF("%s: write err\n", filename);
+        close(fd);
+        unlink(filename);
+        return -1;
+    }
+    close(fd);
+    DEBUG_PRINTF("%s: overlay on %s, %llu bytes\n", filename, path, (unsigned long long)h.size);
+    return 0;
+}
+
+
+static int image_cow_load(const char *filename, int flags, struct image_cow_header_t *h,
+ uint64_t **bitmap)
+{
+    int fd = open(filename, flags);
+    if(fd < 0) {
+        ERROR_PRINTF("%s: open err\n", filename);
+        return -1;
+    }
+    if(pread_full(fd, h, sizeof(*h), 0) < 0 || h->magic != IMAGE_COW_MAGIC) {
+        ERROR_PRINTF("%s: not an overlay\n", filename);
+        goto err;
+    }
+    if(image_cow_header_check(h, filename) < 0)
+        goto err;
+    *bitmap = malloc(h->header_size - IMAGE_BLOCK_SIZE);
+    if(!*bitmap)
+        goto err;
+    if(pread_full(fd, *bitmap, h->header_size - IMAGE_BLOCK_SIZE, IMAGE_BLOCK_SIZE) < 0) {
+        free(*bitmap);
+        goto err;
+    }
+    return fd;
+err:
+    close(fd);
+    return -1;
+}
+
+
+/* forget every block, the data region becomes one hole */
+static int image_cow_reset(int fd, struct image_cow_header_t *h, uint64_t *bitmap)
+{
+    memset(bitmap, 0, h->header_size - IMAGE_BLOCK_SIZE);
+    h->allocated = 0;
+    if(pwrite_full(fd, bitmap, h->header_size - IMAGE_BLOCK_SIZE, IMAGE_BLOCK_SIZE) < 0 ||
+     pwrite_full(fd, h, sizeof(*h), 0) < 0 ||
+     ftruncate(fd, h->header_size) < 0 || ftruncate(fd, h->header_size + h->size) < 0 ||
+     image_fd_sync(fd) < 0)
+        return -1;
+    return 0;
+}
+
+
+/* image_cow_commit: write the allocated blocks into the base, then empty the overlay */
+int image_cow_commit(const char *filename)
+{
+    struct image_cow_header_t h;
+    uint64_t *bitmap, blocks, count = 0;
+    uint8_t buf[IMAGE_BLOCK_SIZE];
+    char path[PATH_MAX];
+    int fd, base_fd, ret = -1;
+
+    fd = image_cow_load(filename, O_RDWR, &h, &bitmap);
+    if(fd < 0)
+        return -1;
+    image_cow_base_path(path, sizeof(path), filename, h.base);
+    base_fd = open(path, O_RDWR);
+    if(base_fd < 0) {
+        ERROR_PRINTF("%s: open base %s err\n", filename, path);
+        goto out;
+    }
+    if(pread_full(base_fd, buf, sizeof(uint32_t), 0) == 0 && *(uint32_t *)buf == IMAGE_CZ_MAGIC) {
+        ERROR_PRINTF("%s: base %s is compressed, read-only\n", filename, path);
+        goto out;
+    }
+    blocks = (h.size + IMAGE_BLOCK_MASK) >> IMAGE_BLOCK_SHIFT;
+    for(uint64_t blk = 0; blk < blocks; blk++) {
+        uint64_t start = blk << IMAGE_BLOCK_SHIFT;
+        size_t len = h.size - start < IMAGE_BLOCK_SIZE ? h.size - start : IMAGE_BLOCK_SIZE;
+        if(!(bitmap[blk >> 6] & (1ULL << (blk & 63))))
+            continue;
+        if(pread_full(fd, buf, len, h.header_size + start) < 0 ||
+         pwrite_full(base_fd, buf, len, start) < 0) {
+            ERROR_PRINTF("%s: commit block %llu err\n", filename, (unsigned long long)blk);
+            goto out;
+        }
+        count++;
+    }
+    //the base holds the data before the overlay lets go of it
+    if(image_fd_sync(base_fd) < 0 || image_cow_reset(fd, &h, bitmap) < 0) {
+        ERROR_PRINTF("%s: sync err\n", filename);
+        goto out;
+    }
+    DEBUG_PRINTF("%s: %llu blocks committed to %s\n", filename, (unsigned long long)count, path);
+    ret = 0;
+out:
+    if(base_fd >= 0)
+        close(base_fd);
+    close(fd);
+    free(bitmap);
+    return ret;
+}
+
+
+int image_cow_discard(const char *filename)
+{
+    struct image_cow_header_t h;
+    uint64_t *bitmap;
+    int fd, ret;
+
+    fd = image_cow_load(filename, O_RDWR, &h, &bitmap);
+    if(fd < 0)
+        return -1;
+    ret = image_cow_reset(fd, &h, bitmap);
+    if(ret < 0)
+        ERROR_PRINTF("%s: write err\n", filename);
+    else
+        DEBUG_PRINTF("%s: discarded\n", filename);
+    close(fd);
+    free(bitmap);
+    return ret;
+}
+
+
+int image_info(const char *filename)
+{
+    struct image_cow_header_t h;
+    uint64_t *bitmap, count = 0;
+    uint32_t magic = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        ERROR_PRINTF("%s: open err\n", filename);
+        return -1;
+    }
+    if(pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+        magic = 0;
+    if(magic == IMAGE_CZ_MAGIC) {
+        struct image_cz_header_t cz;
+        if(pread_full(fd, &cz, sizeof(cz), 0) < 0) {
+            close(fd);
+            return -1;
+        }
+        printf("%s: compressed, %llu bytes in %u chunks of %u, %llu bytes on disk\n", filename,
+         (unsigned long long)cz.size, cz.chunks, 1U << cz.chunk_shift,
+         (unsigned long long)lseek(fd, 0L, SEEK_END));
+        close(fd);
+        return 0;
+    }
+    if(magic != IMAGE_COW_MAGIC) {
+        printf("%s: raw, %llu bytes\n", filename, (unsigned long long)lseek(fd, 0L, SEEK_END));
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    fd = image_cow_load(filename, O_RDONLY, &h, &bitmap);
+    if(fd < 0)
+        return -1;
+    for(uint32_t i = 0; i < (h.header_size - IMAGE_BLOCK_SIZE) / 8; i++)
+        count += __builtin_popcountll(bitmap[i]);
+    printf("%s: overlay on %s, %llu bytes, %llu of %llu blocks allocated\n", filename, h.base,
+     (unsigned long long)h.size, (unsigned long long)count,
+     (unsigned long long)((h.size + IMAGE_BLOCK_MASK) >> IMAGE_BLOCK_SHIFT));
+    close(fd);
+    free(bitmap);
+    return 0;
+}
+
+
+/*
+ * image_cz_convert: compress a raw image chunk by chunk, the index is
+ * written last, so a cut short conversion has no valid chunk table.
+ */
+int image_cz_convert(const char *raw, const char *filename)
+{
+#ifdef USE_ZLIB_SUPPORT
+    struct image_cz_header_t h;
+    uint64_t chunk_size = 1ULL << IMAGE_CZ_CHUNK_SHIFT;
+    uint64_t *index = NULL, pos;
+    uint8_t *buf = NULL, *zbuf = NULL;
+    uLong zbuf_len = compressBound(chunk_size);
+    int raw_fd, fd = -1, ret = -1;
+
+    raw_fd = open(raw, O_RDONLY);
+    if(raw_fd < 0) {
+        ERROR_PRINTF("%s: open err\n", raw);
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = IMAGE_CZ_MAGIC;
+    h.version = IMAGE_CZ_VERSION;
+    h.chunk_shift = IMAGE_CZ_CHUNK_SHIFT;
+    h.size = lseek(raw_fd, 0L, SEEK_END);
+    h.chunks = (h.size + chunk_size - 1) >> h.chunk_shift;
+    h.index_offset = sizeof(h);
+    index = malloc((h.chunks + 1ULL) * sizeof(uint64_t));
+    buf = malloc(chunk_size);
+    zbuf = malloc(zbuf_len);
+    if(!index || !buf || !zbuf)
+        goto out;
+    fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+        ERROR_PRINTF("%s: create err\n", filename);
+        goto out;
+    }
+    pos = h.index_offset + (h.chunks + 1ULL) * sizeof(uint64_t);
+    for(uint32_t i = 0; i < h.chunks; i++) {
+        uint64_t start = (uint64_t)i << h.chunk_shift;
+        uint64_t ulen = h.size - start < chunk_size ? h.size - start : chunk_size;
+        uLongf clen = zbuf_len;
+        const uint8_t *data = zbuf;
+        if(pread_full(raw_fd, buf, ulen, start) < 0) {
+            ERROR_PRINTF("%s: read err\n", raw);
+            goto err;
+        }
+        if(compress2(zbuf, &clen, buf, ulen, Z_BEST_COMPRESSION) != Z_OK || clen >= ulen) {
+            //stored as is
+            data = buf;
+            clen = ulen;
+        }
+        if(pwrite_full(fd, data, clen, pos) < 0) {
+            ERROR_PRINTF("%s: write err\n", filename);
+            goto err;
+        }
+        index[i] = pos;
+        pos += clen;
+    }
+    index[h.chunks] = pos;
+    if(pwrite_full(fd, index, (h.chunks + 1ULL) * sizeof(uint64_t), h.index_offset) < 0 ||
+     pwrite_full(fd, &h, sizeof(h), 0) < 0 || image_fd_sync(fd) < 0) {
+        ERROR_PRINTF("%s: write err\n", filename);
+        goto err;
+    }
+    DEBUG_PRINTF("%s: %llu bytes compressed to %llu\n", filename, (unsigned long long)h.size,
+     (unsigned long long)pos);
+    ret = 0;
+    goto out;
+err:
+    unlink(filename);
+out:
+    if(fd >= 0)
+        close(fd);
+    close(raw_fd);
+    free(index);
+    free(buf);
+    free(zbuf);
+    return ret;
+#else
+    ERROR_PRINTF("built without zlib\n");
+    return -1;
+#endif
+}
+
+/******************************tools*****************************************/
+
+/*****************************END OF FILE***************************/
@@ -0,0 +1,185 @@
+/*
+ * image.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define IMAGE_BLOCK_SHIFT    (12)
+#define IMAGE_BLOCK_SIZE     (1 << IMAGE_BLOCK_SHIFT)
+
+/*
+ * copy-on-write overlay, a sparse file:
+ *  [0, 4K)                 struct image_cow_header_t
+ *  [4K, header_size)       allocation bitmap, one bit per block
+ *  [header_size, +size)    blocks at their offset in the image, holes
+ *                          where the bitmap bit is clear
+ * Allocated blocks are read from the overlay, the others from the
+ * base image, which is opened read-only.
+ */
+#define IMAGE_COW_MAGIC      (0x574f4341)  /* "ACOW" */
+#define IMAGE_COW_VERSION    (1)
+#define IMAGE_COW_BASE_MAX   (256)
+
+struct image_cow_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_shift;     //IMAGE_BLOCK_SHIFT
+    uint32_t header_size;     //file offset of block 0, block aligned
+    uint64_t size;            //image size, equal to the base size
+    uint64_t allocated;       //blocks set in the bitmap, informational
+    char base[IMAGE_COW_BASE_MAX]; //base path, relative to the overlay directory
+};
+
+/*
+ * compressed image, read-only:
+ *  [0, 64)                 struct image_cz_header_t
+ *  [64, +8 * (chunks + 1)) file offset of every chunk and of the end
+ *  data                    chunks compressed one by one with zlib, a
+ *                          chunk that does not shrink is stored as is
+ */
+#define IMAGE_CZ_MAGIC       (0x504d4341)  /* "ACMP" */
+#define IMAGE_CZ_VERSION     (1)
+#define IMAGE_CZ_CHUNK_SHIFT (16)          /* 64K, 16 blocks */
+#define IMAGE_CZ_CACHE       (64)          /* decompressed chunks kept, LRU */
+
+struct image_cz_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_shift;
+    uint32_t chunks;
+    uint64_t size;            //image size
+    uint64_t index_offset;
+    uint8_t reserved[32];
+};
+
+struct image_cz_t;
+
+/*
+ * a file is mapped a window at a time when touched, at most
+ * IMAGE_WINDOWS windows stay mapped, the least recently used one is
+ * unmapped first, a private (cloned) file keeps all of its windows
+ */
+#define IMAGE_WINDOW_SHIFT   (25)          /* 32M */
+#define IMAGE_WINDOW_SIZE    (1ULL << IMAGE_WINDOW_SHIFT)
+#define IMAGE_WINDOWS        (8)
+#define IMAGE_READAHEAD      (2 << 20)     /* hint ahead of sequential access */
+
+struct image_win_t {
+    int fd;
+    uint64_t offset;          //file offset of image byte 0
+    uint64_t len;
+    int prot;
+    uint8_t is_private;
+    uint32_t count;
+    uint32_t mapped;
+    uint8_t **map;            //per window, NULL while not mapped
+    uint64_t *used;           //LRU tick per window
+    uint64_t tick;
+    uint32_t last;            //last window mapped
+    uint64_t maps;
+    uint64_t evictions;
+    pthread_mutex_t lock;     //mapping and eviction
+};
+
+struct image_t {
+    const char *filename;
+    uint64_t len;
+    int fd;                   //raw image, or base of an overlay
+    struct image_win_t win;   //fd, read-only for an overlay base, unused if compressed
+    struct image_cz_t *cz;    //compressed image, or compressed base of an overlay
+    uint8_t is_private;       //cloned machine, writes stay in this process
+    uint8_t read_only;
+    uint64_t next_off;        //end of the last request, sequential access
+
+    //overlay
+    int cow_fd;
+    uint8_t *cow_map;         //header and bitmap
+    uint32_t cow_map_len;
+    struct image_cow_header_t *cow;
+    uint64_t *bitmap;
+    struct image_win_t cow_win; //blocks
+    pthread_mutex_t cow_lock; //serializes copy-up
+};
+
+int image_open(struct image_t *img, const char *filename);
+void image_close(struct image_t *img);
+/* cloned machine, remap the writable parts private */
+int image_fork_child(struct image_t *img);
+
+uint8_t *image_win_map(struct image_win_t *w, uint64_t off);
+uint8_t *image_cow_copy(struct image_t *img, uint64_t off);
+
+static inline uint8_t *image_win_ptr(struct image_win_t *w, uint64_t off)
+{
+    uint32_t i = off >> IMAGE_WINDOW_SHIFT;
+    uint8_t *p = __atomic_load_n(&w->map[i], __ATOMIC_ACQUIRE);
+    w->used[i] = ++w->tick;
+    if(!p)
+        return image_win_map(w, off);
+    return p + (off & (IMAGE_WINDOW_SIZE - 1));
+}
+
+/*
+ * image_ptr: pointer to the byte at off, valid up to the end of its
+ * block, off < len, write: the caller stores through the pointer,
+ * return: NULL on error, or to read a compressed block by image_read.
+ * A window may be unmapped by the next call, so on a shared image
+ * only one thread (the cpu) uses pointers, the others image_rw.
+ */
+static inline uint8_t *image_ptr(struct image_t *img, uint64_t off, int write)
+{
+    if(img->cow) {
+        uint64_t blk = off >> IMAGE_BLOCK_SHIFT;
+        if(__atomic_load_n(&img->bitmap[blk >> 6], __ATOMIC_ACQUIRE) & (1ULL << (blk & 63)))
+            return image_win_ptr(&img->cow_win, off);
+        if(write)
+            return image_cow_copy(img, off);
+    } else if(write && img->read_only) {
+        return NULL;
+    }
+    return img->win.map ? image_win_ptr(&img->win, off) : NULL;
+}
+
+/* from any thread, return: 0 done, -1 error */
+int image_read(struct image_t *img, void *buf, size_t len, uint64_t off);
+/* from any thread, iov is consumed, return: 0 done, -1 error */
+int image_rw(struct image_t *img, struct iovec *iov, int cnt, uint64_t off, int write);
+int image_flush(struct image_t *img);
+int image_discard(struct image_t *img, uint64_t off, uint64_t len);
+
+/* plain files, from any thread, return: 0 done, -1 error */
+int image_fd_rw(int fd, struct iovec *iov, int cnt, uint64_t off, int write);
+int image_fd_zero(int fd, uint64_t off, uint64_t len);
+int image_fd_sync(int fd);
+
+void image_show(struct image_t *img);
+
+/* image tools, return: 0 done, -1 error */
+int image_cow_create(const char *filename, const char *base);
+int image_cow_commit(const char *filename);
+int image_cow_discard(const char *filename);
+int image_info(const char *filename);
+/* compress a raw image */
+int image_cz_convert(const char *raw, const char *filename);
+
+#endif
+/*****************************END OF FILE***************************/
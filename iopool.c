@@ -0,0 +1,122 @@
+/*
+ * iopool.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iopool.h>
+#include <config.h>
+
+#ifdef USE_PRCTL_SET_THREAD_NAME
+#include <sys/prctl.h>
+#endif
+
+#define LOG_NAME   "iopool"
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+/*
+ * Host threads for blocking I/O of devices, the cpu thread queues
+ * work and goes on, completion is reported by the work itself,
+ * e.g. by marking a descriptor done and raising an interrupt.
+ */
+
+static void *iopool_proc(void *base)
+{
+    struct iopool_t *pool = (struct iopool_t *)base;
+#ifdef USE_PRCTL_SET_THREAD_NAME
+    prctl(PR_SET_NAME, pool->name);
+#endif
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->is_run && !pool->head)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        struct iopool_work_t *w = pool->head;
+        if(!w)
+            break;
+        pool->head = w->next;
+        if(!pool->head)
+            pool->tail = &pool->head;
+        pthread_mutex_unlock(&pool->lock);
+
+        w->fn(w);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->busy == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int iopool_init(struct iopool_t *pool, const char *name, int threads)
+{
+    if(threads > IOPOOL_THREADS_MAX)
+        threads = IOPOOL_THREADS_MAX;
+    pool->name = name;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->head = NULL;
+    pool->tail = &pool->head;
+    pool->busy = 0;
+    pool->is_run = 1;
+    for(pool->threads = 0; pool->threads < threads; pool->threads++) {
+        if(pthread_create(&pool->thread_id[pool->threads], 0, iopool_proc, pool) != 0) {
+            ERROR_PRINTF("%s create thread err\n", name);
+            iopool_exit(pool);
+            return -1;
+        }
+    }
+    DEBUG_PRINTF("%s %d threads\n", name, threads);
+    return 0;
+}
+
+void iopool_exit(struct iopool_t *pool)
+{
+    if(!pool->is_run)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->is_run = 0;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->threads; i++)
+        pthread_join(pool->thread_id[i], NULL);
+    pool->threads = 0;
+}
+
+void iopool_submit(struct iopool_t *pool, struct iopool_work_t *w)
+{
+    w->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    *pool->tail = w;
+    pool->tail = &w->next;
+    pool->busy++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void iopool_drain(struct iopool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->busy)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*****************************END OF FILE***************************/
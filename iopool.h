@@ -0,0 +1,55 @@
+/*
+ * iopool.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _IOPOOL_H_
+#define _IOPOOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define IOPOOL_THREADS_MAX   (16)
+
+/* a piece of blocking host work, fn runs on one of the pool threads */
+struct iopool_work_t {
+    void (* fn)(struct iopool_work_t *w);
+    struct iopool_work_t *next;
+};
+
+struct iopool_t {
+    const char *name;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    //work queued or stop
+    pthread_cond_t idle;    //queue empty and no work running
+    struct iopool_work_t *head;
+    struct iopool_work_t **tail;
+    uint32_t busy;          //queued + running
+    uint8_t is_run;
+    int threads;
+    pthread_t thread_id[IOPOOL_THREADS_MAX];
+};
+
+int iopool_init(struct iopool_t *pool, const char *name, int threads);
+/* waits for the queued work, then joins the threads */
+void iopool_exit(struct iopool_t *pool);
+/* from any thread */
+void iopool_submit(struct iopool_t *pool, struct iopool_work_t *w);
+/* wait until all work submitted so far is done */
+void iopool_drain(struct iopool_t *pool);
+
+#endif
+/*****************************END OF FILE***************************/
@@ -114,11 +114,6 @@ static void kfifo_copy_in(struct __kfifo *fifo, const void *src,
 
     memcpy( (unsigned char *)fifo->data + off, src, l);
     memcpy( fifo->data, (unsigned char *)src + l, len - l);
-    /*
-     * make sure that the data in the fifo is up to date before
-     * incrementing the fifo->in index counter
-     */
-    smp_wmb();
 }
 
 unsigned int __kfifo_in(struct __kfifo *fifo,
@@ -131,7 +126,11 @@ unsigned int __kfifo_in(struct __kfifo *fifo,
         len = l;
 
     kfifo_copy_in(fifo, buf, len, fifo->in);
-    fifo->in += len;
+    /*
+     * make sure that the data in the fifo is up to date before
+     * incrementing the fifo->in index counter
+     */
+    __atomic_store_n(&fifo->in, fifo->in + len, __ATOMIC_RELEASE);
     return len;
 }
 
@@ -152,11 +151,6 @@ static void kfifo_copy_out(struct __kfifo *fifo, void *dst,
 
     memcpy(dst, (unsigned char *)fifo->data + off, l);
     memcpy((unsigned char *)dst + l, fifo->data, len - l);
-    /*
-     * make sure that the data is copied before
-     * incrementing the fifo->out index counter
-     */
-    smp_wmb();
 }
 
 unsigned int __kfifo_out_peek(struct __kfifo *fifo,
@@ -164,7 +158,7 @@ unsigned int __kfifo_out_peek(struct __kfifo *fifo,
 {
     unsigned int l;
 
-    l = fifo->in - fifo->out;
+    l = __atomic_load_n(&fifo->in, __ATOMIC_ACQUIRE) - fifo->out;
     if (len > l)
         len = l;
 
@@ -176,7 +170,11 @@ unsigned int __kfifo_out(struct __kfifo *fifo,
         void *buf, unsigned int len)
 {
     len = __kfifo_out_peek(fifo, buf, len);
-    fifo->out += len;
+    /*
+     * make sure that the data is copied before
+     * incrementing the fifo->out index counter
+     */
+    __atomic_store_n(&fifo->out, fifo->out + len, __ATOMIC_RELEASE);
     return len;
 }
 
@@ -208,10 +206,39 @@ unsigned int __kfifo_out_peek_one(struct __kfifo *fifo,
 {
     unsigned int l;
 
-    l = fifo->in - fifo->out;
+    l = __atomic_load_n(&fifo->in, __ATOMIC_ACQUIRE) - fifo->out;
     if (len > l)
         len = l;
 
     kfifo_copy_out_one(fifo, buf, len, fifo->out);
     return len;
 }
+
+
+unsigned int __kfifo_in_reserve(struct __kfifo *fifo, void **buf)
+{
+    unsigned int off = fifo->in & fifo->mask;
+    unsigned int l = kfifo_unused(fifo);
+
+    *buf = (unsigned char *)fifo->data + off * fifo->esize;
+    return min(l, fifo->mask + 1 - off);
+}
+
+void __kfifo_in_commit(struct __kfifo *fifo, unsigned int len)
+{
+    __atomic_store_n(&fifo->in, fifo->in + len, __ATOMIC_RELEASE);
+}
+
+unsigned int __kfifo_out_linear(struct __kfifo *fifo, void **buf)
+{
+    unsigned int off = fifo->out & fifo->mask;
+    unsigned int l = __atomic_load_n(&fifo->in, __ATOMIC_ACQUIRE) - fifo->out;
+
+    *buf = (unsigned char *)fifo->data + off * fifo->esize;
+    return min(l, fifo->mask + 1 - off);
+}
+
+void __kfifo_out_commit(struct __kfifo *fifo, unsigned int len)
+{
+    __atomic_store_n(&fifo->out, fifo->out + len, __ATOMIC_RELEASE);
+}
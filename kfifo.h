@@ -48,21 +48,29 @@
  *  For multiple writer and one reader there is only a need to lock the writer.
  * And vice versa for only one writer and multiple reader there is only a need
  * to lock the reader.
+ *
+ * The writer publishes @in with a release store after copying the data,
+ * the reader publishes @out the same way after copying it out, each side
+ * loads the other index with acquire. @in and @out sit in their own cache
+ * lines so the two threads do not bounce one line on every byte.
  */
 
 #include <stdio.h>
 
 
-#define smp_wmb()
 #define gfp_t int
 
+#define KFIFO_CACHE_LINE    (64)
+
 struct __kfifo {
-    unsigned int    in;
-    unsigned int    out;
     unsigned int    mask;
     unsigned int    esize;
     void        *data;
-};
+    /* written by the producer only */
+    unsigned int    in __attribute__((aligned(KFIFO_CACHE_LINE)));
+    /* written by the consumer only */
+    unsigned int    out __attribute__((aligned(KFIFO_CACHE_LINE)));
+} __attribute__((aligned(KFIFO_CACHE_LINE)));
 
 
 /**
@@ -82,7 +90,18 @@ struct __kfifo {
  */
 static inline unsigned int kfifo_unused(struct __kfifo *fifo)
 {
-    return (fifo->mask + 1) - (fifo->in - fifo->out);
+    return (fifo->mask + 1) - (__atomic_load_n(&fifo->in, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&fifo->out, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * kfifo_len - returns the number of used elements in the fifo
+ * @fifo: address of the fifo to be used
+ */
+static inline unsigned int kfifo_len(struct __kfifo *fifo)
+{
+    return __atomic_load_n(&fifo->in, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&fifo->out, __ATOMIC_ACQUIRE);
 }
 
 /*
@@ -110,4 +129,18 @@ unsigned int __kfifo_out(struct __kfifo *fifo,
 unsigned int __kfifo_out_peek_one(struct __kfifo *fifo,
         void *buf, unsigned int len);
 
+/*
+ * zero-copy producer: reserve returns how many elements can be written
+ * contiguously at *buf, commit publishes the first len of them.
+ */
+unsigned int __kfifo_in_reserve(struct __kfifo *fifo, void **buf);
+void __kfifo_in_commit(struct __kfifo *fifo, unsigned int len);
+
+/*
+ * zero-copy consumer: linear returns how many elements can be read
+ * contiguously at *buf, commit releases the first len of them.
+ */
+unsigned int __kfifo_out_linear(struct __kfifo *fifo, void **buf);
+void __kfifo_out_commit(struct __kfifo *fifo, unsigned int len);
+
 #endif
@@ -0,0 +1,239 @@
+/*
+ * ksm.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ksm.h>
+#include <config.h>
+
+#define LOG_NAME   "ksm"
+#define PRINTF(...)           printf(LOG_NAME ": " __VA_ARGS__)
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+/*
+ * Same page merging of guest RAM.
+ * Zero pages which stay zero for two passes are given back to the host,
+ * reading them maps the shared zero page and the first write breaks it.
+ * Identical pages of this and other machines are merged by the host KSM,
+ * the RAM mapping is registered as mergeable, the scanner only hashes
+ * them to report how many duplicates the guest has.
+ * The scanner runs on the cpu thread, so the guest can not write a page
+ * while it is checked and discarded. Device threads writing RAM hold
+ * memory_host_begin(), pages are discarded only when none does, after
+ * checking again that they are still zero.
+ */
+
+#define PAGE_ZERO_ONCE   (1 << 0)
+#define PAGE_MERGED      (1 << 1)
+
+#define HASH_TABLE_SIZE  (MEM_PAGE_NUMBER * 2)
+
+struct ksm_t {
+    uint32_t page;
+    uint8_t state[MEM_PAGE_NUMBER];
+    uint32_t hash[MEM_PAGE_NUMBER];
+    //page + 1 of the first page of a hash in this pass, 0 empty
+    uint32_t table[HASH_TABLE_SIZE];
+
+    uint32_t full_scans;
+    uint32_t pass_zero;
+    uint32_t pass_merged;
+    uint32_t pass_duplicate;
+    //result of last full pass
+    uint32_t pages_zero;
+    uint32_t pages_merged;
+    uint32_t pages_duplicate;
+};
+
+static struct ksm_t *ksm = NULL;
+
+
+/* return: 0 zero page, else page hash */
+static uint32_t page_hash(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0, any = 0;
+    for(int i=0; i<MEM_PAGE_SIZE/sizeof(uint64_t); i++) {
+        any |= w[i];
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+    }
+    if(!any)
+        return 0;
+    h ^= h >> 32;
+    return (uint32_t)h ? (uint32_t)h : 1;
+}
+
+static void ksm_table_insert(struct ksm_t *k, struct memory_t *m, uint32_t page)
+{
+    uint32_t idx = k->hash[page] % HASH_TABLE_SIZE;
+    for(int probe=0; probe<HASH_TABLE_SIZE; probe++) {
+        uint32_t first = k->table[idx];
+        if(!first) {
+            k->table[idx] = page + 1;
+            return;
+        }
+        first--;
+        if(k->hash[first] == k->hash[page] &&
+         memcmp(m->mem + (first << MEM_PAGE_SHIFT), m->mem + (page << MEM_PAGE_SHIFT),
+          MEM_PAGE_SIZE) == 0) {
+            k->pass_duplicate++;
+            return;
+        }
+        idx = (idx + 1) % HASH_TABLE_SIZE;
+    }
+}
+
+static void ksm_discard(struct ksm_t *k, struct memory_t *m, uint32_t page, uint32_t count)
+{
+    uint32_t start = page, end = page + count;
+    if(!count)
+        return;
+    if(memory_host_trylock(m) < 0) {
+        //a device is writing RAM, the pages are tried again next pass
+        k->pass_merged -= count;
+        return;
+    }
+    for(; page < end; page++) {
+        if(!page_hash(m->mem + (page << MEM_PAGE_SHIFT)))
+            continue;
+        //written by a device since it was scanned
+        k->state[page] = 0;
+        k->pass_merged--;
+        if(page > start)
+            memory_discard(m, start << MEM_PAGE_SHIFT, (page - start) << MEM_PAGE_SHIFT);
+        start = page + 1;
+    }
+    if(end > start)
+        memory_discard(m, start << MEM_PAGE_SHIFT, (end - start) << MEM_PAGE_SHIFT);
+    memory_host_end(m);
+}
+
+
+int ksm_init(struct memory_t *m)
+{
+    ksm = calloc(1, sizeof(struct ksm_t));
+    if(!ksm) {
+        ERROR_PRINTF("alloc err\n");
+        return -1;
+    }
+#ifdef MADV_MERGEABLE
+    if(m->shm) {
+        //the host merges private anonymous pages only
+        DEBUG_PRINTF("RAM is a shared file, host merging skipped\n");
+    } else if(madvise(m->mem, MEM_SIZE, MADV_MERGEABLE) < 0) {
+        ERROR_PRINTF("madvise mergeable err, host merging disabled\n");
+    }
+#else
+    ERROR_PRINTF("host merging is not supported in this build\n");
+#endif
+    DEBUG_PRINTF("scan %d pages every %d instructions\n", KSM_SCAN_PAGES, KSM_SCAN_RATE + 1);
+    return 0;
+}
+
+
+/* from cpu thread */
+void ksm_scan(struct memory_t *m)
+{
+    struct ksm_t *k = ksm;
+    uint32_t run_start = 0, run_len = 0;
+    if(!k)
+        return;
+
+    for(int i=0; i<KSM_SCAN_PAGES; i++) {
+        uint32_t page = k->page;
+        uint32_t hash = page_hash(m->mem + (page << MEM_PAGE_SHIFT));
+        k->hash[page] = hash;
+        if(hash) {
+            k->state[page] = 0;
+            ksm_table_insert(k, m, page);
+        } else {
+            k->pass_zero++;
+            if(k->state[page] & (PAGE_ZERO_ONCE | PAGE_MERGED)) {
+                //stable zero page, coalesce runs into one madvise
+                if(run_len && run_start + run_len != page) {
+                    ksm_discard(k, m, run_start, run_len);
+                    run_len = 0;
+                }
+                if(!run_len)
+                    run_start = page;
+                run_len++;
+                k->pass_merged++;
+                k->state[page] = PAGE_MERGED;
+            } else {
+                k->state[page] = PAGE_ZERO_ONCE;
+            }
+        }
+
+        if(++k->page >= MEM_PAGE_NUMBER) {
+            ksm_discard(k, m, run_start, run_len);
+            run_len = 0;
+            k->page = 0;
+            k->full_scans++;
+            k->pages_zero = k->pass_zero;
+            k->pages_merged = k->pass_merged;
+            k->pages_duplicate = k->pass_duplicate;
+            k->pass_zero = 0;
+            k->pass_merged = 0;
+            k->pass_duplicate = 0;
+            memset(k->table, 0, sizeof(k->table));
+        }
+    }
+    ksm_discard(k, m, run_start, run_len);
+}
+
+
+static long read_ulong(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    long val = -1;
+    if(!fp)
+        return -1;
+    if(fscanf(fp, "%ld", &val) != 1)
+        val = -1;
+    fclose(fp);
+    return val;
+}
+
+void ksm_show(void)
+{
+    struct ksm_t *k = ksm;
+    long host_sharing, host_merging;
+    if(!k) {
+        PRINTF("scanner disabled, use -k\n");
+        return;
+    }
+    PRINTF("full scans: %u\n", k->full_scans);
+    PRINTF("zero pages: %u / %u\n", k->pages_zero, MEM_PAGE_NUMBER);
+    PRINTF("zero pages given back to host: %u\n", k->pages_merged);
+    PRINTF("duplicate pages: %u\n", k->pages_duplicate);
+
+    host_sharing = read_ulong("/sys/kernel/mm/ksm/pages_sharing");
+    if(host_sharing < 0) {
+        PRINTF("host ksm: not available\n");
+        return;
+    }
+    host_merging = read_ulong("/proc/self/ksm_merging_pages");
+    PRINTF("host ksm pages sharing: %ld, run %ld\n", host_sharing,
+     read_ulong("/sys/kernel/mm/ksm/run"));
+    if(host_merging >= 0)
+        PRINTF("host ksm pages merged of this machine: %ld\n", host_merging);
+}
+
+/*****************************END OF FILE***************************/
@@ -0,0 +1,34 @@
+/*
+ * ksm.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <stdint.h>
+#include <peripheral.h>
+
+/* scan KSM_SCAN_PAGES pages every KSM_SCAN_RATE+1 instructions */
+#define KSM_SCAN_RATE     (0xffff)
+#define KSM_SCAN_PAGES    (32)
+
+int ksm_init(struct memory_t *m);
+void ksm_scan(struct memory_t *m);
+void ksm_show(void);
+
+#endif
+/*****************************END OF FILE***************************/
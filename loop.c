@@ -16,6 +16,7 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#define _GNU_SOURCE  /* pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,8 +24,17 @@
 
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <config.h>
 
+#ifdef USE_EPOLL_SUPPORT
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define LOOP_EPOLL_EVENTS   (32)
+#endif
+
 #ifdef USE_PRCTL_SET_THREAD_NAME
 #include <sys/prctl.h>
 #endif
@@ -61,19 +71,218 @@ static void loop_timer_callback(struct loop_t *lo)
     }
 }
 
+#define TIMER_AT(lo, i)   g_array_index((lo)->timers, struct loop_timer_t *, i)
+
+static void loop_timer_set(struct loop_t *lo, int i, struct loop_timer_t *t)
+{
+    TIMER_AT(lo, i) = t;
+    t->idx = i;
+}
+
+static void loop_timer_sift_up(struct loop_t *lo, int i)
+{
+    struct loop_timer_t *t = TIMER_AT(lo, i);
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(TIMER_AT(lo, parent)->expire_ns <= t->expire_ns)
+            break;
+        loop_timer_set(lo, i, TIMER_AT(lo, parent));
+        i = parent;
+    }
+    loop_timer_set(lo, i, t);
+}
+
+static void loop_timer_sift_down(struct loop_t *lo, int i)
+{
+    struct loop_timer_t *t = TIMER_AT(lo, i);
+    int len = lo->timers->len;
+    for(;;) {
+        int child = 2 * i + 1;
+        if(child >= len)
+            break;
+        if(child + 1 < len && TIMER_AT(lo, child + 1)->expire_ns < TIMER_AT(lo, child)->expire_ns)
+            child++;
+        if(t->expire_ns <= TIMER_AT(lo, child)->expire_ns)
+            break;
+        loop_timer_set(lo, i, TIMER_AT(lo, child));
+        i = child;
+    }
+    loop_timer_set(lo, i, t);
+}
+
+void loop_timer_del(struct loop_t *lo, struct loop_timer_t *t)
+{
+    int i = t->idx;
+    int last;
+    //not armed, the heap may be gone after loop_exit
+    if(i < 0)
+        return;
+    last = lo->timers->len - 1;
+    t->idx = -1;
+    if(i != last) {
+        //the last timer fills the hole
+        struct loop_timer_t *m = TIMER_AT(lo, last);
+        loop_timer_set(lo, i, m);
+        g_array_set_size(lo->timers, last);
+        loop_timer_sift_down(lo, i);
+        if(m->idx == i)
+            loop_timer_sift_up(lo, i);
+    } else {
+        g_array_set_size(lo->timers, last);
+    }
+}
+
+void loop_timer_mod(struct loop_t *lo, struct loop_timer_t *t, int64_t expire_ns)
+{
+    loop_timer_del(lo, t);
+    t->expire_ns = expire_ns;
+    g_array_append_val(lo->timers, t);
+    loop_timer_sift_up(lo, lo->timers->len - 1);
+}
+
+struct loop_timer_t *loop_timer_new(struct loop_t *lo, void (*cb)(void *opaque), void *opaque)
+{
+    struct loop_timer_t *t = malloc(sizeof(struct loop_timer_t));
+    if(!t) {
+        ERROR_PRINTF("timer alloc err\n");
+        return NULL;
+    }
+    t->expire_ns = 0;
+    t->idx = -1;
+    t->cb = cb;
+    t->opaque = opaque;
+    return t;
+}
+
+void loop_timer_free(struct loop_t *lo, struct loop_timer_t *t)
+{
+    if(!t)
+        return;
+    loop_timer_del(lo, t);
+    free(t);
+}
+
+/* wake up in time for the nearest timer */
+static void loop_timer_timeout(struct loop_t *lo)
+{
+    int64_t delta;
+    if(!lo->timers->len)
+        return;
+    delta = TIMER_AT(lo, 0)->expire_ns - loop_get_clock_ns(lo);
+    if(delta <= 0) {
+        loop_set_timeout(lo, 0);
+    } else if(delta < (int64_t)lo->poll_timeout * 1000000) {
+        loop_set_timeout(lo, (delta + 999999) / 1000000);
+    }
+}
+
+static void loop_timer_run(struct loop_t *lo)
+{
+    int64_t now = loop_get_clock_ns(lo);
+    while(lo->timers->len && TIMER_AT(lo, 0)->expire_ns <= now) {
+        struct loop_timer_t *t = TIMER_AT(lo, 0);
+        loop_timer_del(lo, t);
+        //the callback may re-arm or free the timer
+        t->cb(t->opaque);
+    }
+}
+
+/*
+ * loop_wait: sleep until a fd is ready, the timeout expires or the
+ * loop is notified, persistent fd callbacks are called here,
+ * return: events of prepare fds + persistent fds, or -1
+ */
+#ifdef USE_EPOLL_SUPPORT
+static int loop_wait(struct loop_t *lo)
+{
+    struct epoll_event events[LOOP_EPOLL_EVENTS];
+    int timeout = lo->poll_timeout;
+    int prepare_len = lo->gpollfds->len;
+    int epoll_ready = 1;
+    int r = 0, n;
+
+    for(int i=0; i<lo->fds->len; i++) {
+        if(g_array_index(lo->fds, struct loop_fd_t *, i)->events)
+            timeout = 0;
+    }
+    if(prepare_len) {
+        //fds of prepare callbacks change every iteration, poll them with the epoll fd
+        loop_add_poll(lo, lo->epoll_fd, POLLIN);
+        r = poll((struct pollfd *)lo->gpollfds->data, lo->gpollfds->len, timeout);
+        if(r < 0)
+            return r;
+        epoll_ready = loop_get_revents(lo, prepare_len) & POLLIN;
+        if(epoll_ready)
+            r--;
+        timeout = 0;
+    }
+    if(epoll_ready) {
+        n = epoll_wait(lo->epoll_fd, events, LOOP_EPOLL_EVENTS, timeout);
+        if(n < 0)
+            return n;
+        //EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP have the POLL* values
+        for(int i=0; i<n; i++) {
+            struct loop_fd_t *f = events[i].data.ptr;
+            f->cb(f->opaque, events[i].events);
+        }
+        r += n;
+    }
+    for(int i=0; i<lo->fds->len; i++) {
+        struct loop_fd_t *f = g_array_index(lo->fds, struct loop_fd_t *, i);
+        if(f->events) {
+            f->cb(f->opaque, f->events);
+            r++;
+        }
+    }
+    return r;
+}
+#else
+static int loop_wait(struct loop_t *lo)
+{
+    int r;
+    for(int i=0; i<lo->fds->len; i++) {
+        struct loop_fd_t *f = g_array_index(lo->fds, struct loop_fd_t *, i);
+        f->idx = f->events ? loop_add_poll(lo, f->fd, f->events) : -1;
+    }
+    r = poll((struct pollfd *)lo->gpollfds->data, lo->gpollfds->len, lo->poll_timeout);
+    if(r <= 0)
+        return r;
+    for(int i=0; i<lo->fds->len; i++) {
+        struct loop_fd_t *f = g_array_index(lo->fds, struct loop_fd_t *, i);
+        int revents = (f->idx < 0) ? 0 : loop_get_revents(lo, f->idx);
+        if(revents)
+            f->cb(f->opaque, revents);
+    }
+    return r;
+}
+#endif
+
 static void *loop_proc(void *base)
 {
     struct loop_t *lo = (struct loop_t *)base;
 #ifdef USE_PRCTL_SET_THREAD_NAME
     prctl(PR_SET_NAME, lo->thread_name);
+#endif
+#ifdef USE_THREAD_AFFINITY
+    if(lo->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(lo->cpu, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            ERROR_PRINTF("%s set affinity to cpu %d err\n", lo->thread_name, lo->cpu);
+    }
 #endif
     DEBUG_PRINTF("%s task enter success!\n", lo->thread_name);
     
     while(lo->is_run) {
         lo->poll_timeout = 2000;
         g_array_set_size(lo->gpollfds, 0);
+        //work queued after this point rings the doorbell
+        __atomic_store_n(&lo->notify_armed, 1, __ATOMIC_SEQ_CST);
         loop_prepare_callback(lo);
-        int r = poll((struct pollfd *)lo->gpollfds->data, lo->gpollfds->len, lo->poll_timeout);
+        loop_timer_timeout(lo);
+        int r = loop_wait(lo);
+        __atomic_store_n(&lo->notify_armed, 0, __ATOMIC_RELAXED);
         if(r < 0) {
             if(errno == EINTR)
                 continue;
@@ -84,7 +293,8 @@ static void *loop_proc(void *base)
         } else {
             loop_poll_callback(lo);
         }
-        lo->timer_cnt = clock()/(CLOCKS_PER_SEC/1000);
+        lo->timer_cnt = loop_get_clock_ns(lo) / 1000000;
+        loop_timer_run(lo);
     }
 
     lo->is_run = 0;
@@ -113,9 +323,143 @@ void loop_register(struct loop_t *lo, const struct loopcb_t *cb)
     g_array_append_val(lo->callback, cb);
 }
 
+static void loop_fds_remove(struct loop_t *lo, struct loop_fd_t *f)
+{
+    if(!lo->fds)
+        return;
+    for(int i=0; i<lo->fds->len; i++) {
+        if(g_array_index(lo->fds, struct loop_fd_t *, i) == f) {
+            g_array_remove_range(lo->fds, i, 1);
+            return;
+        }
+    }
+}
+
+#ifdef USE_EPOLL_SUPPORT
+int loop_add_fd(struct loop_t *lo, struct loop_fd_t *f)
+{
+    struct epoll_event ev = {
+        .events = f->events,
+        .data.ptr = f,
+    };
+    f->idx = -1;
+    f->always = 0;
+    if(epoll_ctl(lo->epoll_fd, EPOLL_CTL_ADD, f->fd, &ev) < 0) {
+        if(errno != EPERM) {
+            ERROR_PRINTF("epoll add fd %d err\n", f->fd);
+            return -1;
+        }
+        //not pollable, e.g. a regular file or /dev/null
+        f->always = 1;
+        g_array_append_val(lo->fds, f);
+    }
+    return 0;
+}
+
+int loop_mod_fd(struct loop_t *lo, struct loop_fd_t *f, int events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = f,
+    };
+    if(f->events == events)
+        return 0;
+    f->events = events;
+    if(f->always)
+        return 0;
+    return epoll_ctl(lo->epoll_fd, EPOLL_CTL_MOD, f->fd, &ev);
+}
+
+void loop_del_fd(struct loop_t *lo, struct loop_fd_t *f)
+{
+    if(f->always) {
+        loop_fds_remove(lo, f);
+    } else if(lo->epoll_fd >= 0) {
+        //fails harmlessly if the loop was re-created since loop_add_fd
+        epoll_ctl(lo->epoll_fd, EPOLL_CTL_DEL, f->fd, NULL);
+    }
+}
+
+static int loop_notify_init(struct loop_t *lo)
+{
+    lo->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(lo->epoll_fd < 0)
+        return -1;
+    lo->notify_fd[0] = lo->notify_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(lo->notify_fd[0] < 0) {
+        close(lo->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void loop_notify_exit(struct loop_t *lo)
+{
+    close(lo->notify_fd[0]);
+    close(lo->epoll_fd);
+    lo->epoll_fd = -1;
+}
+#else
+int loop_add_fd(struct loop_t *lo, struct loop_fd_t *f)
+{
+    f->idx = -1;
+    f->always = 0;
+    g_array_append_val(lo->fds, f);
+    return 0;
+}
+
+int loop_mod_fd(struct loop_t *lo, struct loop_fd_t *f, int events)
+{
+    f->events = events;
+    return 0;
+}
+
+void loop_del_fd(struct loop_t *lo, struct loop_fd_t *f)
+{
+    loop_fds_remove(lo, f);
+}
+
+static int loop_notify_init(struct loop_t *lo)
+{
+    lo->epoll_fd = -1;
+    if(pipe(lo->notify_fd) < 0)
+        return -1;
+    fcntl(lo->notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(lo->notify_fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static void loop_notify_exit(struct loop_t *lo)
+{
+    close(lo->notify_fd[0]);
+    close(lo->notify_fd[1]);
+}
+#endif
+
+static void loop_notify_callback(void *opaque, int revents)
+{
+    struct loop_t *lo = opaque;
+    uint64_t v;
+    while(read(lo->notify_fd[0], &v, sizeof(v)) > 0);
+}
+
+/*
+ * loop_notify: the write is only paid when the loop may be going to
+ * sleep, i.e. between the start of an iteration and its wake up.
+ */
+void loop_notify(struct loop_t *lo)
+{
+    if(__atomic_exchange_n(&lo->notify_armed, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t v = 1;
+        //may fail when full, the loop wakes up anyway
+        write(lo->notify_fd[1], &v, sizeof(v));
+    }
+}
+
 int loop_init(struct loop_t *lo)
 {
-    lo->thread_name = LOG_NAME;
+    if(!lo->thread_name)
+        lo->thread_name = LOG_NAME;
     lo->gpollfds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
     if(!lo->gpollfds) {
         ERROR_PRINTF("g array new err\n");
@@ -127,8 +471,42 @@ int loop_init(struct loop_t *lo)
         ERROR_PRINTF("g array new err\n");
         goto err1;
     }
+
+    lo->timers = g_array_new(FALSE, FALSE, sizeof(struct loop_timer_t *));
+    if(!lo->timers) {
+        ERROR_PRINTF("g array new err\n");
+        goto err2;
+    }
+    lo->timer_cnt = loop_get_clock_ns(lo) / 1000000;
+
+    lo->fds = g_array_new(FALSE, FALSE, sizeof(struct loop_fd_t *));
+    if(!lo->fds) {
+        ERROR_PRINTF("g array new err\n");
+        goto err3;
+    }
+
+    if(loop_notify_init(lo) < 0) {
+        ERROR_PRINTF("notify init err\n");
+        goto err4;
+    }
+    lo->notify_armed = 0;
+    lo->notify.fd = lo->notify_fd[0];
+    lo->notify.events = POLLIN;
+    lo->notify.cb = loop_notify_callback;
+    lo->notify.opaque = lo;
+    if(loop_add_fd(lo, &lo->notify) < 0)
+        goto err5;
     return 0;
 
+err5:
+    loop_notify_exit(lo);
+err4:
+    g_array_free(lo->fds, TRUE);
+    lo->fds = NULL;
+err3:
+    g_array_free(lo->timers, TRUE);
+    lo->timers = NULL;
+err2:
     g_array_free(lo->callback, TRUE);
     lo->callback = NULL;
 err1:
@@ -148,20 +526,65 @@ int loop_start(struct loop_t *lo)
     return 0;
 }
 
-int loop_exit(struct loop_t *lo)
+int loop_stop(struct loop_t *lo)
 {
     if (lo->is_run == 1) {
+        uint64_t v = 1;
         lo->is_run = 0;
+        //the loop may be about to sleep without seeing is_run
+        write(lo->notify_fd[1], &v, sizeof(v));
         pthread_join(lo->thread_id, 0);
     } else {
         ERROR_PRINTF("%s stop failed!\n", lo->thread_name);
         return -1;
     }
+    return 0;
+}
+
+int loop_set_affinity(struct loop_t *lo, int cpu)
+{
+#ifdef USE_THREAD_AFFINITY
+    if(cpu < -1 || cpu >= CPU_SETSIZE)
+        return -1;
+    lo->cpu = cpu;
+    return 0;
+#else
+    return cpu < 0 ? 0 : -1;
+#endif
+}
+
+int loop_exit(struct loop_t *lo)
+{
+    int ret = 0;
+    if (lo->is_run == 1)
+        ret = loop_stop(lo);
     if(lo->gpollfds)
         g_array_free(lo->gpollfds, TRUE);
+    lo->gpollfds = NULL;
     if(lo->callback)
         g_array_free(lo->callback, TRUE);
-    return 0;
+    lo->callback = NULL;
+    //armed timers belong to their owners, only the heap is freed
+    if(lo->timers) {
+        for(int i=0; i<lo->timers->len; i++)
+            TIMER_AT(lo, i)->idx = -1;
+        g_array_free(lo->timers, TRUE);
+    }
+    lo->timers = NULL;
+    if(lo->fds) {
+        loop_notify_exit(lo);
+        g_array_free(lo->fds, TRUE);
+    }
+    lo->fds = NULL;
+    return ret;
 }
 
-struct loop_t loop_default;
+struct loop_t loop_default = {
+    .thread_name = "loop",
+    .cpu = -1,
+};
+
+struct loop_t loop_net = {
+    .thread_name = "net",
+    .cpu = -1,
+};
@@ -20,6 +20,7 @@
 #define _LOOP_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <poll.h>
 #ifdef NO_GLIB
 #include <garray.h>
@@ -35,29 +36,86 @@ struct loopcb_t {
     void *opaque;
 };
 
+/* one shot timer, armed by loop_timer_mod, called from the loop thread */
+struct loop_timer_t {
+    int64_t expire_ns;
+    int idx;        //position in the timer heap, -1 when not armed
+    void (* cb)(void *opaque);
+    void *opaque;
+};
+
+/*
+ * persistent fd watch, stays registered until loop_del_fd,
+ * cb is called from the loop thread with POLL* revents
+ */
+struct loop_fd_t {
+    int fd;
+    int events;
+    void (* cb)(void *opaque, int revents);
+    void *opaque;
+    int idx;        //poll array position, or -1
+    uint8_t always; //regular files and the like are always ready
+};
+
 struct loop_t {
     GArray *gpollfds;
     uint32_t poll_timeout;
     uint32_t timer_cnt;
+    GArray *timers; //min heap of struct loop_timer_t *, by expire_ns
+    GArray *fds;    //struct loop_fd_t * not watched by epoll
+    int epoll_fd;
+    int notify_fd[2];
+    struct loop_fd_t notify;
+    uint8_t notify_armed;
 
-    char *thread_name;
+    const char *thread_name;
+    int cpu;        //the thread is pinned to this cpu, -1 for any
     uint8_t is_run;
     pthread_t thread_id;
     GArray *callback;
 };
 
 #define LOOP_IS_RUN(a)   ((a)->is_run)
+/* console and housekeeping */
 extern struct loop_t loop_default;
+/* network backends, kept apart so traffic does not delay the console */
+extern struct loop_t loop_net;
 
 int loop_init(struct loop_t *lo);
 int loop_exit(struct loop_t *lo);
 int loop_start(struct loop_t *lo);
+int loop_stop(struct loop_t *lo);
+/* before loop_start, return: -1 if cpu is out of range */
+int loop_set_affinity(struct loop_t *lo, int cpu);
 
 void loop_register(struct loop_t *lo, const struct loopcb_t *cb);
+/* for prepare callbacks, the fd is polled in this iteration only */
 int loop_add_poll(struct loop_t *lo, int fd, int events);
 int loop_get_revents(struct loop_t *lo, int idx);
 
+/* from the loop thread, or before loop_start */
+int loop_add_fd(struct loop_t *lo, struct loop_fd_t *f);
+int loop_mod_fd(struct loop_t *lo, struct loop_fd_t *f, int events);
+void loop_del_fd(struct loop_t *lo, struct loop_fd_t *f);
+/* from any thread, wake the loop up for new work */
+void loop_notify(struct loop_t *lo);
+
+/* timers are used from the loop thread, or before loop_start */
+struct loop_timer_t *loop_timer_new(struct loop_t *lo, void (*cb)(void *opaque), void *opaque);
+void loop_timer_free(struct loop_t *lo, struct loop_timer_t *t);
+void loop_timer_mod(struct loop_t *lo, struct loop_timer_t *t, int64_t expire_ns);
+void loop_timer_del(struct loop_t *lo, struct loop_timer_t *t);
+
+/* monotonic clock */
+static inline int64_t loop_get_clock_ns(struct loop_t *lo)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 
+/* monotonic clock of the last loop iteration */
 static inline uint32_t loop_get_clock_ms(struct loop_t *lo)
 {
     return lo->timer_cnt;
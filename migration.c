@@ -0,0 +1,546 @@
+/*
+ * migration.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <migration.h>
+#include <loop.h>
+#include <config.h>
+
+#ifdef USE_PRCTL_SET_THREAD_NAME
+#include <sys/prctl.h>
+#endif
+
+#define LOG_NAME   "migration"
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+
+#define MIGRATION_MAGIC        (0x4d4d5241)  /* "ARMM" */
+#define MIGRATION_VERSION      (1)
+
+/* pre-copy ends when a round leaves fewer dirty pages than this */
+#define MIGRATION_STOP_PAGES   (64)
+#define MIGRATION_MAX_ROUNDS   (30)
+
+#define MIG_REC_PAGE    (1)  /* arg: page number, MEM_PAGE_SIZE bytes follow */
+#define MIG_REC_STATE   (2)  /* arg: state size, state follows */
+#define MIG_REC_END     (3)
+
+struct migration_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mem_size;
+    uint32_t page_size;
+};
+
+struct migration_record_t {
+    uint32_t type;
+    uint32_t arg;
+};
+
+/* cpu and device registers, fifo contents are not migrated */
+struct migration_state_t {
+    uint32_t spsr[7];
+    uint32_t reg[7][16];
+    uint32_t mmu_reg[16];
+    uint32_t code_counter;
+    uint32_t intc[2];
+    uint32_t tim[4];
+    uint32_t uart[UART_NUMBER][11];
+    uint32_t irq_req;
+    uint32_t balloon[3];
+    uint32_t nic[12];
+    uint32_t blk[7];
+    uint32_t dma[4];
+    uint32_t crypto[7];
+    uint32_t rng[4];
+    uint32_t share[7];
+};
+
+struct migration_t {
+    const char *uri;
+    int fd;
+    uint8_t is_run;
+    pthread_t thread_id;
+    struct peripheral_t *base;
+    void (*stop_request)(void);
+};
+
+static struct migration_t migration = {
+    .uri = NULL,
+    .fd = -1,
+};
+
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while(len) {
+        ssize_t r = write(fd, p, len);
+        if(r < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while(len) {
+        ssize_t r = read(fd, p, len);
+        if(r < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        } else if(r == 0) {
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int migration_open(const char *uri, uint8_t listen_mode)
+{
+    struct sockaddr_un addr;
+    int fd, cfd;
+
+    if(strncmp(uri, "fd:", 3) == 0)
+        return atoi(uri + 3);
+    if(strncmp(uri, "unix:", 5) == 0)
+        uri += 5;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        ERROR_PRINTF("socket err\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, uri, sizeof(addr.sun_path) - 1);
+
+    if(!listen_mode) {
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            ERROR_PRINTF("connect %s err\n", uri);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    unlink(addr.sun_path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        ERROR_PRINTF("listen %s err\n", uri);
+        close(fd);
+        return -1;
+    }
+    DEBUG_PRINTF("wait for incoming machine on %s\n", uri);
+    do {
+        cfd = accept(fd, NULL, NULL);
+    } while(cfd < 0 && errno == EINTR);
+    close(fd);
+    unlink(addr.sun_path);
+    if(cfd < 0)
+        ERROR_PRINTF("accept %s err\n", uri);
+    return cfd;
+}
+
+static int migration_send_page(struct migration_t *mig, uint32_t page)
+{
+    struct migration_record_t rec = {
+        .type = MIG_REC_PAGE,
+        .arg = page,
+    };
+    if(write_full(mig->fd, &rec, sizeof(rec)) < 0)
+        return -1;
+    return write_full(mig->fd, mig->base->mem.mem + (page << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+}
+
+static int page_is_zero(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    for(int i=0; i<MEM_PAGE_SIZE/sizeof(uint64_t); i++) {
+        if(w[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* return: number of pages sent, -1 on error */
+static int migration_send_dirty(struct migration_t *mig)
+{
+    int count = 0;
+    for(uint32_t page=0; page<MEM_PAGE_NUMBER; page++) {
+        if(!memory_get_dirty(&mig->base->mem, page))
+            continue;
+        if(migration_send_page(mig, page) < 0)
+            return -1;
+        count++;
+    }
+    return count;
+}
+
+static void *migration_proc(void *opaque)
+{
+    struct migration_t *mig = opaque;
+    struct migration_header_t hdr = {
+        .magic = MIGRATION_MAGIC,
+        .version = MIGRATION_VERSION,
+        .mem_size = MEM_SIZE,
+        .page_size = MEM_PAGE_SIZE,
+    };
+    int count = 0;
+#ifdef USE_PRCTL_SET_THREAD_NAME
+    prctl(PR_SET_NAME, "migration_task");
+#endif
+
+    if(write_full(mig->fd, &hdr, sizeof(hdr)) < 0)
+        goto err;
+
+    //round 0, full copy, the incoming RAM starts zeroed
+    memory_dirty_log(&mig->base->mem, 1);
+    for(uint32_t page=0; page<MEM_PAGE_NUMBER; page++) {
+        if(page_is_zero(mig->base->mem.mem + (page << MEM_PAGE_SHIFT)))
+            continue;
+        if(migration_send_page(mig, page) < 0)
+            goto err;
+        count++;
+    }
+    DEBUG_PRINTF("round 0, %d pages\n", count);
+
+    for(int round=1; round<=MIGRATION_MAX_ROUNDS; round++) {
+        count = migration_send_dirty(mig);
+        if(count < 0)
+            goto err;
+        DEBUG_PRINTF("round %d, %d dirty pages\n", round, count);
+        if(count <= MIGRATION_STOP_PAGES)
+            break;
+    }
+
+    //stop-and-copy in migration_complete
+    mig->stop_request();
+    return NULL;
+
+err:
+    ERROR_PRINTF("send to %s err, machine continue\n", mig->uri);
+    memory_dirty_log(&mig->base->mem, 0);
+    close(mig->fd);
+    mig->fd = -1;
+    __atomic_store_n(&mig->is_run, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+int migration_register(const char *uri, struct peripheral_t *base, void (*stop_request)(void))
+{
+    migration.uri = uri;
+    migration.base = base;
+    migration.stop_request = stop_request;
+    return 0;
+}
+
+/*
+ * migration_start: begin iterative pre-copy, the machine keeps running
+ * until stop_request() is called from the migration thread.
+ */
+int migration_start(void)
+{
+    struct migration_t *mig = &migration;
+    if(!mig->uri) {
+        ERROR_PRINTF("no destination, use -M <uri>\n");
+        return -1;
+    }
+    if(__atomic_load_n(&mig->is_run, __ATOMIC_ACQUIRE)) {
+        ERROR_PRINTF("already running\n");
+        return -1;
+    }
+    mig->fd = migration_open(mig->uri, 0);
+    if(mig->fd < 0)
+        return -1;
+    DEBUG_PRINTF("start to %s\n", mig->uri);
+    mig->is_run = 1;
+    if(pthread_create(&mig->thread_id, 0, migration_proc, mig) < 0) {
+        ERROR_PRINTF("create thread err\n");
+        close(mig->fd);
+        mig->is_run = 0;
+        return -1;
+    }
+    pthread_detach(mig->thread_id);
+    return 0;
+}
+
+static void migration_save_state(struct migration_state_t *st, struct armv4_cpu_t *cpu,
+ struct peripheral_t *base)
+{
+    memcpy(st->spsr, cpu->spsr, sizeof(st->spsr));
+    memcpy(st->reg, cpu->reg, sizeof(st->reg));
+    memcpy(st->mmu_reg, cpu->mmu.reg, sizeof(st->mmu_reg));
+    st->code_counter = cpu->code_counter;
+    st->intc[0] = base->intc.MSK;
+    st->intc[1] = base->intc.PND;
+    st->tim[0] = base->tim.CNT;
+    st->tim[1] = base->tim.EN;
+    st->tim[2] = base->tim.PERIOD;
+    st->tim[3] = base->tim.privious_cnt;
+    for(int i=0; i<UART_NUMBER; i++) {
+        struct uart_register *uart = &base->uart[i];
+        uint32_t *u = st->uart[i];
+        u[0] = uart->DLL;
+        u[1] = uart->DLH;
+        u[2] = uart->IER;
+        u[3] = uart->IIR;
+        u[4] = uart->FCR;
+        u[5] = uart->LCR;
+        u[6] = uart->MCR;
+        u[7] = uart->LSR;
+        u[8] = uart->MSR;
+        u[9] = uart->SCR;
+        u[10] = uart->RBR;
+    }
+    st->irq_req = base->irq_req;
+    st->balloon[0] = base->balloon.TARGET;
+    st->balloon[1] = base->balloon.ACTUAL;
+    st->balloon[2] = base->balloon.ISR;
+    st->nic[0] = base->nic.CTRL;
+    st->nic[1] = base->nic.IER;
+    st->nic[2] = base->nic.ISR;
+    st->nic[3] = base->nic.ITR;
+    memcpy(&st->nic[4], &base->nic.tx, sizeof(struct nic_ring));
+    memcpy(&st->nic[8], &base->nic.rx, sizeof(struct nic_ring));
+    st->blk[0] = base->blk.CTRL;
+    st->blk[1] = base->blk.IER;
+    st->blk[2] = base->blk.ISR;
+    st->blk[3] = base->blk.BASE;
+    st->blk[4] = base->blk.SIZE;
+    st->blk[5] = base->blk.HEAD;
+    st->blk[6] = base->blk.TAIL;
+    st->dma[0] = base->dma.DESC;
+    st->dma[1] = base->dma.IER;
+    st->dma[2] = base->dma.ISR;
+    st->dma[3] = base->dma.CUR;
+    st->crypto[0] = base->crypto.CTRL;
+    st->crypto[1] = base->crypto.IER;
+    st->crypto[2] = base->crypto.ISR;
+    st->crypto[3] = base->crypto.BASE;
+    st->crypto[4] = base->crypto.SIZE;
+    st->crypto[5] = base->crypto.HEAD;
+    st->crypto[6] = base->crypto.TAIL;
+    st->rng[0] = base->rng.ADDR;
+    st->rng[1] = base->rng.LEN;
+    st->rng[2] = base->rng.IER;
+    st->rng[3] = base->rng.ISR;
+    st->share[0] = base->share.CTRL;
+    st->share[1] = base->share.IER;
+    st->share[2] = base->share.ISR;
+    st->share[3] = base->share.BASE;
+    st->share[4] = base->share.SIZE;
+    st->share[5] = base->share.HEAD;
+    st->share[6] = base->share.TAIL;
+}
+
+static void migration_load_state(const struct migration_state_t *st, struct armv4_cpu_t *cpu,
+ struct peripheral_t *base)
+{
+    memcpy(cpu->spsr, st->spsr, sizeof(st->spsr));
+    memcpy(cpu->reg, st->reg, sizeof(st->reg));
+    memcpy(cpu->mmu.reg, st->mmu_reg, sizeof(st->mmu_reg));
+    memset(cpu->mmu.tlb, 0, sizeof(cpu->mmu.tlb));
+    if(cpu->mmu.reg_mirror)
+        memcpy(cpu->mmu.reg_mirror, cpu->mmu.reg, sizeof(cpu->mmu.reg));
+    cpu->code_counter = st->code_counter;
+    base->intc.MSK = st->intc[0];
+    base->intc.PND = st->intc[1];
+    base->tim.CNT = st->tim[0];
+    base->tim.EN = st->tim[1];
+    base->tim.PERIOD = st->tim[2];
+    base->tim.privious_cnt = st->tim[3];
+    for(int i=0; i<UART_NUMBER; i++) {
+        struct uart_register *uart = &base->uart[i];
+        const uint32_t *u = st->uart[i];
+        uart->DLL = u[0];
+        uart->DLH = u[1];
+        uart->IER = u[2];
+        uart->IIR = u[3];
+        uart->FCR = u[4];
+        uart->LCR = u[5];
+        uart->MCR = u[6];
+        uart->LSR = u[7];
+        uart->MSR = u[8];
+        uart->SCR = u[9];
+        uart->RBR = u[10];
+        //the tx fifo starts empty here, a driver waiting on THRE must see it
+        uart->thre_pending = 1;
+    }
+    base->irq_req = st->irq_req;
+    base->balloon.TARGET = st->balloon[0];
+    base->balloon.ACTUAL = st->balloon[1];
+    base->balloon.ISR = st->balloon[2];
+    pthread_mutex_lock(&base->nic.lock);
+    base->nic.CTRL = st->nic[0];
+    base->nic.IER = st->nic[1];
+    base->nic.ISR = st->nic[2];
+    base->nic.ITR = st->nic[3];
+    memcpy(&base->nic.tx, &st->nic[4], sizeof(struct nic_ring));
+    memcpy(&base->nic.rx, &st->nic[8], sizeof(struct nic_ring));
+    pthread_mutex_unlock(&base->nic.lock);
+    base->blk.CTRL = st->blk[0];
+    base->blk.IER = st->blk[1];
+    base->blk.ISR = st->blk[2];
+    base->blk.BASE = st->blk[3];
+    base->blk.SIZE = st->blk[4];
+    base->blk.HEAD = st->blk[5];
+    base->blk.TAIL = st->blk[6];
+    base->dma.DESC = st->dma[0];
+    base->dma.IER = st->dma[1];
+    base->dma.ISR = st->dma[2];
+    base->dma.CUR = st->dma[3];
+    base->crypto.CTRL = st->crypto[0];
+    base->crypto.IER = st->crypto[1];
+    base->crypto.ISR = st->crypto[2];
+    base->crypto.BASE = st->crypto[3];
+    base->crypto.SIZE = st->crypto[4];
+    base->crypto.HEAD = st->crypto[5];
+    base->crypto.TAIL = st->crypto[6];
+    base->rng.ADDR = st->rng[0];
+    base->rng.LEN = st->rng[1];
+    base->rng.IER = st->rng[2];
+    base->rng.ISR = st->rng[3];
+    base->share.CTRL = st->share[0];
+    base->share.IER = st->share[1];
+    base->share.ISR = st->share[2];
+    base->share.BASE = st->share[3];
+    base->share.SIZE = st->share[4];
+    base->share.HEAD = st->share[5];
+    base->share.TAIL = st->share[6];
+}
+
+/*
+ * migration_complete: from cpu thread, the machine is stopped, stop the
+ * loop threads, send the last dirty pages and the device state, then quit.
+ */
+void migration_complete(struct armv4_cpu_t *cpu)
+{
+    struct migration_t *mig = &migration;
+    struct migration_state_t st;
+    struct migration_record_t rec;
+    int count;
+
+    //nic rx on the net loop writes buffers and descriptors too
+    loop_stop(&loop_default);
+    loop_stop(&loop_net);
+    //completions write descriptors and buffers, the last pass must see them
+    blk_drain(&mig->base->blk);
+    crypto_drain(&mig->base->crypto);
+    share_drain(&mig->base->share);
+    count = migration_send_dirty(mig);
+    if(count < 0)
+        goto err;
+    DEBUG_PRINTF("stop-and-copy, %d dirty pages\n", count);
+
+    migration_save_state(&st, cpu, mig->base);
+    rec.type = MIG_REC_STATE;
+    rec.arg = sizeof(st);
+    if(write_full(mig->fd, &rec, sizeof(rec)) < 0 || write_full(mig->fd, &st, sizeof(st)) < 0)
+        goto err;
+    rec.type = MIG_REC_END;
+    rec.arg = 0;
+    if(write_full(mig->fd, &rec, sizeof(rec)) < 0)
+        goto err;
+    close(mig->fd);
+    DEBUG_PRINTF("done, machine moved to %s\n", mig->uri);
+    exit(0);
+
+err:
+    ERROR_PRINTF("send to %s err, machine continue\n", mig->uri);
+    memory_dirty_log(&mig->base->mem, 0);
+    close(mig->fd);
+    mig->fd = -1;
+    __atomic_store_n(&mig->is_run, 0, __ATOMIC_RELEASE);
+    if(loop_start(&loop_default) < 0 || loop_start(&loop_net) < 0)
+        exit(-1);
+}
+
+/*
+ * migration_incoming: receive a running machine instead of loading an image
+ */
+int migration_incoming(const char *uri, struct armv4_cpu_t *cpu, struct peripheral_t *base)
+{
+    struct migration_header_t hdr;
+    struct migration_record_t rec;
+    struct migration_state_t st;
+    uint32_t pages = 0;
+    int fd;
+
+    fd = migration_open(uri, 1);
+    if(fd < 0)
+        return -1;
+    if(read_full(fd, &hdr, sizeof(hdr)) < 0)
+        goto err;
+    if(hdr.magic != MIGRATION_MAGIC || hdr.version != MIGRATION_VERSION ||
+     hdr.mem_size != MEM_SIZE || hdr.page_size != MEM_PAGE_SIZE) {
+        ERROR_PRINTF("incompatible machine, version %u, mem size 0x%x\n",
+         hdr.version, hdr.mem_size);
+        goto err;
+    }
+
+    for(;;) {
+        if(read_full(fd, &rec, sizeof(rec)) < 0)
+            goto err;
+        switch(rec.type) {
+        case MIG_REC_PAGE:
+            if(rec.arg >= MEM_PAGE_NUMBER)
+                goto err;
+            if(read_full(fd, base->mem.mem + (rec.arg << MEM_PAGE_SHIFT), MEM_PAGE_SIZE) < 0)
+                goto err;
+            pages++;
+            break;
+        case MIG_REC_STATE:
+            if(rec.arg != sizeof(st) || read_full(fd, &st, sizeof(st)) < 0)
+                goto err;
+            migration_load_state(&st, cpu, base);
+            break;
+        case MIG_REC_END:
+            close(fd);
+            DEBUG_PRINTF("incoming done, %u pages\n", pages);
+            return 0;
+        default:
+            ERROR_PRINTF("unknown record %u\n", rec.type);
+            goto err;
+        }
+    }
+
+err:
+    ERROR_PRINTF("receive from %s err\n", uri);
+    close(fd);
+    return -1;
+}
+
+/*****************************END OF FILE***************************/
@@ -0,0 +1,36 @@
+/*
+ * migration.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _MIGRATION_H_
+#define _MIGRATION_H_
+
+#include <stdint.h>
+#include <armv4.h>
+#include <peripheral.h>
+
+/*
+ * uri: 'unix:<path>', '<path>' for a unix socket,
+ *      'fd:<n>' for an already opened pipe or socket
+ */
+int migration_register(const char *uri, struct peripheral_t *base, void (*stop_request)(void));
+int migration_start(void);
+void migration_complete(struct armv4_cpu_t *cpu);
+int migration_incoming(const char *uri, struct armv4_cpu_t *cpu, struct peripheral_t *base);
+
+#endif
+/*****************************END OF FILE***************************/
@@ -0,0 +1,1311 @@
+/*
+ * p9.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE  /* O_PATH */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <p9.h>
+#include <config.h>
+
+#define LOG_NAME   "p9"
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+/* T-message types, the R-message is type + 1 */
+#define P9_RLERROR           7
+#define P9_TSTATFS           8
+#define P9_TLOPEN            12
+#define P9_TLCREATE          14
+#define P9_TSYMLINK          16
+#define P9_TRENAME           20
+#define P9_TREADLINK         22
+#define P9_TGETATTR          24
+#define P9_TSETATTR          26
+#define P9_TREADDIR          40
+#define P9_TFSYNC            50
+#define P9_TLOCK             52
+#define P9_TGETLOCK          54
+#define P9_TLINK             70
+#define P9_TMKDIR            72
+#define P9_TRENAMEAT         74
+#define P9_TUNLINKAT         76
+#define P9_TVERSION          100
+#define P9_TATTACH           104
+#define P9_TFLUSH            108
+#define P9_TWALK             110
+#define P9_TREAD             116
+#define P9_TWRITE            118
+#define P9_TCLUNK            120
+#define P9_TREMOVE           122
+
+/* Tlopen and Tlcreate flags, Linux values whatever the host is */
+#define P9_DOTL_ACCMODE      00000003
+#define P9_DOTL_WRONLY       00000001
+#define P9_DOTL_RDWR         00000002
+#define P9_DOTL_EXCL         00000200
+#define P9_DOTL_TRUNC        00001000
+#define P9_DOTL_APPEND       00002000
+#define P9_DOTL_DSYNC        00010000
+#define P9_DOTL_SYNC         04000000
+#define P9_DOTL_AT_REMOVEDIR 0x200
+
+/* Tsetattr valid */
+#define P9_ATTR_MODE         0x001
+#define P9_ATTR_UID          0x002
+#define P9_ATTR_GID          0x004
+#define P9_ATTR_SIZE         0x008
+#define P9_ATTR_ATIME        0x010
+#define P9_ATTR_MTIME        0x020
+#define P9_ATTR_ATIME_SET    0x080
+#define P9_ATTR_MTIME_SET    0x100
+
+#define P9_GETATTR_BASIC     0x7ffULL
+#define P9_QTDIR             0x80
+#define P9_QTSYMLINK         0x02
+#define P9_QID_SIZE          (13)
+#define P9_MAXWELEM          (16)
+#define P9_LOCK_SUCCESS      0
+#define P9_LOCK_TYPE_UNLCK   2
+#define P9_SUPER_MAGIC       0x01021997
+
+/* directories on the way to a file, never a symlink */
+#ifdef O_PATH
+#define P9_DIR_FLAGS   (O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#else
+#define P9_DIR_FLAGS   (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#endif
+
+struct p9_fid_t {
+    uint32_t fid;
+    char *path;               //relative to the root, "" is the root
+    int fd;                   //opened file
+    DIR *dir;                 //opened directory
+    struct p9_fid_t *next;
+};
+
+struct p9_msg_t {
+    uint8_t *buf;
+    uint32_t len;             //T-message: size, R-message: buffer length
+    uint32_t off;
+    int err;                  //went past len
+};
+
+
+static uint8_t *p9_take(struct p9_msg_t *m, uint32_t len)
+{
+    uint8_t *p;
+    if(m->err || len > m->len - m->off) {
+        m->err = 1;
+        return NULL;
+    }
+    p = m->buf + m->off;
+    m->off += len;
+    return p;
+}
+
+
+/* little endian fields of 1, 2, 4 or 8 bytes */
+static uint64_t p9_get(struct p9_msg_t *m, int len)
+{
+    uint8_t *p = p9_take(m, len);
+    uint64_t v = 0;
+    if(!p)
+        return 0;
+    while(len--)
+        v = v << 8 | p[len];
+    return v;
+}
+
+
+static void p9_put_at(uint8_t *p, uint64_t v, int len)
+{
+    int i;
+    for(i = 0; i < len; i++, v >>= 8)
+        p[i] = v;
+}
+
+
+static void p9_put(struct p9_msg_t *m, uint64_t v, int len)
+{
+    uint8_t *p = p9_take(m, len);
+    if(p)
+        p9_put_at(p, v, len);
+}
+
+
+/* string[s] to a C string, return: 0 done, -1 malformed or longer than size - 1 */
+static int p9_getstr(struct p9_msg_t *m, char *s, size_t size)
+{
+    uint16_t len = p9_get(m, 2);
+    uint8_t *p = p9_take(m, len);
+    if(!p || len >= size || memchr(p, 0, len)) {
+        m->err = 1;
+        return -1;
+    }
+    memcpy(s, p, len);
+    s[len] = '\0';
+    return 0;
+}
+
+
+static void p9_putstr(struct p9_msg_t *m, const char *s)
+{
+    size_t len = strlen(s);
+    uint8_t *p;
+    if(len > 0xffff) {
+        m->err = 1;
+        return;
+    }
+    p9_put(m, len, 2);
+    p = p9_take(m, len);
+    if(p)
+        memcpy(p, s, len);
+}
+
+
+static void p9_putqid(struct p9_msg_t *m, const struct stat *st)
+{
+    uint8_t type = 0;
+    if(S_ISDIR(st->st_mode))
+        type = P9_QTDIR;
+    else if(S_ISLNK(st->st_mode))
+        type = P9_QTSYMLINK;
+    p9_put(m, type, 1);
+    p9_put(m, 0, 4); //version
+    p9_put(m, st->st_ino, 8);
+}
+
+
+static void p9_close_fd(int fd)
+{
+    int e = errno;
+    close(fd);
+    errno = e;
+}
+
+
+/*******************************fid******************************************/
+
+static struct p9_fid_t *p9_fid(struct p9_t *p, uint32_t fid)
+{
+    struct p9_fid_t *f = p->fids[fid % P9_FID_HASH];
+    while(f && f->fid != fid)
+        f = f->next;
+    return f;
+}
+
+
+/* path is taken by the fid */
+static struct p9_fid_t *p9_fid_new(struct p9_t *p, uint32_t fid, char *path)
+{
+    struct p9_fid_t *f = malloc(sizeof(struct p9_fid_t));
+    if(!f)
+        return NULL;
+    f->fid = fid;
+    f->path = path;
+    f->fd = -1;
+    f->dir = NULL;
+    f->next = p->fids[fid % P9_FID_HASH];
+    p->fids[fid % P9_FID_HASH] = f;
+    p->fid_count++;
+    return f;
+}
+
+
+static void p9_fid_free(struct p9_t *p, uint32_t fid)
+{
+    struct p9_fid_t **pf = &p->fids[fid % P9_FID_HASH];
+    struct p9_fid_t *f;
+    while(*pf && (*pf)->fid != fid)
+        pf = &(*pf)->next;
+    f = *pf;
+    if(!f)
+        return;
+    *pf = f->next;
+    if(f->dir)
+        closedir(f->dir);
+    else if(f->fd >= 0)
+        close(f->fd);
+    free(f->path);
+    free(f);
+    p->fid_count--;
+}
+
+
+static int p9_fid_is_open(struct p9_fid_t *f)
+{
+    return f->fd >= 0 || f->dir;
+}
+
+
+/* fids are paths, follow a rename of from, a file or a directory, to to */
+static void p9_fid_rename(struct p9_t *p, const char *from, const char *to)
+{
+    size_t flen = strlen(from), tlen = strlen(to);
+    struct p9_fid_t *f;
+    int i;
+    for(i = 0; i < P9_FID_HASH; i++) {
+        for(f = p->fids[i]; f; f = f->next) {
+            size_t len = strlen(f->path);
+            char *path;
+            if(len < flen || strncmp(f->path, from, flen) ||
+             (f->path[flen] != '\0' && f->path[flen] != '/'))
+                continue;
+            path = malloc(tlen + len - flen + 1);
+            if(!path)
+                continue;
+            memcpy(path, to, tlen);
+            memcpy(path + tlen, f->path + flen, len - flen + 1);
+            free(f->path);
+            f->path = path;
+        }
+    }
+}
+
+/*******************************fid******************************************/
+/*******************************path******************************************/
+
+/* one component inside its directory */
+static int p9_name_ok(const char *name)
+{
+    return name[0] && strcmp(name, ".") && strcmp(name, "..") && !strchr(name, '/');
+}
+
+
+/* path/name, or name at the root, return: NULL, errno */
+static char *p9_join(const char *path, const char *name)
+{
+    size_t plen = strlen(path), nlen = strlen(name);
+    char *s;
+    if(plen + nlen + 2 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    s = malloc(plen + nlen + 2);
+    if(!s)
+        return NULL;
+    if(plen) {
+        memcpy(s, path, plen);
+        s[plen++] = '/';
+    }
+    memcpy(s + plen, name, nlen + 1);
+    return s;
+}
+
+
+/*
+ * p9_dir: open the directory of the first len bytes of path, one
+ * component at a time, so a symlink on the way fails instead of
+ * leading out of the root, return: fd, -1 errno
+ */
+static int p9_dir(struct p9_t *p, const char *path, size_t len)
+{
+    char name[NAME_MAX + 1];
+    int fd = openat(p->root_fd, ".", P9_DIR_FLAGS);
+    while(fd >= 0 && len) {
+        const char *end = memchr(path, '/', len);
+        size_t n = end ? (size_t)(end - path) : len;
+        int next;
+        if(n > NAME_MAX) {
+            close(fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, path, n);
+        name[n] = '\0';
+        next = openat(fd, name, P9_DIR_FLAGS);
+        p9_close_fd(fd);
+        fd = next;
+        if(end)
+            n++;
+        path += n;
+        len -= n;
+    }
+    return fd;
+}
+
+
+/* directory holding the last component of path, *name is that component, "." for the root */
+static int p9_parent(struct p9_t *p, const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    if(!path[0]) {
+        *name = ".";
+        return p9_dir(p, path, 0);
+    }
+    if(!slash) {
+        *name = path;
+        return p9_dir(p, path, 0);
+    }
+    *name = slash + 1;
+    return p9_dir(p, path, slash - path);
+}
+
+
+/* lstat() of path, return: 0 done, -1 errno */
+static int p9_stat(struct p9_t *p, const char *path, struct stat *st)
+{
+    const char *name;
+    int ret, fd = p9_parent(p, path, &name);
+    if(fd < 0)
+        return -1;
+    ret = fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW);
+    p9_close_fd(fd);
+    return ret;
+}
+
+
+static int p9_open_flags(uint32_t flags)
+{
+    int o = O_RDONLY;
+    if((flags & P9_DOTL_ACCMODE) == P9_DOTL_WRONLY)
+        o = O_WRONLY;
+    else if((flags & P9_DOTL_ACCMODE) == P9_DOTL_RDWR)
+        o = O_RDWR;
+    if(flags & P9_DOTL_TRUNC)
+        o |= O_TRUNC;
+    if(flags & P9_DOTL_APPEND)
+        o |= O_APPEND;
+    if(flags & P9_DOTL_DSYNC)
+        o |= O_DSYNC;
+    if(flags & P9_DOTL_SYNC)
+        o |= O_SYNC;
+    return o | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC;
+}
+
+
+/*
+ * p9_openat: open name in dirfd for fid f, regular files and directories
+ * only, a fifo or a device would stall the server, return: 0 done, errno
+ */
+static int p9_openat(struct p9_fid_t *f, int dirfd, const char *name, int flags, mode_t mode,
+ struct stat *st)
+{
+    int err, fd = openat(dirfd, name, flags, mode);
+    if(fd < 0)
+        return errno;
+    if(fstat(fd, st) < 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if(S_ISDIR(st->st_mode)) {
+        f->dir = fdopendir(fd);
+        if(!f->dir) {
+            err = errno;
+            close(fd);
+            return err;
+        }
+        return 0;
+    }
+    if(!S_ISREG(st->st_mode)) {
+        close(fd);
+        return ENXIO;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    f->fd = fd;
+    return 0;
+}
+
+/*******************************path******************************************/
+/*******************************messages******************************************/
+
+static int p9_version(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char version[32];
+    uint32_t msize = p9_get(in, 4);
+    if(p9_getstr(in, version, sizeof(version)) < 0)
+        return EPROTO;
+    p9_reset(p);
+    if(msize > P9_MSIZE_MAX)
+        msize = P9_MSIZE_MAX;
+    p->msize = msize;
+    p9_put(out, msize, 4);
+    p9_putstr(out, strcmp(version, P9_VERSION) ? "unknown" : P9_VERSION);
+    return 0;
+}
+
+
+static int p9_attach(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char uname[256], aname[PATH_MAX];
+    uint32_t fid = p9_get(in, 4);
+    struct stat st;
+    char *path;
+
+    p9_get(in, 4); //afid, no authentication
+    p9_getstr(in, uname, sizeof(uname));
+    p9_getstr(in, aname, sizeof(aname)); //a single tree, aname is ignored
+    p9_get(in, 4); //n_uname
+    if(in->err)
+        return EPROTO;
+    if(p9_fid(p, fid))
+        return EBADF;
+    if(fstat(p->root_fd, &st) < 0)
+        return errno;
+    path = strdup("");
+    if(!path || !p9_fid_new(p, fid, path)) {
+        free(path);
+        return ENOMEM;
+    }
+    p9_putqid(out, &st);
+    return 0;
+}
+
+
+static int p9_walk(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t fid = p9_get(in, 4);
+    uint32_t newfid = p9_get(in, 4);
+    uint16_t nwname = p9_get(in, 2);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    uint32_t count_off = out->off;
+    struct stat st;
+    char *path, *next;
+    int i, err = 0;
+
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(nwname > P9_MAXWELEM)
+        return EINVAL;
+    if(newfid != fid && p9_fid(p, newfid))
+        return EBADF;
+    path = strdup(f->path);
+    if(!path)
+        return ENOMEM;
+    p9_put(out, 0, 2);
+    for(i = 0; i < nwname; i++) {
+        if(p9_getstr(in, name, sizeof(name)) < 0) {
+            err = EPROTO;
+            break;
+        }
+        if(strcmp(name, "..") == 0) {
+            //lexical, the root is its own parent
+            char *slash = strrchr(path, '/');
+            next = strndup(path, slash ? slash - path : 0);
+        } else if(p9_name_ok(name)) {
+            next = p9_join(path, name);
+        } else {
+            err = EINVAL;
+            break;
+        }
+        if(!next) {
+            err = errno;
+            break;
+        }
+        if(p9_stat(p, next, &st) < 0) {
+            err = errno;
+            free(next);
+            break;
+        }
+        free(path);
+        path = next;
+        p9_putqid(out, &st);
+    }
+    if(i < nwname) {
+        free(path);
+        if(i == 0)
+            return err;
+        //walked part of the way, newfid is not created
+        p9_put_at(out->buf + count_off, i, 2);
+        return 0;
+    }
+    p9_put_at(out->buf + count_off, i, 2);
+    if(newfid == fid) {
+        free(f->path);
+        f->path = path;
+    } else if(!p9_fid_new(p, newfid, path)) {
+        free(path);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+
+static int p9_lopen(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint32_t flags = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    const char *name;
+    struct stat st;
+    int err, dirfd;
+
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(p9_fid_is_open(f))
+        return EBUSY;
+    dirfd = p9_parent(p, f->path, &name);
+    if(dirfd < 0)
+        return errno;
+    err = p9_openat(f, dirfd, name, p9_open_flags(flags), 0, &st);
+    close(dirfd);
+    if(err)
+        return err;
+    p9_putqid(out, &st);
+    p9_put(out, 0, 4); //iounit, bound by msize
+    return 0;
+}
+
+
+static int p9_lcreate(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t fid = p9_get(in, 4);
+    uint32_t flags, mode;
+    struct p9_fid_t *f = p9_fid(p, fid);
+    struct stat st;
+    char *path;
+    int err, dirfd, o;
+
+    p9_getstr(in, name, sizeof(name));
+    flags = p9_get(in, 4);
+    mode = p9_get(in, 4);
+    p9_get(in, 4); //gid, files belong to the emulator user
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(p9_fid_is_open(f))
+        return EBUSY;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    path = p9_join(f->path, name);
+    if(!path)
+        return errno;
+    dirfd = p9_dir(p, f->path, strlen(f->path));
+    if(dirfd < 0) {
+        err = errno;
+        free(path);
+        return err;
+    }
+    o = p9_open_flags(flags) | O_CREAT;
+    if(flags & P9_DOTL_EXCL)
+        o |= O_EXCL;
+    err = p9_openat(f, dirfd, name, o, mode & 07777, &st);
+    close(dirfd);
+    if(err) {
+        free(path);
+        return err;
+    }
+    //the fid now stands for the new file
+    free(f->path);
+    f->path = path;
+    p9_putqid(out, &st);
+    p9_put(out, 0, 4);
+    return 0;
+}
+
+
+static int p9_read(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint64_t offset = p9_get(in, 8);
+    uint32_t count = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    uint32_t room = out->len - out->off - 4;
+    ssize_t n;
+
+    if(in->err)
+        return EPROTO;
+    if(!f || f->fd < 0)
+        return EBADF;
+    if(count > room)
+        count = room;
+    if(count > p->msize - P9_HEADER_SIZE - 4)
+        count = p->msize - P9_HEADER_SIZE - 4;
+    //straight into the reply, which is the guest buffer
+    do {
+        n = pread(f->fd, out->buf + out->off + 4, count, offset);
+    } while(n < 0 && errno == EINTR);
+    if(n < 0)
+        return errno;
+    p9_put(out, n, 4);
+    out->off += n;
+    __atomic_fetch_add(&p->bytes_read, n, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+static int p9_write(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint64_t offset = p9_get(in, 8);
+    uint32_t count = p9_get(in, 4);
+    uint8_t *data = p9_take(in, count);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    ssize_t n;
+
+    if(in->err)
+        return EPROTO;
+    if(!f || f->fd < 0)
+        return EBADF;
+    do {
+        n = pwrite(f->fd, data, count, offset);
+    } while(n < 0 && errno == EINTR);
+    if(n < 0)
+        return errno;
+    p9_put(out, n, 4);
+    __atomic_fetch_add(&p->bytes_written, n, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+static int p9_clunk(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    if(in->err)
+        return EPROTO;
+    if(!p9_fid(p, fid))
+        return EBADF;
+    p9_fid_free(p, fid);
+    return 0;
+}
+
+
+/* the fid is clunked even if the remove fails */
+static int p9_remove(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    const char *name;
+    struct stat st;
+    int err = 0, dirfd;
+
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(!f->path[0]) {
+        err = EBUSY;
+    } else if((dirfd = p9_parent(p, f->path, &name)) < 0) {
+        err = errno;
+    } else {
+        if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+         unlinkat(dirfd, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0)
+            err = errno;
+        close(dirfd);
+    }
+    p9_fid_free(p, fid);
+    return err;
+}
+
+
+static int p9_getattr(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    struct stat st;
+    int ret;
+
+    p9_get(in, 8); //request_mask, the basic set is always returned
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(f->fd >= 0)
+        ret = fstat(f->fd, &st);
+    else if(f->dir)
+        ret = fstat(dirfd(f->dir), &st);
+    else
+        ret = p9_stat(p, f->path, &st);
+    if(ret < 0)
+        return errno;
+    p9_put(out, P9_GETATTR_BASIC, 8);
+    p9_putqid(out, &st);
+    p9_put(out, st.st_mode, 4);
+    p9_put(out, st.st_uid, 4);
+    p9_put(out, st.st_gid, 4);
+    p9_put(out, st.st_nlink, 8);
+    p9_put(out, st.st_rdev, 8);
+    p9_put(out, st.st_size, 8);
+    p9_put(out, st.st_blksize, 8);
+    p9_put(out, st.st_blocks, 8);
+    p9_put(out, st.st_atim.tv_sec, 8);
+    p9_put(out, st.st_atim.tv_nsec, 8);
+    p9_put(out, st.st_mtim.tv_sec, 8);
+    p9_put(out, st.st_mtim.tv_nsec, 8);
+    p9_put(out, st.st_ctim.tv_sec, 8);
+    p9_put(out, st.st_ctim.tv_nsec, 8);
+    p9_put(out, 0, 8); //btime
+    p9_put(out, 0, 8);
+    p9_put(out, 0, 8); //gen
+    p9_put(out, 0, 8); //data_version
+    return 0;
+}
+
+
+static int p9_setattr(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint32_t valid = p9_get(in, 4);
+    uint32_t mode = p9_get(in, 4);
+    uint32_t uid = p9_get(in, 4);
+    uint32_t gid = p9_get(in, 4);
+    uint64_t size = p9_get(in, 8);
+    struct timespec ts[2];
+    struct p9_fid_t *f = p9_fid(p, fid);
+    const char *name;
+    struct stat st;
+    int err = 0, dirfd, fd;
+
+    ts[0].tv_sec = p9_get(in, 8);
+    ts[0].tv_nsec = p9_get(in, 8);
+    ts[1].tv_sec = p9_get(in, 8);
+    ts[1].tv_nsec = p9_get(in, 8);
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    dirfd = p9_parent(p, f->path, &name);
+    if(dirfd < 0)
+        return errno;
+    if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        err = errno;
+    if(!err && (valid & P9_ATTR_MODE)) {
+        //fchmodat() follows symlinks
+        if(S_ISLNK(st.st_mode))
+            err = EOPNOTSUPP;
+        else if(fchmodat(dirfd, name, mode & 07777, 0) < 0)
+            err = errno;
+    }
+    if(!err && (valid & (P9_ATTR_UID | P9_ATTR_GID))) {
+        if(fchownat(dirfd, name, (valid & P9_ATTR_UID) ? uid : (uint32_t)-1,
+         (valid & P9_ATTR_GID) ? gid : (uint32_t)-1, AT_SYMLINK_NOFOLLOW) < 0)
+            err = errno;
+    }
+    if(!err && (valid & P9_ATTR_SIZE)) {
+        if(f->fd >= 0) {
+            if(ftruncate(f->fd, size) < 0)
+                err = errno;
+        } else if(!S_ISREG(st.st_mode)) {
+            err = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        } else if((fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+            err = errno;
+        } else {
+            if(ftruncate(fd, size) < 0)
+                err = errno;
+            close(fd);
+        }
+    }
+    if(!err && (valid & (P9_ATTR_ATIME | P9_ATTR_MTIME))) {
+        if(!(valid & P9_ATTR_ATIME))
+            ts[0].tv_nsec = UTIME_OMIT;
+        else if(!(valid & P9_ATTR_ATIME_SET))
+            ts[0].tv_nsec = UTIME_NOW;
+        if(!(valid & P9_ATTR_MTIME))
+            ts[1].tv_nsec = UTIME_OMIT;
+        else if(!(valid & P9_ATTR_MTIME_SET))
+            ts[1].tv_nsec = UTIME_NOW;
+        if(utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW) < 0)
+            err = errno;
+    }
+    close(dirfd);
+    return err;
+}
+
+
+static int p9_readdir(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint64_t offset = p9_get(in, 8);
+    uint32_t count = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    uint32_t count_off = out->off;
+    uint32_t used = 0;
+
+    if(in->err)
+        return EPROTO;
+    if(!f || !f->dir)
+        return EBADF;
+    if(count > out->len - out->off - 4)
+        count = out->len - out->off - 4;
+    if(count > p->msize - P9_HEADER_SIZE - 4)
+        count = p->msize - P9_HEADER_SIZE - 4;
+    p9_put(out, 0, 4);
+    //offsets are telldir() cookies of the entry after
+    if(offset)
+        seekdir(f->dir, offset);
+    else
+        rewinddir(f->dir);
+    while(1) {
+        long pos = telldir(f->dir);
+        struct dirent *de;
+        uint32_t size;
+        uint8_t type = 0;
+
+        errno = 0;
+        de = readdir(f->dir);
+        if(!de) {
+            if(errno && !used)
+                return errno;
+            break;
+        }
+        size = P9_QID_SIZE + 8 + 1 + 2 + strlen(de->d_name);
+        if(used + size > count) {
+            seekdir(f->dir, pos);
+            break;
+        }
+        if(de->d_type == DT_DIR)
+            type = P9_QTDIR;
+        else if(de->d_type == DT_LNK)
+            type = P9_QTSYMLINK;
+        p9_put(out, type, 1);
+        p9_put(out, 0, 4);
+        p9_put(out, de->d_ino, 8);
+        p9_put(out, telldir(f->dir), 8);
+        p9_put(out, de->d_type, 1);
+        p9_putstr(out, de->d_name);
+        used += size;
+    }
+    p9_put_at(out->buf + count_off, used, 4);
+    return 0;
+}
+
+
+static int p9_mkdir(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t dfid = p9_get(in, 4);
+    uint32_t mode;
+    struct p9_fid_t *f = p9_fid(p, dfid);
+    struct stat st;
+    int err = 0, dirfd;
+
+    p9_getstr(in, name, sizeof(name));
+    mode = p9_get(in, 4);
+    p9_get(in, 4); //gid
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    dirfd = p9_dir(p, f->path, strlen(f->path));
+    if(dirfd < 0)
+        return errno;
+    if(mkdirat(dirfd, name, mode & 07777) < 0 ||
+     fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        err = errno;
+    close(dirfd);
+    if(!err)
+        p9_putqid(out, &st);
+    return err;
+}
+
+
+static int p9_symlink(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1], target[PATH_MAX];
+    uint32_t dfid = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, dfid);
+    struct stat st;
+    int err = 0, dirfd;
+
+    p9_getstr(in, name, sizeof(name));
+    p9_getstr(in, target, sizeof(target)); //never followed here, may point anywhere
+    p9_get(in, 4); //gid
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    dirfd = p9_dir(p, f->path, strlen(f->path));
+    if(dirfd < 0)
+        return errno;
+    if(symlinkat(target, dirfd, name) < 0 ||
+     fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        err = errno;
+    close(dirfd);
+    if(!err)
+        p9_putqid(out, &st);
+    return err;
+}
+
+
+static int p9_readlink(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char target[PATH_MAX];
+    uint32_t fid = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    const char *name;
+    ssize_t n;
+    int err = 0, dirfd;
+
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    dirfd = p9_parent(p, f->path, &name);
+    if(dirfd < 0)
+        return errno;
+    n = readlinkat(dirfd, name, target, sizeof(target) - 1);
+    if(n < 0)
+        err = errno;
+    close(dirfd);
+    if(err)
+        return err;
+    target[n] = '\0';
+    p9_putstr(out, target);
+    return 0;
+}
+
+
+static int p9_link(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t dfid = p9_get(in, 4);
+    uint32_t fid = p9_get(in, 4);
+    struct p9_fid_t *df = p9_fid(p, dfid);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    const char *oldname;
+    int err = 0, dirfd, olddirfd;
+
+    p9_getstr(in, name, sizeof(name));
+    if(in->err)
+        return EPROTO;
+    if(!df || !f)
+        return EBADF;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    dirfd = p9_dir(p, df->path, strlen(df->path));
+    if(dirfd < 0)
+        return errno;
+    olddirfd = p9_parent(p, f->path, &oldname);
+    if(olddirfd < 0 || linkat(olddirfd, oldname, dirfd, name, 0) < 0)
+        err = errno;
+    if(olddirfd >= 0)
+        close(olddirfd);
+    close(dirfd);
+    return err;
+}
+
+
+/* rename olddir/oldname to newdir/newname, open fids follow */
+static int p9_rename_path(struct p9_t *p, const char *olddir, const char *oldname,
+ const char *newdir, const char *newname)
+{
+    char *from = p9_join(olddir, oldname);
+    char *to = p9_join(newdir, newname);
+    int err = 0, oldfd = -1, newfd = -1;
+
+    if(!from || !to) {
+        err = errno;
+        goto out;
+    }
+    oldfd = p9_dir(p, olddir, strlen(olddir));
+    newfd = oldfd < 0 ? -1 : p9_dir(p, newdir, strlen(newdir));
+    if(newfd < 0 || renameat(oldfd, oldname, newfd, newname) < 0) {
+        err = errno;
+        goto out;
+    }
+    p9_fid_rename(p, from, to);
+out:
+    if(oldfd >= 0)
+        close(oldfd);
+    if(newfd >= 0)
+        close(newfd);
+    free(from);
+    free(to);
+    return err;
+}
+
+
+static int p9_rename(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t fid = p9_get(in, 4);
+    uint32_t dfid = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    struct p9_fid_t *df = p9_fid(p, dfid);
+    char *olddir, *slash;
+    int err;
+
+    p9_getstr(in, name, sizeof(name));
+    if(in->err)
+        return EPROTO;
+    if(!f || !df)
+        return EBADF;
+    if(!f->path[0])
+        return EBUSY;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    olddir = strdup(f->path);
+    if(!olddir)
+        return ENOMEM;
+    slash = strrchr(olddir, '/');
+    if(slash) {
+        *slash = '\0';
+        err = p9_rename_path(p, olddir, slash + 1, df->path, name);
+    } else {
+        err = p9_rename_path(p, "", olddir, df->path, name);
+    }
+    free(olddir);
+    return err;
+}
+
+
+static int p9_renameat(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char oldname[NAME_MAX + 1], newname[NAME_MAX + 1];
+    uint32_t olddirfid = p9_get(in, 4);
+    struct p9_fid_t *od, *nd;
+    uint32_t newdirfid;
+
+    p9_getstr(in, oldname, sizeof(oldname));
+    newdirfid = p9_get(in, 4);
+    p9_getstr(in, newname, sizeof(newname));
+    if(in->err)
+        return EPROTO;
+    od = p9_fid(p, olddirfid);
+    nd = p9_fid(p, newdirfid);
+    if(!od || !nd)
+        return EBADF;
+    if(!p9_name_ok(oldname) || !p9_name_ok(newname))
+        return EINVAL;
+    return p9_rename_path(p, od->path, oldname, nd->path, newname);
+}
+
+
+static int p9_unlinkat(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char name[NAME_MAX + 1];
+    uint32_t dfid = p9_get(in, 4);
+    uint32_t flags;
+    struct p9_fid_t *f = p9_fid(p, dfid);
+    int err = 0, dirfd;
+
+    p9_getstr(in, name, sizeof(name));
+    flags = p9_get(in, 4);
+    if(in->err)
+        return EPROTO;
+    if(!f)
+        return EBADF;
+    if(!p9_name_ok(name))
+        return EINVAL;
+    dirfd = p9_dir(p, f->path, strlen(f->path));
+    if(dirfd < 0)
+        return errno;
+    if(unlinkat(dirfd, name, (flags & P9_DOTL_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) < 0)
+        err = errno;
+    close(dirfd);
+    return err;
+}
+
+
+static int p9_statfs(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    struct statvfs sv;
+
+    if(in->err)
+        return EPROTO;
+    if(!p9_fid(p, fid))
+        return EBADF;
+    if(fstatvfs(p->root_fd, &sv) < 0)
+        return errno;
+    p9_put(out, P9_SUPER_MAGIC, 4);
+    p9_put(out, sv.f_bsize, 4);
+    p9_put(out, sv.f_blocks, 8);
+    p9_put(out, sv.f_bfree, 8);
+    p9_put(out, sv.f_bavail, 8);
+    p9_put(out, sv.f_files, 8);
+    p9_put(out, sv.f_ffree, 8);
+    p9_put(out, sv.f_fsid, 8);
+    p9_put(out, sv.f_namemax, 4);
+    return 0;
+}
+
+
+static int p9_fsync(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    uint32_t fid = p9_get(in, 4);
+    uint32_t datasync = p9_get(in, 4);
+    struct p9_fid_t *f = p9_fid(p, fid);
+    int fd;
+
+    if(in->err)
+        return EPROTO;
+    if(!f || !p9_fid_is_open(f))
+        return EBADF;
+    fd = f->dir ? dirfd(f->dir) : f->fd;
+    if((datasync ? fdatasync(fd) : fsync(fd)) < 0)
+        return errno;
+    return 0;
+}
+
+
+/* one client, so locks are kept by the guest kernel alone */
+static int p9_lock(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char client[256];
+    uint32_t fid = p9_get(in, 4);
+
+    p9_get(in, 1); //type
+    p9_get(in, 4); //flags
+    p9_get(in, 8); //start
+    p9_get(in, 8); //length
+    p9_get(in, 4); //proc_id
+    p9_getstr(in, client, sizeof(client));
+    if(in->err)
+        return EPROTO;
+    if(!p9_fid(p, fid))
+        return EBADF;
+    p9_put(out, P9_LOCK_SUCCESS, 1);
+    return 0;
+}
+
+
+static int p9_getlock(struct p9_t *p, struct p9_msg_t *in, struct p9_msg_t *out)
+{
+    char client[256];
+    uint32_t fid = p9_get(in, 4);
+    uint64_t start, length;
+    uint32_t proc_id;
+
+    p9_get(in, 1); //type
+    start = p9_get(in, 8);
+    length = p9_get(in, 8);
+    proc_id = p9_get(in, 4);
+    p9_getstr(in, client, sizeof(client));
+    if(in->err)
+        return EPROTO;
+    if(!p9_fid(p, fid))
+        return EBADF;
+    p9_put(out, P9_LOCK_TYPE_UNLCK, 1);
+    p9_put(out, start, 8);
+    p9_put(out, length, 8);
+    p9_put(out, proc_id, 4);
+    p9_putstr(out, client);
+    return 0;
+}
+
+/*******************************messages******************************************/
+
+int p9_open(struct p9_t *p, const char *root)
+{
+    memset(p->fids, 0, sizeof(p->fids));
+    p->fid_count = 0;
+    p->msize = P9_MSIZE_MAX;
+    p->root = root;
+    p->root_fd = -1;
+    if(!root)
+        return 0;
+    p->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(p->root_fd < 0) {
+        ERROR_PRINTF("%s: open err, %s\n", root, strerror(errno));
+        p->root = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+void p9_close(struct p9_t *p)
+{
+    p9_reset(p);
+    if(p->root_fd >= 0) {
+        close(p->root_fd);
+        p->root_fd = -1;
+    }
+}
+
+
+void p9_reset(struct p9_t *p)
+{
+    int i;
+    for(i = 0; i < P9_FID_HASH; i++) {
+        while(p->fids[i])
+            p9_fid_free(p, p->fids[i]->fid);
+    }
+}
+
+
+int p9_request(struct p9_t *p, uint8_t *req, uint32_t req_len, uint8_t *resp, uint32_t resp_len)
+{
+    struct p9_msg_t in = { .buf = req, .len = req_len };
+    struct p9_msg_t out = { .buf = resp, .len = resp_len, .off = P9_HEADER_SIZE };
+    uint32_t size = p9_get(&in, 4);
+    uint8_t type = p9_get(&in, 1);
+    uint16_t tag = p9_get(&in, 2);
+    int err;
+
+    if(in.err || size < P9_HEADER_SIZE || size > req_len || resp_len < P9_HEADER_SIZE + 4)
+        return -1;
+    in.len = size;
+    if(p->root_fd < 0) {
+        err = ENODEV;
+    } else {
+        switch(type) {
+        case P9_TVERSION:   err = p9_version(p, &in, &out);  break;
+        case P9_TATTACH:    err = p9_attach(p, &in, &out);   break;
+        case P9_TFLUSH:     err = 0;                         break; //served in order, nothing to cancel
+        case P9_TWALK:      err = p9_walk(p, &in, &out);     break;
+        case P9_TLOPEN:     err = p9_lopen(p, &in, &out);    break;
+        case P9_TLCREATE:   err = p9_lcreate(p, &in, &out);  break;
+        case P9_TREAD:      err = p9_read(p, &in, &out);     break;
+        case P9_TWRITE:     err = p9_write(p, &in, &out);    break;
+        case P9_TCLUNK:     err = p9_clunk(p, &in, &out);    break;
+        case P9_TREMOVE:    err = p9_remove(p, &in, &out);   break;
+        case P9_TGETATTR:   err = p9_getattr(p, &in, &out);  break;
+        case P9_TSETATTR:   err = p9_setattr(p, &in, &out);  break;
+        case P9_TREADDIR:   err = p9_readdir(p, &in, &out);  break;
+        case P9_TMKDIR:     err = p9_mkdir(p, &in, &out);    break;
+        case P9_TSYMLINK:   err = p9_symlink(p, &in, &out);  break;
+        case P9_TREADLINK:  err = p9_readlink(p, &in, &out); break;
+        case P9_TLINK:      err = p9_link(p, &in, &out);     break;
+        case P9_TRENAME:    err = p9_rename(p, &in, &out);   break;
+        case P9_TRENAMEAT:  err = p9_renameat(p, &in, &out); break;
+        case P9_TUNLINKAT:  err = p9_unlinkat(p, &in, &out); break;
+        case P9_TSTATFS:    err = p9_statfs(p, &in, &out);   break;
+        case P9_TFSYNC:     err = p9_fsync(p, &in, &out);    break;
+        case P9_TLOCK:      err = p9_lock(p, &in, &out);     break;
+        case P9_TGETLOCK:   err = p9_getlock(p, &in, &out);  break;
+        default:            err = EOPNOTSUPP;                break; //xattrs, mknod, auth
+        }
+    }
+    if(!err && out.err)
+        err = EMSGSIZE;
+    if(err) {
+        out.off = P9_HEADER_SIZE;
+        out.err = 0;
+        p9_put(&out, err, 4);
+        type = P9_RLERROR - 1;
+        __atomic_fetch_add(&p->errors, 1, __ATOMIC_RELAXED);
+    }
+    p9_put_at(resp, out.off, 4);
+    p9_put_at(resp + 4, type + 1, 1);
+    p9_put_at(resp + 5, tag, 2);
+    return out.off;
+}
+
+/*****************************END OF FILE***************************/
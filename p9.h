@@ -0,0 +1,62 @@
+/*
+ * p9.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _P9_H_
+#define _P9_H_
+
+#include <stdint.h>
+
+/*
+ * 9P2000.L file server on a host directory, the dialect of the Linux
+ * v9fs client. Nothing outside the directory is reachable: paths are
+ * resolved one component at a time without following symlinks, and
+ * symlinks are handed to the client to resolve.
+ */
+#define P9_VERSION           "9P2000.L"
+#define P9_MSIZE_MAX         (512 * 1024)  /* message size limit offered by Tversion */
+#define P9_HEADER_SIZE       (7)           /* size[4] type[1] tag[2] */
+#define P9_FID_HASH          (64)
+
+struct p9_fid_t;
+
+struct p9_t {
+    const char *root;         //shared host directory, NULL if none
+    int root_fd;
+    uint32_t msize;           //negotiated by Tversion
+    struct p9_fid_t *fids[P9_FID_HASH];
+    uint32_t fid_count;
+
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint32_t errors;          //Rlerror replies
+};
+
+/* return: 0 done, -1 error */
+int p9_open(struct p9_t *p, const char *root);
+void p9_close(struct p9_t *p);
+/* clunk all fids, as Tversion does */
+void p9_reset(struct p9_t *p);
+/*
+ * p9_request: serve one T-message, not thread safe, a server is used by
+ * one thread at a time, req and resp may be guest RAM,
+ * return: R-message length, -1 malformed header or resp too small
+ */
+int p9_request(struct p9_t *p, uint8_t *req, uint32_t req_len, uint8_t *resp, uint32_t resp_len);
+
+#endif
+/*****************************END OF FILE***************************/
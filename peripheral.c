@@ -16,15 +16,29 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#define _GNU_SOURCE  /* memfd_create */
 #include <peripheral.h>
+#include <armv4.h>
+#include <crypto.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <poll.h>
+#include <errno.h>
+#include <loop.h>
 
 #ifdef USE_PRCTL_SET_THREAD_NAME
 #include <sys/prctl.h>
 #endif
 
+#ifdef USE_GETRANDOM_SUPPORT
+#include <sys/random.h>
+#endif
+
+#ifndef MADV_REMOVE
+#define MADV_REMOVE   MADV_DONTNEED
+#endif
+
 #define LOG_NAME   "peripheral"
 #define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
 #define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
@@ -32,52 +46,30 @@
 
 
 /******************************memory*****************************************/
-uint32_t memory_reset(void *base)
-{
-    uint8_t **mem = base;
-    *mem = (uint8_t *)malloc(MEM_SIZE);
-    if(!*mem) {
-        ERROR_PRINTF("memory alloc err\n");
-        return 0;
-    }
-    return 1;
-}
-
-
-void memory_exit(int s, void *base)
-{
-    uint8_t **mem = base;
-    free(*mem);
-    *mem = NULL;
-}
-
-
-uint32_t memory_read(void *base, uint32_t address)
+static inline uint32_t mem_load(uint8_t *p)
 {
-    uint8_t **mem = base;
-    return *((int*)(*mem + address));
+    return *((int*)p);
 }
 
 
-void memory_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+static inline void mem_store(uint8_t *p, uint32_t data, uint8_t mask)
 {
-    uint8_t **mem = base;
     switch(mask) {
     case 3:
         {    
-            int *data_p = (int *) (*mem + address);
+            int *data_p = (int *)p;
             *data_p = data;
         }
         break;
     case 1:
         {
-            short *data_p = (short *) (*mem + address);
+            short *data_p = (short *)p;
             *data_p = data;
         }
         break;
     default:
         {
-            char * data_p = (char *) (*mem + address);
+            char * data_p = (char *)p;
             *data_p = data;
         }
         break;
@@ -85,6 +77,226 @@ void memory_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
 }
 
 
+static int memory_shm_open(struct memory_t *m)
+{
+    int fd;
+#ifdef USE_MEMFD_SUPPORT
+    if(strcmp(m->shm_name, "memfd") == 0) {
+        fd = memfd_create("armemulator", MFD_CLOEXEC);
+        if(fd >= 0)
+            DEBUG_PRINTF("memory shared at /proc/%d/fd/%d\n", getpid(), fd);
+        return fd;
+    }
+#endif
+    fd = shm_open(m->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0)
+        DEBUG_PRINTF("memory shared at shm %s\n", m->shm_name);
+    return fd;
+}
+
+/*
+ * memory_shm_reset: RAM is a shared file mapping, a header page
+ * describing the layout is placed in front of it.
+ */
+static uint32_t memory_shm_reset(struct memory_t *m)
+{
+    uint8_t *map;
+    m->shm_fd = memory_shm_open(m);
+    if(m->shm_fd < 0) {
+        ERROR_PRINTF("memory shm open %s err\n", m->shm_name);
+        return 0;
+    }
+    if(ftruncate(m->shm_fd, MEM_PAGE_SIZE + MEM_SIZE) < 0) {
+        ERROR_PRINTF("memory shm truncate err\n");
+        goto err;
+    }
+    map = mmap(NULL, MEM_PAGE_SIZE + MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m->shm_fd, 0);
+    if(map == MAP_FAILED) {
+        ERROR_PRINTF("memory shm mmap err\n");
+        goto err;
+    }
+    m->shm = (struct memory_shm_header_t *)map;
+    m->shm->magic = MEM_SHM_MAGIC;
+    m->shm->version = MEM_SHM_VERSION;
+    m->shm->header_size = MEM_PAGE_SIZE;
+    m->shm->page_size = MEM_PAGE_SIZE;
+    m->shm->ram_base = 0;
+    m->shm->ram_size = MEM_SIZE;
+    m->shm->pid = getpid();
+    m->mem = map + MEM_PAGE_SIZE;
+    return 1;
+
+err:
+    close(m->shm_fd);
+    if(strcmp(m->shm_name, "memfd") != 0)
+        shm_unlink(m->shm_name);
+    return 0;
+}
+
+/*
+ * Guest RAM is a private anonymous mapping, so that fork() based clones
+ * share every page with the template until one of them writes it.
+ */
+uint32_t memory_reset(void *base)
+{
+    struct memory_t *m = base;
+    m->dirty_log = 0;
+    m->shm = NULL;
+    m->shm_fd = -1;
+    m->shm_private = 0;
+    pthread_rwlock_init(&m->host_lock, NULL);
+    if(m->shm_name)
+        return memory_shm_reset(m);
+
+    m->mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m->mem == MAP_FAILED) {
+        m->mem = NULL;
+        ERROR_PRINTF("memory alloc err\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+void memory_exit(int s, void *base)
+{
+    struct memory_t *m = base;
+    if(m->shm) {
+        munmap(m->shm, MEM_PAGE_SIZE + MEM_SIZE);
+        close(m->shm_fd);
+        if(!m->shm_private && strcmp(m->shm_name, "memfd") != 0)
+            shm_unlink(m->shm_name);
+        m->shm = NULL;
+    } else if(m->mem) {
+        munmap(m->mem, MEM_SIZE);
+    }
+    m->mem = NULL;
+}
+
+
+/*
+ * memory_fork_child: a shared RAM file is remapped copy-on-write,
+ * the clone must not write the template RAM or header.
+ */
+int memory_fork_child(void *base)
+{
+    struct memory_t *m = base;
+    //a pool thread of the template may have held it, none runs here
+    pthread_rwlock_init(&m->host_lock, NULL);
+    if(!m->shm)
+        return 0;
+    void *map = mmap(m->shm, MEM_PAGE_SIZE + MEM_SIZE, PROT_READ | PROT_WRITE,
+     MAP_PRIVATE | MAP_FIXED, m->shm_fd, 0);
+    if(map == MAP_FAILED) {
+        ERROR_PRINTF("memory remap err\n");
+        return -1;
+    }
+    m->shm_private = 1;
+    return 0;
+}
+
+
+uint32_t memory_read(void *base, uint32_t address)
+{
+    struct memory_t *m = base;
+    return mem_load(m->mem + address);
+}
+
+
+void memory_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct memory_t *m = base;
+    mem_store(m->mem + address, data, mask);
+    if(m->dirty_log) {
+        uint32_t page = address >> MEM_PAGE_SHIFT;
+        __atomic_fetch_or(&m->dirty[page >> 5], 1U << (page & 31), __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * memory_dirty_log: start or stop dirty page logging,
+ * all pages are clean when logging starts.
+ */
+void memory_dirty_log(struct memory_t *m, uint8_t enable)
+{
+    memset(m->dirty, 0, sizeof(m->dirty));
+    __atomic_store_n(&m->dirty_log, enable, __ATOMIC_RELEASE);
+}
+
+
+/* for host side writers of guest RAM */
+void memory_set_dirty(struct memory_t *m, uint32_t address, uint32_t len)
+{
+    if(!m->dirty_log || !len)
+        return;
+    for(uint32_t page = address >> MEM_PAGE_SHIFT;
+     page <= (address + len - 1) >> MEM_PAGE_SHIFT && page < MEM_PAGE_NUMBER; page++) {
+        __atomic_fetch_or(&m->dirty[page >> 5], 1U << (page & 31), __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * memory_discard: give the page aligned range back to the host,
+ * it reads as zero afterwards.
+ */
+void memory_discard(struct memory_t *m, uint32_t address, uint32_t len)
+{
+    if(address >= MEM_SIZE || (address & (MEM_PAGE_SIZE - 1)) || (len & (MEM_PAGE_SIZE - 1)))
+        return;
+    if(len > MEM_SIZE - address)
+        len = MEM_SIZE - address;
+    if(m->shm_private) {
+        //dropping a private file page would bring back the template data
+        memset(m->mem + address, 0, len);
+    } else if(madvise(m->mem + address, len, m->shm ? MADV_REMOVE : MADV_DONTNEED) < 0) {
+        ERROR_PRINTF("memory discard 0x%x err\n", address);
+        return;
+    }
+    memory_set_dirty(m, address, len);
+}
+
+
+/*
+ * memory_host_begin/end: around writes of RAM from a thread other than
+ * the cpu thread, pages are not discarded by the cpu thread meanwhile.
+ */
+void memory_host_begin(struct memory_t *m)
+{
+    pthread_rwlock_rdlock(&m->host_lock);
+}
+
+
+void memory_host_end(struct memory_t *m)
+{
+    pthread_rwlock_unlock(&m->host_lock);
+}
+
+
+/*
+ * memory_host_trylock: from cpu thread, keep other threads from writing
+ * RAM until memory_host_end, return: 0 done, -1 a write is in progress
+ */
+int memory_host_trylock(struct memory_t *m)
+{
+    return pthread_rwlock_trywrlock(&m->host_lock) == 0 ? 0 : -1;
+}
+
+
+/*
+ * memory_get_dirty: test and clear the dirty bit of page,
+ * return: 0 clean, 1 dirty
+ */
+int memory_get_dirty(struct memory_t *m, uint32_t page)
+{
+    uint32_t bit = 1U << (page & 31);
+    if(!(__atomic_load_n(&m->dirty[page >> 5], __ATOMIC_RELAXED) & bit))
+        return 0;
+    return (__atomic_fetch_and(&m->dirty[page >> 5], ~bit, __ATOMIC_ACQUIRE) & bit) ? 1 : 0;
+}
+
+
 /******************************memory*****************************************/
 
 /******************************fs*****************************************/
@@ -92,9 +304,8 @@ void fs_exit(int s, void *base)
 {
     struct fs_t *fs = base;
 #ifdef FS_MMAP_MODE
-    if(fs->fd) {
-        munmap(fs->map, fs->len);
-        close(fs->fd);
+    if(fs->img.len) {
+        image_close(&fs->img);
         DEBUG_PRINTF("fs Exit %s\n", fs->filename);
     }
 #else
@@ -112,18 +323,11 @@ uint32_t fs_reset(void *base)
     uint32_t ret = 0;
     if(fs->filename) {
 #ifdef FS_MMAP_MODE
-        fs->fd = open(fs->filename, O_RDWR);
-        if(fs->fd < 0) {
+        if(image_open(&fs->img, fs->filename) < 0) {
             ERROR_PRINTF("fs Open %s: err\n", fs->filename);
             return ret;
         }
-        fs->len = lseek(fs->fd, 0L, SEEK_END);
-        fs->map = mmap(0, fs->len, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
-        if(fs->map == MAP_FAILED) {
-            ERROR_PRINTF("fs mmap %s: err\n", fs->filename);
-            close(fs->fd);
-            return ret;
-        }
+        fs->len = fs->img.len;
         ret = 1;
 #else
         fs->fp = fopen(fs->filename, "rb+");
@@ -131,6 +335,10 @@ uint32_t fs_reset(void *base)
             ERROR_PRINTF("fs Open %s: err\n", fs->filename);
             return ret;
         }
+        //the blk device reads and writes the fd behind the stream
+        setvbuf(fs->fp, NULL, _IONBF, 0);
+        fseek(fs->fp, 0L, SEEK_END);
+        fs->len = ftell(fs->fp);
         ret = 1;
 #endif
     }
@@ -138,12 +346,45 @@ uint32_t fs_reset(void *base)
 }
 
 
+/*
+ * fs_fork_child: called in a cloned machine, guest writes must not
+ * reach the image shared with the template and the other clones.
+ */
+int fs_fork_child(void *base)
+{
+    struct fs_t *fs = base;
+#ifdef FS_MMAP_MODE
+    if(fs->img.len && image_fork_child(&fs->img) < 0) {
+        ERROR_PRINTF("fs remap %s: err\n", fs->filename);
+        return -1;
+    }
+#else
+    if(fs->fp) {
+        fclose(fs->fp);
+        fs->fp = fopen(fs->filename, "rb");
+        if(fs->fp == NULL) {
+            ERROR_PRINTF("fs Open %s: err\n", fs->filename);
+            return -1;
+        }
+        setvbuf(fs->fp, NULL, _IONBF, 0);
+    }
+#endif
+    return 0;
+}
+
+
 uint32_t fs_read(void *base, uint32_t address)
 {
     struct fs_t *fs = base;
 #ifdef FS_MMAP_MODE
-    if(fs->map && address < fs->len) {
-        return memory_read(&fs->map, address);
+    if(address < fs->len) {
+        uint8_t *p = image_ptr(&fs->img, address, 0);
+        uint32_t data = 0;
+        if(p)
+            return mem_load(p);
+        //compressed, no stable pointer
+        image_read(&fs->img, &data, sizeof(data), address);
+        return data;
     }
     return 0;
 #else
@@ -161,8 +402,10 @@ void fs_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
 {
     struct fs_t *fs = base;
 #ifdef FS_MMAP_MODE
-    if(fs->map && address < fs->len) {
-        memory_write(&fs->map, address, data, mask);
+    if(address < fs->len) {
+        uint8_t *p = image_ptr(&fs->img, address, 1);
+        if(p)
+            mem_store(p, data, mask);
     }
 #else
     if(!fs->fp) {
@@ -256,6 +499,8 @@ static uint32_t interrupt_detect(struct interrupt_register *intc, uint32_t id)
     return 1;
 }
 
+static uint8_t uart_8250_event(struct uart_register *uart, uint8_t type);
+
 /*
  * user_event: interrupt request
  * author:hxdyxd
@@ -285,25 +530,22 @@ uint32_t user_event(struct peripheral_t *base, uint8_t type)
     } else {
         for(int i=0; i<UART_NUMBER; i++) {
             struct uart_register *uart = &base->uart[i];
-            if(uart->IER & 0xf) {
-                //uart enable
-                uart->IIR = UART_IIR_NO_INT; //no interrupt pending
-                //UART
-                if( (uart->IER & UART_IER_THRI) && uart->interface->writeable() ) {
-                    //Bit1, Enable Transmit Holding Register Empty Interrupt. 
-                    if((event = interrupt_action(intc, uart->interrupt_id)) != 0) {
-                        uart->IIR = UART_IIR_THRI; // THR empty interrupt pending
-                    }
-                    return event;
-                } else  if( (uart->IER & UART_IER_RDI) && uart->interface->readable() ) {
-                    //Bit0, Enable Received Data Available Interrupt. 
-                    if((event = interrupt_action(intc, uart->interrupt_id)) != 0 ) {
-                        uart->IIR = UART_IIR_RDI; //received data available interrupt pending
-                    }
+            if(uart_8250_event(uart, type)) {
+                if((event = interrupt_action(intc, uart->interrupt_id)) != 0)
                     return event;
-                }
-            } /*end if*/
+            }
         } /*end for*/
+
+        uint32_t req = __atomic_load_n(&base->irq_req, __ATOMIC_ACQUIRE);
+        while(req) {
+            uint32_t id = __builtin_ctz(req);
+            req &= ~(1U << id);
+            if((event = interrupt_action(intc, id)) != 0) {
+                if(type != EVENT_TYPE_DETECT)
+                    __atomic_fetch_and(&base->irq_req, ~(1U << id), __ATOMIC_RELAXED);
+                return event;
+            }
+        }
     }
     return event;
 }
@@ -353,13 +595,27 @@ uint32_t tim_reset(void *base)
     tim->PERIOD = 1;
     DEBUG_PRINTF("timer interrupt id: %d\n", tim->interrupt_id);
 
-    tim->is_run = 1;
     tim->privious_cnt = 0;
+    if(tim_fork_child(tim) < 0)
+        return 0;
+    return 1;
+}
+
+
+/*
+ * tim_fork_child: only the calling thread survives fork(), restart
+ * the timer task without touching the timer registers.
+ */
+int tim_fork_child(void *base)
+{
+    struct timer_register *tim = base;
+    tim->is_run = 1;
     if(pthread_create(&tim->thread_id, 0, tim_proc, tim) < 0) {
         ERROR_PRINTF("timer task err!\n");
-        return 0;
+        tim->is_run = 0;
+        return -1;
     }
-    return 1;
+    return 0;
 }
 
 
@@ -411,17 +667,143 @@ uint8_t uart_8250_rw_disable(void)
 }
 
 
+static uint8_t uart_null_write(uint8_t ch)
+{
+    return 0;
+}
+
+
+/* nothing attached, the port never receives and drops what is sent */
+static const struct charwr_interface uart_null_interface = {
+    .init = uart_8250_rw_enable,
+    .exit = NULL,
+    .readable = uart_8250_rw_disable,
+    .read = uart_8250_rw_disable,
+    .writeable = uart_8250_rw_enable,
+    .write = uart_null_write,
+};
+
+
+int uart_null_register(const struct charwr_interface **interface, struct loop_t *lo)
+{
+    *interface = &uart_null_interface;
+    return 0;
+}
+
+
+/*
+ * The fifos sit between the guest and the backend, bytes move in bursts
+ * on LSR/RBR/THR access and every UART_POLL_RATE user_event calls, the
+ * backend is not asked on every instruction. Without FCR_ENABLE_FIFO
+ * both fifos hold one byte, as on a 16450.
+ */
+#define UART_POLL_RATE      (64)    /* power of two */
+/* character timeout, user_event calls without rx fifo activity */
+#define UART_RX_TIMEOUT     (1024)
+
+static inline uint32_t uart_8250_fifo_depth(struct uart_register *uart)
+{
+    return (uart->FCR & UART_FCR_ENABLE_FIFO) ? UART_FIFO_SIZE : 1;
+}
+
+/* FCR[7:6] selects 1, 1/4, 1/2 or full-2 bytes, 1/4/8/14 for 16 bytes */
+static inline uint32_t uart_8250_rx_trigger(struct uart_register *uart)
+{
+    const uint32_t trigger[4] = {1, UART_FIFO_SIZE / 4, UART_FIFO_SIZE / 2, UART_FIFO_SIZE - 2};
+    if(!(uart->FCR & UART_FCR_ENABLE_FIFO))
+        return 1;
+    return trigger[(uart->FCR & UART_FCR_TRIGGER_MASK) >> 6];
+}
+
+static void uart_8250_tx_flush(struct uart_register *uart)
+{
+    const struct charwr_interface *io = uart->interface;
+    uint32_t n = 0;
+    if(!uart->tx_count)
+        return;
+    if(io->write_buf) {
+        n = io->write_buf(uart->tx_fifo, uart->tx_count);
+    } else {
+        for(; n < uart->tx_count && io->writeable(); n++)
+            io->write(uart->tx_fifo[n]);
+    }
+    if(!n)
+        return;
+    uart->tx_count -= n;
+    memmove(uart->tx_fifo, uart->tx_fifo + n, uart->tx_count);
+    if(!uart->tx_count)
+        uart->thre_pending = 1;
+}
+
+static void uart_8250_rx_fill(struct uart_register *uart)
+{
+    const struct charwr_interface *io = uart->interface;
+    uint32_t room = uart_8250_fifo_depth(uart);
+    uint32_t n = 0;
+    if(uart->rx_count >= room)
+        return;
+    memmove(uart->rx_fifo, uart->rx_fifo + uart->rx_head, uart->rx_count);
+    uart->rx_head = 0;
+    room -= uart->rx_count;
+    if(io->read_buf) {
+        n = io->read_buf(uart->rx_fifo + uart->rx_count, room);
+    } else {
+        for(; n < room && io->readable(); n++)
+            uart->rx_fifo[uart->rx_count + n] = io->read();
+    }
+    if(n) {
+        uart->rx_count += n;
+        uart->rx_idle = 0;
+    }
+}
+
+/* highest priority pending interrupt, UART_IIR_NO_INT if none */
+static uint32_t uart_8250_iir(struct uart_register *uart)
+{
+    if(uart->IER & UART_IER_RDI) {
+        if(uart->rx_count >= uart_8250_rx_trigger(uart))
+            return UART_IIR_RDI;
+        if(uart->rx_count && uart->rx_idle >= UART_RX_TIMEOUT)
+            return UART_IIR_RX_TIMEOUT;
+    }
+    if((uart->IER & UART_IER_THRI) && uart->thre_pending)
+        return UART_IIR_THRI;
+    return UART_IIR_NO_INT;
+}
+
+/* return: 1 interrupt pending */
+static uint8_t uart_8250_event(struct uart_register *uart, uint8_t type)
+{
+    if(!uart->interface)
+        return 0;
+    if(type == EVENT_TYPE_DETECT || !(++uart->poll_cnt & (UART_POLL_RATE - 1))) {
+        uart_8250_tx_flush(uart);
+        uart_8250_rx_fill(uart);
+    }
+    //a wfi poll sleeps for about as long as UART_POLL_RATE instructions take
+    if(uart->rx_count && uart->rx_idle < UART_RX_TIMEOUT)
+        uart->rx_idle += (type == EVENT_TYPE_DETECT) ? UART_POLL_RATE : 1;
+    if(!(uart->IER & 0xf))
+        return 0;
+    return uart_8250_iir(uart) != UART_IIR_NO_INT;
+}
+
+
 uint32_t uart_8250_reset(void *base) 
 {
     struct uart_register *uart = base;
     uart->IER = 0;
     uart->IIR = UART_IIR_NO_INT; //no interrupt pending
+    uart->FCR = 0;
     uart->LSR = UART_LSR_TEMT | UART_LSR_THRE; //THR empty
+    uart->rx_head = uart->rx_count = uart->tx_count = 0;
+    uart->rx_idle = 0;
+    uart->thre_pending = 0;
     if(!uart->interface_register_cb) {
         ERROR_PRINTF("uart_8250 interface_register_cb = null\n");
         return 0;
     }
-    if(uart->interface_register_cb(&uart->interface) < 0)
+    if(uart->interface_register_cb(&uart->interface, uart->loop) < 0)
         return 0;
     if(!uart->interface->readable || !uart->interface->read)
         return 0;
@@ -443,6 +825,23 @@ void uart_8250_exit(int s, void *base)
 }
 
 
+/*
+ * uart_8250_fork_child: give a cloned machine its own backend,
+ * the loop must have been re-initialised before.
+ */
+int uart_8250_fork_child(void *base)
+{
+    struct uart_register *uart = base;
+    if(!uart->interface)
+        return -1;
+    if(uart->interface->exit)
+        uart->interface->exit();
+    if(!uart->interface->init())
+        return -1;
+    return 0;
+}
+
+
 
 uint32_t uart_8250_read(void *base, uint32_t address)
 {
@@ -455,7 +854,13 @@ uint32_t uart_8250_read(void *base, uint32_t address)
             return uart->DLL;
         } else {
             //Receive Buffer Register
-            uart->RBR = uart->interface->read();
+            if(!uart->rx_count)
+                uart_8250_rx_fill(uart);
+            if(uart->rx_count) {
+                uart->RBR = uart->rx_fifo[uart->rx_head++];
+                uart->rx_count--;
+                uart->rx_idle = 0;
+            }
             return uart->RBR;
         }
         break;
@@ -469,7 +874,12 @@ uint32_t uart_8250_read(void *base, uint32_t address)
         }
         break;
     case 0x8:
-        //Interrupt Identity Register
+        //Interrupt Identity Register, reading a THRE interrupt acknowledges it
+        uart->IIR = uart_8250_iir(uart);
+        if(uart->IIR == UART_IIR_THRI)
+            uart->thre_pending = 0;
+        if(uart->FCR & UART_FCR_ENABLE_FIFO)
+            return uart->IIR | UART_IIR_FIFO_ENABLED;
         return uart->IIR;
     case 0xc:
         //Line Control Register
@@ -478,9 +888,13 @@ uint32_t uart_8250_read(void *base, uint32_t address)
         //Modem Control Register
         return uart->MCR;
     case 0x14:
-        //Line Status Register, read-only
-        register_set(uart->LSR, 0, uart->interface->readable()?1:0);
-        register_set(uart->LSR, 6, uart->interface->writeable()?1:0);
+        //Line Status Register, read-only, polling guests drive the fifos from here
+        uart_8250_tx_flush(uart);
+        if(!uart->rx_count)
+            uart_8250_rx_fill(uart);
+        register_set(uart->LSR, 0, uart->rx_count ? 1 : 0);
+        register_set(uart->LSR, 5, uart->tx_count ? 0 : 1);
+        register_set(uart->LSR, 6, uart->tx_count ? 0 : 1);
         return uart->LSR;
     case 0x18:
         //Modem Status Registe, read-only
@@ -508,7 +922,14 @@ void uart_8250_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
             uart->DLL = data;
         } else {
             //Transmit Holding Register
-            uart->interface->write(data);
+            if(uart->tx_count >= uart_8250_fifo_depth(uart))
+                uart_8250_tx_flush(uart);
+            if(uart->tx_count < uart_8250_fifo_depth(uart))
+                uart->tx_fifo[uart->tx_count++] = data;
+            uart->thre_pending = 0;
+            //a 16450 holding register goes out at once
+            if(!(uart->FCR & UART_FCR_ENABLE_FIFO))
+                uart_8250_tx_flush(uart);
         }
         break;
     case 0x4:
@@ -516,13 +937,25 @@ void uart_8250_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
             //Divisor Latch High
             uart->DLH = data;
         } else {
-            //Interrupt Enable Register 
+            //Interrupt Enable Register, enabling THRI with an empty fifo raises it
+            if((data & ~uart->IER & UART_IER_THRI) && !uart->tx_count)
+                uart->thre_pending = 1;
             uart->IER = data;
         }
         break;
     case 0x8:
-        //FIFO Control Register
-        uart->FCR = data;
+        //FIFO Control Register, write-only
+        if((data ^ uart->FCR) & UART_FCR_ENABLE_FIFO)
+            data |= UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT;
+        if(data & UART_FCR_CLEAR_RCVR)
+            uart->rx_head = uart->rx_count = 0;
+        if(data & UART_FCR_CLEAR_XMIT) {
+            //hand what the backend takes over before dropping the rest
+            uart_8250_tx_flush(uart);
+            uart->tx_count = 0;
+            uart->thre_pending = 1;
+        }
+        uart->FCR = data & (UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_MASK);
         break;
     case 0xc:
         //Line Control Register
@@ -567,4 +1000,1984 @@ void uart_8250_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
 
 
 /*******************************uart*****************************************/
+
+
+/*******************************balloon**************************************/
+/*
+ * Guest protocol:
+ *  0x00 ID       read-only, BALLOON_ID
+ *  0x04 TARGET   read-only, pages the guest should give up
+ *  0x08 ACTUAL   pages given up, written by the guest
+ *  0x0c INFLATE  write a page address, the page goes back to the host
+ *  0x10 DEFLATE  write a page address, the guest takes the page again
+ *  0x14 ADDR     free page report start address
+ *  0x18 LEN      write length in bytes, reports [ADDR, ADDR+LEN) as free
+ *  0x1c ISR      interrupt status, write 1 to clear
+ * The interrupt is raised when TARGET changes.
+ */
+#define BALLOON_ID   (0x424c4e31)  /* "BLN1" */
+
+uint32_t balloon_reset(void *base)
+{
+    struct balloon_register *b = base;
+    b->TARGET = 0;
+    b->ACTUAL = 0;
+    b->ADDR = 0;
+    b->ISR = 0;
+    b->discarded = 0;
+    DEBUG_PRINTF("balloon interrupt id: %d\n", b->interrupt_id);
+    return 1;
+}
+
+
+uint32_t balloon_read(void *base, uint32_t address)
+{
+    struct balloon_register *b = base;
+    switch(address) {
+    case 0x0:
+        return BALLOON_ID;
+    case 0x4:
+        return b->TARGET;
+    case 0x8:
+        return b->ACTUAL;
+    case 0x14:
+        return b->ADDR;
+    case 0x1c:
+        return b->ISR;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+static void balloon_discard(struct balloon_register *b, uint32_t address, uint32_t len)
+{
+    uint32_t end = address + len;
+    if(address >= MEM_SIZE || len > MEM_SIZE - address)
+        return;
+    //only whole pages inside RAM
+    address = (address + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+    end &= ~(MEM_PAGE_SIZE - 1);
+    if(end <= address)
+        return;
+    memory_discard(b->mem, address, end - address);
+    b->discarded += (end - address) >> MEM_PAGE_SHIFT;
+}
+
+
+void balloon_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct balloon_register *b = base;
+    switch(address) {
+    case 0x8:
+        b->ACTUAL = data;
+        break;
+    case 0xc:
+        balloon_discard(b, data, MEM_PAGE_SIZE);
+        break;
+    case 0x10:
+        //nothing to do, the next guest write faults a fresh page in
+        break;
+    case 0x14:
+        b->ADDR = data;
+        break;
+    case 0x18:
+        balloon_discard(b, b->ADDR, data);
+        break;
+    case 0x1c:
+        b->ISR &= ~data;
+        break;
+    default:
+        break;
+    }
+}
+
+
+/* from cpu thread */
+void balloon_set_target(struct balloon_register *b, uint32_t pages)
+{
+    if(pages > MEM_PAGE_NUMBER)
+        pages = MEM_PAGE_NUMBER;
+    b->TARGET = pages;
+    b->ISR |= BALLOON_ISR_TARGET;
+    irq_raise(b->irq_req, b->interrupt_id);
+}
+
+
+void balloon_show(struct balloon_register *b)
+{
+    DEBUG_PRINTF("balloon target %u pages, actual %u pages, discarded %u pages\n",
+     b->TARGET, b->ACTUAL, b->discarded);
+}
+
+/*******************************balloon**************************************/
+
+
+/*******************************nic******************************************/
+/*
+ * Guest protocol:
+ *  0x00 ID        read-only, NIC_ID
+ *  0x04 STATUS    read-only, bit0 link up
+ *  0x08 CTRL      NIC_CTRL_*
+ *  0x0c MAC_LO    read-only, mac[0..3]
+ *  0x10 MAC_HI    read-only, mac[4..5]
+ *  0x14 IER       NIC_INT_* enable
+ *  0x18 ISR       NIC_INT_* status, write 1 to clear
+ *  0x1c ITR       rx interrupt after [15:0] frames or [31:16] us
+ *  0x20-0x2c      TX_BASE, TX_SIZE, TX_HEAD, TX_TAIL
+ *  0x30-0x3c      RX_BASE, RX_SIZE, RX_HEAD, RX_TAIL
+ *  0x40-0x48      read-only, rx frames, tx frames, rx dropped
+ * Rings are arrays of struct nic_desc_t in RAM. The guest owns the
+ * descriptors from TAIL to HEAD, it fills them and moves TAIL, the
+ * device owns the descriptors from HEAD to TAIL, it sets
+ * NIC_DESC_DONE and moves HEAD. Frames are copied between RAM and
+ * the backend in the loop thread, writing TX_TAIL or RX_TAIL wakes
+ * the loop up.
+ */
+#define NIC_ID   (0x4e494331)  /* "NIC1" */
+
+static const uint8_t nic_default_mac[6] = {0x90, 0xad, 0xf7, 0xb9, 0x30, 0x1b};
+
+static uint64_t nic_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* return: host address of [address, address+len) in RAM, or NULL */
+static inline uint8_t *nic_ram(struct nic_register *nic, uint32_t address, uint32_t len)
+{
+    if(address >= MEM_SIZE || len > MEM_SIZE - address)
+        return NULL;
+    return nic->mem->mem + address;
+}
+
+
+static inline struct nic_desc_t *nic_desc(struct nic_register *nic, struct nic_ring *ring, uint32_t idx)
+{
+    return (struct nic_desc_t *)nic_ram(nic, ring->BASE + idx * sizeof(struct nic_desc_t),
+     sizeof(struct nic_desc_t));
+}
+
+
+/*
+ * the cpu thread may rewrite a descriptor while the loop uses it, take
+ * one copy and check and use only the copy
+ */
+static inline void nic_desc_get(struct nic_desc_t *d, const struct nic_desc_t *desc)
+{
+    memcpy(d, desc, sizeof(struct nic_desc_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+
+static void nic_desc_done(struct nic_register *nic, struct nic_ring *ring, struct nic_desc_t *desc,
+ uint16_t flags)
+{
+    __atomic_store_n(&desc->flags, flags | NIC_DESC_DONE, __ATOMIC_RELEASE);
+    memory_set_dirty(nic->mem, (uint8_t *)desc - nic->mem->mem, sizeof(struct nic_desc_t));
+    __atomic_store_n(&ring->HEAD, (ring->HEAD + 1) & (ring->SIZE - 1), __ATOMIC_RELEASE);
+}
+
+
+static void nic_interrupt(struct nic_register *nic, uint32_t isr)
+{
+    __atomic_fetch_or(&nic->ISR, isr, __ATOMIC_RELAXED);
+    if(nic->IER & isr)
+        irq_raise(nic->irq_req, nic->interrupt_id);
+}
+
+
+/*
+ * ones complement checksum from start to the end of frame,
+ * return: 0 done, -1 the checksum field is not inside the frame
+ */
+int nic_checksum(uint8_t *buf, int len, uint16_t start, uint16_t offset)
+{
+    uint32_t sum = 0;
+    uint16_t csum;
+    int i;
+    if(start + offset + 2 > len)
+        return -1;
+    for(i=start; i+1<len; i+=2) {
+        sum += (buf[i] << 8) | buf[i+1];
+    }
+    if(i < len)
+        sum += buf[i] << 8;
+    while(sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    csum = ~sum;
+    buf[start + offset] = csum >> 8;
+    buf[start + offset + 1] = csum & 0xff;
+    return 0;
+}
+
+
+static void nic_ring_reset(struct nic_register *nic)
+{
+    nic->tx.HEAD = nic->tx.TAIL = 0;
+    nic->rx.HEAD = nic->rx.TAIL = 0;
+    nic->rx_pending = 0;
+}
+
+
+/*
+ * from loop thread, send the frames between HEAD and TAIL. A frame is
+ * copied out and sent unlocked, a backend like slirp answers at once
+ * through nic_receive.
+ */
+static void nic_tx_process(struct nic_register *nic)
+{
+    struct nic_ring *tx = &nic->tx;
+    uint32_t sent = 0;
+    pthread_mutex_lock(&nic->lock);
+    while((nic->CTRL & NIC_CTRL_TX_EN) && tx->SIZE &&
+     tx->HEAD != __atomic_load_n(&tx->TAIL, __ATOMIC_ACQUIRE)) {
+        uint32_t head = tx->HEAD;
+        struct nic_desc_t *desc = nic_desc(nic, tx, head);
+        struct nic_desc_t d;
+        uint8_t *buf;
+        int len, r = -1;
+        if(!desc) {
+            ERROR_PRINTF("nic tx ring 0x%x err\n", tx->BASE);
+            nic->CTRL &= ~NIC_CTRL_TX_EN;
+            break;
+        }
+        memory_host_begin(nic->mem);
+        nic_desc_get(&d, desc);
+        uint16_t flags = d.flags & NIC_DESC_CSUM;
+        buf = nic_ram(nic, d.addr, d.len);
+        len = d.len;
+        if(!buf || len > NIC_FRAME_MAX) {
+            nic_desc_done(nic, tx, desc, flags | NIC_DESC_ERROR);
+            memory_host_end(nic->mem);
+            sent++;
+            continue;
+        }
+        memcpy(nic->tx_buf, buf, len);
+        memory_host_end(nic->mem);
+        pthread_mutex_unlock(&nic->lock);
+
+        //tx_buf is only used by this thread
+        if(nic->interface && (flags & NIC_DESC_CSUM) && nic->interface->send_csum) {
+            //the backend leaves the checksum to the host
+            r = nic->interface->send_csum(nic->tx_buf, len, d.csum_start, d.csum_offset);
+        } else if(nic->interface) {
+            if(flags & NIC_DESC_CSUM)
+                nic_checksum(nic->tx_buf, len, d.csum_start, d.csum_offset);
+            r = nic->interface->send(nic->tx_buf, len);
+        }
+
+        pthread_mutex_lock(&nic->lock);
+        if(r == 0)
+            nic->tx_frames++;
+        //the guest may have reset the ring meanwhile
+        if(tx->HEAD != head || !(desc = nic_desc(nic, tx, head)))
+            continue;
+        memory_host_begin(nic->mem);
+        nic_desc_done(nic, tx, desc, flags);
+        memory_host_end(nic->mem);
+        sent++;
+    }
+    pthread_mutex_unlock(&nic->lock);
+    if(sent)
+        nic_interrupt(nic, NIC_INT_TX);
+}
+
+
+/* from loop thread, the guest has free rx descriptors */
+int nic_can_receive(struct nic_register *nic)
+{
+    struct nic_ring *rx = &nic->rx;
+    return (nic->CTRL & NIC_CTRL_RX_EN) && rx->SIZE &&
+     rx->HEAD != __atomic_load_n(&rx->TAIL, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * nic_receive: from loop thread, copy one frame into the next rx buffer,
+ * return: 0 received, -1 dropped
+ */
+int nic_receive(struct nic_register *nic, const uint8_t *buf, int len, uint16_t flags)
+{
+    struct nic_ring *rx = &nic->rx;
+    struct nic_desc_t *desc;
+    struct nic_desc_t d;
+    uint8_t *dst;
+    uint32_t itr_frames, itr_delay;
+
+    pthread_mutex_lock(&nic->lock);
+    if(!nic_can_receive(nic)) {
+        nic->rx_dropped++;
+        pthread_mutex_unlock(&nic->lock);
+        return -1;
+    }
+    desc = nic_desc(nic, rx, rx->HEAD);
+    if(!desc) {
+        ERROR_PRINTF("nic rx ring 0x%x err\n", rx->BASE);
+        nic->CTRL &= ~NIC_CTRL_RX_EN;
+        nic->rx_dropped++;
+        pthread_mutex_unlock(&nic->lock);
+        return -1;
+    }
+    memory_host_begin(nic->mem);
+    nic_desc_get(&d, desc);
+    if(len > d.len) {
+        len = d.len;
+        flags |= NIC_DESC_ERROR;
+    }
+    dst = nic_ram(nic, d.addr, len);
+    if(dst) {
+        memcpy(dst, buf, len);
+        memory_set_dirty(nic->mem, d.addr, len);
+        nic->rx_frames++;
+    } else {
+        len = 0;
+        flags |= NIC_DESC_ERROR;
+    }
+    desc->len = len;
+    nic_desc_done(nic, rx, desc, flags);
+    memory_host_end(nic->mem);
+
+    itr_frames = nic->ITR & 0xffff;
+    itr_delay = nic->ITR >> 16;
+    if(nic->rx_pending++ == 0)
+        nic->rx_first = nic_clock_us();
+    if(nic->rx_pending >= itr_frames || !itr_delay) {
+        nic->rx_pending = 0;
+        nic_interrupt(nic, NIC_INT_RX);
+    }
+    pthread_mutex_unlock(&nic->lock);
+    return 0;
+}
+
+
+static void nic_prepare_callback(void *opaque)
+{
+    struct nic_register *nic = opaque;
+    nic_tx_process(nic);
+
+    pthread_mutex_lock(&nic->lock);
+    if(nic->rx_pending) {
+        uint64_t elapsed = nic_clock_us() - nic->rx_first;
+        uint32_t itr_delay = nic->ITR >> 16;
+        if(elapsed >= itr_delay) {
+            nic->rx_pending = 0;
+            nic_interrupt(nic, NIC_INT_RX);
+        } else {
+            loop_set_timeout(nic->loop, (itr_delay - elapsed + 999) / 1000);
+        }
+    }
+    pthread_mutex_unlock(&nic->lock);
+}
+
+
+static struct loopcb_t loop_nic_cb = {
+    .prepare = nic_prepare_callback,
+    .poll = NULL,
+    .timer = NULL,
+};
+
+
+uint32_t nic_reset(void *base)
+{
+    struct nic_register *nic = base;
+    pthread_mutex_init(&nic->lock, NULL);
+    nic->CTRL = 0;
+    nic->IER = 0;
+    nic->ISR = 0;
+    nic->ITR = 1;
+    memset(&nic->tx, 0, sizeof(nic->tx));
+    memset(&nic->rx, 0, sizeof(nic->rx));
+    nic_ring_reset(nic);
+    memcpy(nic->mac, nic_default_mac, sizeof(nic->mac));
+    nic->interface = NULL;
+    if(nic->interface_register_cb) {
+        if(nic->interface_register_cb(&nic->interface, nic->loop) < 0)
+            return 0;
+        if(!nic->interface->init || !nic->interface->send)
+            return 0;
+        if(!nic->interface->init(nic))
+            return 0;
+    }
+    loop_nic_cb.opaque = nic;
+    loop_register(nic->loop, &loop_nic_cb);
+    DEBUG_PRINTF("nic interrupt id: %d, link %s\n", nic->interrupt_id, nic->interface ? "up" : "down");
+    return 1;
+}
+
+
+void nic_exit(int s, void *base)
+{
+    struct nic_register *nic = base;
+    if(nic->interface && nic->interface->exit)
+        nic->interface->exit();
+}
+
+
+/*
+ * nic_fork_child: give a cloned machine its own backend,
+ * the loop must have been re-initialised before.
+ */
+int nic_fork_child(void *base)
+{
+    struct nic_register *nic = base;
+    if(nic->interface) {
+        if(nic->interface->exit)
+            nic->interface->exit();
+        if(!nic->interface->init(nic))
+            return -1;
+    }
+    loop_register(nic->loop, &loop_nic_cb);
+    return 0;
+}
+
+
+uint32_t nic_read(void *base, uint32_t address)
+{
+    struct nic_register *nic = base;
+    switch(address) {
+    case 0x0:
+        return NIC_ID;
+    case 0x4:
+        return nic->interface ? 1 : 0;
+    case 0x8:
+        return nic->CTRL;
+    case 0xc:
+        return nic->mac[0] | (nic->mac[1] << 8) | (nic->mac[2] << 16) | (nic->mac[3] << 24);
+    case 0x10:
+        return nic->mac[4] | (nic->mac[5] << 8);
+    case 0x14:
+        return nic->IER;
+    case 0x18:
+        return __atomic_load_n(&nic->ISR, __ATOMIC_RELAXED);
+    case 0x1c:
+        return nic->ITR;
+    case 0x20:
+        return nic->tx.BASE;
+    case 0x24:
+        return nic->tx.SIZE;
+    case 0x28:
+        return __atomic_load_n(&nic->tx.HEAD, __ATOMIC_ACQUIRE);
+    case 0x2c:
+        return nic->tx.TAIL;
+    case 0x30:
+        return nic->rx.BASE;
+    case 0x34:
+        return nic->rx.SIZE;
+    case 0x38:
+        return __atomic_load_n(&nic->rx.HEAD, __ATOMIC_ACQUIRE);
+    case 0x3c:
+        return nic->rx.TAIL;
+    case 0x40:
+        return nic->rx_frames;
+    case 0x44:
+        return nic->tx_frames;
+    case 0x48:
+        return nic->rx_dropped;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+static void nic_ring_write(struct nic_register *nic, struct nic_ring *ring, uint32_t address, uint32_t data)
+{
+    switch(address) {
+    case 0x0:
+        ring->BASE = data & ~(sizeof(struct nic_desc_t) - 1);
+        break;
+    case 0x4:
+        if(data & (data - 1)) {
+            ERROR_PRINTF("nic ring size %u is not a power of two\n", data);
+            break;
+        }
+        ring->SIZE = data;
+        break;
+    case 0xc:
+        //doorbell, the stores to the ring are visible before TAIL
+        if(ring->SIZE) {
+            __atomic_store_n(&ring->TAIL, data & (ring->SIZE - 1), __ATOMIC_RELEASE);
+            loop_notify(nic->loop);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+void nic_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct nic_register *nic = base;
+    switch(address) {
+    case 0x8:
+        pthread_mutex_lock(&nic->lock);
+        if(data & NIC_CTRL_RESET) {
+            nic_ring_reset(nic);
+            data = 0;
+        }
+        nic->CTRL = data;
+        pthread_mutex_unlock(&nic->lock);
+        loop_notify(nic->loop);
+        break;
+    case 0x14:
+        nic->IER = data;
+        if(__atomic_load_n(&nic->ISR, __ATOMIC_RELAXED) & data)
+            irq_raise(nic->irq_req, nic->interrupt_id);
+        break;
+    case 0x18:
+        __atomic_fetch_and(&nic->ISR, ~data, __ATOMIC_RELAXED);
+        break;
+    case 0x1c:
+        nic->ITR = data;
+        break;
+    case 0x20:
+    case 0x24:
+    case 0x2c:
+        nic_ring_write(nic, &nic->tx, address - 0x20, data);
+        break;
+    case 0x30:
+    case 0x34:
+    case 0x3c:
+        nic_ring_write(nic, &nic->rx, address - 0x30, data);
+        break;
+    default:
+        break;
+    }
+}
+
+
+void nic_show(struct nic_register *nic)
+{
+    DEBUG_PRINTF("nic link %s, ctrl 0x%x, isr 0x%x, itr 0x%x\n", nic->interface ? "up" : "down",
+     nic->CTRL, nic->ISR, nic->ITR);
+    DEBUG_PRINTF("nic tx ring 0x%08x/%u head %u tail %u, %u frames\n",
+     nic->tx.BASE, nic->tx.SIZE, nic->tx.HEAD, nic->tx.TAIL, nic->tx_frames);
+    DEBUG_PRINTF("nic rx ring 0x%08x/%u head %u tail %u, %u frames, %u dropped\n",
+     nic->rx.BASE, nic->rx.SIZE, nic->rx.HEAD, nic->rx.TAIL, nic->rx_frames, nic->rx_dropped);
+}
+
+/*******************************nic******************************************/
+
+/*******************************blk******************************************/
+/*
+ * Block device over the -r image, requests are served by host threads.
+ *  0x00 ID        read-only, BLK_ID
+ *  0x04 CAPACITY  read-only, image size in 512 byte sectors, low
+ *  0x08 CAPACITY  read-only, high
+ *  0x0c CTRL      BLK_CTRL_*
+ *  0x10 IER       BLK_INT_* enable
+ *  0x14 ISR       BLK_INT_* status, write 1 to clear
+ *  0x20-0x2c      BASE, SIZE, HEAD, TAIL
+ *  0x30-0x40      read-only, reads, writes, flushes, discards, errors
+ * The ring is an array of struct blk_desc_t in RAM. The guest fills
+ * descriptors from TAIL and moves TAIL, the device takes them from
+ * HEAD and hands each request to the I/O pool at once, a request
+ * sets BLK_DESC_DONE on its descriptors when it completes, so the
+ * guest reclaims a descriptor once it is done, not when HEAD passed.
+ * Data moves between the image and RAM with preadv/pwritev, or
+ * through the mapping for an overlay and in a cloned machine.
+ */
+
+#define BLK_ID   (0x424c4b31)  /* "BLK1" */
+
+struct blk_req_t {
+    struct iopool_work_t work;
+    struct blk_register *blk;
+    uint32_t base;          //ring when the request was taken
+    uint32_t size;
+    uint32_t first;         //first descriptor
+    int segs;
+    uint16_t cmd;
+    uint16_t flags;
+    uint64_t offset;        //bytes into the image
+    uint64_t len;
+    struct iovec iov[BLK_SEG_MAX];
+};
+
+
+static inline uint8_t *blk_ram(struct blk_register *blk, uint32_t address, uint32_t len)
+{
+    if(address >= MEM_SIZE || len > MEM_SIZE - address)
+        return NULL;
+    return blk->mem->mem + address;
+}
+
+
+static inline struct blk_desc_t *blk_desc(struct blk_register *blk, uint32_t base, uint32_t idx)
+{
+    return (struct blk_desc_t *)blk_ram(blk, base + idx * sizeof(struct blk_desc_t),
+     sizeof(struct blk_desc_t));
+}
+
+
+/* image size, the -r image in FS_MMAP_MODE may be an overlay or compressed */
+static uint64_t blk_len(struct fs_t *fs)
+{
+#ifdef FS_MMAP_MODE
+    return fs->img.len;
+#else
+    return fs->fp ? fs->len : 0;
+#endif
+}
+
+
+/* image size may not be a sector multiple, the tail sector is readable */
+static uint64_t blk_capacity(struct blk_register *blk)
+{
+    return (blk_len(blk->fs) + (1 << BLK_SECTOR_SHIFT) - 1) >> BLK_SECTOR_SHIFT;
+}
+
+
+/* from pool thread, return: 0 done, -1 error */
+static int blk_rw(struct blk_req_t *req)
+{
+    struct fs_t *fs = req->blk->fs;
+    struct iovec iov[BLK_SEG_MAX];
+    int write = req->cmd == BLK_CMD_WRITE;
+
+    if(req->offset > blk_len(fs) || req->len > blk_len(fs) - req->offset)
+        return -1;
+    //short transfers advance a copy, blk_complete needs the buffers
+    memcpy(iov, req->iov, req->segs * sizeof(struct iovec));
+#ifdef FS_MMAP_MODE
+    return image_rw(&fs->img, iov, req->segs, req->offset, write);
+#else
+    return image_fd_rw(fileno(fs->fp), iov, req->segs, req->offset, write);
+#endif
+}
+
+
+static int blk_discard(struct blk_req_t *req)
+{
+    struct fs_t *fs = req->blk->fs;
+
+    if(req->offset > blk_len(fs) || req->len > blk_len(fs) - req->offset)
+        return -1;
+#ifdef FS_MMAP_MODE
+    return image_discard(&fs->img, req->offset, req->len);
+#else
+    return image_fd_zero(fileno(fs->fp), req->offset, req->len);
+#endif
+}
+
+
+static int blk_flush(struct blk_req_t *req)
+{
+    struct fs_t *fs = req->blk->fs;
+
+    if(!blk_len(fs))
+        return -1;
+#ifdef FS_MMAP_MODE
+    return image_flush(&fs->img);
+#else
+    return image_fd_sync(fileno(fs->fp));
+#endif
+}
+
+
+static void blk_complete(struct blk_req_t *req)
+{
+    struct blk_register *blk = req->blk;
+    for(int i = 0; i < req->segs; i++) {
+        struct blk_desc_t *desc = blk_desc(blk, req->base, (req->first + i) & (req->size - 1));
+        if(!desc)
+            continue;
+        //the buffers taken by blk_fetch, the guest may have rewritten desc since
+        if(req->cmd == BLK_CMD_READ && !(req->flags & BLK_DESC_ERROR))
+            memory_set_dirty(blk->mem, (uint8_t *)req->iov[i].iov_base - blk->mem->mem,
+             req->iov[i].iov_len);
+        __atomic_store_n(&desc->flags, (desc->flags & BLK_DESC_NEXT) | req->flags | BLK_DESC_DONE,
+         __ATOMIC_RELEASE);
+        memory_set_dirty(blk->mem, (uint8_t *)desc - blk->mem->mem, sizeof(struct blk_desc_t));
+    }
+    if(req->flags & BLK_DESC_ERROR)
+        __atomic_fetch_add(&blk->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&blk->ISR, BLK_INT_DONE, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&blk->IER, __ATOMIC_RELAXED) & BLK_INT_DONE)
+        irq_raise(blk->irq_req, blk->interrupt_id);
+    free(req);
+}
+
+
+/* from pool thread */
+static void blk_work(struct iopool_work_t *w)
+{
+    struct blk_req_t *req = (struct blk_req_t *)w;
+    struct blk_register *blk = req->blk;
+    int r = -1;
+    memory_host_begin(blk->mem);
+    switch(req->cmd) {
+    case BLK_CMD_READ:
+        r = blk_rw(req);
+        __atomic_fetch_add(&blk->reads, 1, __ATOMIC_RELAXED);
+        break;
+    case BLK_CMD_WRITE:
+        r = blk_rw(req);
+        __atomic_fetch_add(&blk->writes, 1, __ATOMIC_RELAXED);
+        break;
+    case BLK_CMD_FLUSH:
+        r = blk_flush(req);
+        __atomic_fetch_add(&blk->flushes, 1, __ATOMIC_RELAXED);
+        break;
+    case BLK_CMD_DISCARD:
+        r = blk_discard(req);
+        __atomic_fetch_add(&blk->discards, 1, __ATOMIC_RELAXED);
+        break;
+    default:
+        break;
+    }
+    if(r < 0)
+        req->flags |= BLK_DESC_ERROR;
+    blk_complete(req);
+    memory_host_end(blk->mem);
+}
+
+
+/*
+ * blk_fetch: from cpu thread, turn the descriptors from HEAD to TAIL
+ * into requests, a chain not yet complete waits for the next TAIL.
+ */
+static void blk_fetch(struct blk_register *blk)
+{
+    while((blk->CTRL & BLK_CTRL_EN) && blk->SIZE && blk->HEAD != blk->TAIL) {
+        uint32_t avail = (blk->TAIL - blk->HEAD) & (blk->SIZE - 1);
+        struct blk_req_t *req = malloc(sizeof(struct blk_req_t));
+        struct blk_desc_t *desc;
+        if(!req) {
+            ERROR_PRINTF("blk request alloc err\n");
+            return;
+        }
+        req->work.fn = blk_work;
+        req->blk = blk;
+        req->base = blk->BASE;
+        req->size = blk->SIZE;
+        req->first = blk->HEAD;
+        req->segs = 0;
+        req->flags = 0;
+        req->len = 0;
+        do {
+            desc = blk_desc(blk, blk->BASE, (blk->HEAD + req->segs) & (blk->SIZE - 1));
+            if(!desc) {
+                ERROR_PRINTF("blk ring 0x%x err\n", blk->BASE);
+                blk->CTRL &= ~BLK_CTRL_EN;
+                free(req);
+                return;
+            }
+            if(req->segs == 0) {
+                req->cmd = desc->cmd;
+                req->offset = ((uint64_t)desc->sector_hi << 32 | desc->sector) << BLK_SECTOR_SHIFT;
+            }
+            if(req->segs < BLK_SEG_MAX) {
+                req->iov[req->segs].iov_base = blk_ram(blk, desc->addr, desc->len);
+                req->iov[req->segs].iov_len = desc->len;
+                if(!req->iov[req->segs].iov_base && req->cmd != BLK_CMD_DISCARD)
+                    req->flags |= BLK_DESC_ERROR;
+            } else {
+                req->flags |= BLK_DESC_ERROR;
+            }
+            req->len += desc->len;
+            req->segs++;
+        } while((desc->flags & BLK_DESC_NEXT) && req->segs < avail);
+        if(desc->flags & BLK_DESC_NEXT) {
+            //rest of the chain is not there yet
+            free(req);
+            return;
+        }
+        blk->HEAD = (blk->HEAD + req->segs) & (blk->SIZE - 1);
+        if(!blk->pool.is_run)
+            req->flags |= BLK_DESC_ERROR;
+        if(req->flags & BLK_DESC_ERROR)
+            blk_complete(req);
+        else
+            iopool_submit(&blk->pool, &req->work);
+    }
+}
+
+
+uint32_t blk_reset(void *base)
+{
+    struct blk_register *blk = base;
+    blk->CTRL = 0;
+    blk->IER = 0;
+    blk->ISR = 0;
+    blk->BASE = blk->SIZE = 0;
+    blk->HEAD = blk->TAIL = 0;
+    if(iopool_init(&blk->pool, "blk", BLK_IO_THREADS) < 0)
+        return 0;
+    DEBUG_PRINTF("blk interrupt id: %d, %llu sectors\n", blk->interrupt_id,
+     (unsigned long long)blk_capacity(blk));
+    return 1;
+}
+
+
+void blk_exit(int s, void *base)
+{
+    struct blk_register *blk = base;
+    iopool_exit(&blk->pool);
+}
+
+
+/* the pool threads do not survive fork(), requests were drained by blk_exit */
+int blk_fork_child(void *base)
+{
+    struct blk_register *blk = base;
+    return iopool_init(&blk->pool, "blk", BLK_IO_THREADS);
+}
+
+
+/* from cpu thread, wait for the requests in flight, e.g. before migration */
+void blk_drain(struct blk_register *blk)
+{
+    if(blk->pool.is_run)
+        iopool_drain(&blk->pool);
+}
+
+
+uint32_t blk_read(void *base, uint32_t address)
+{
+    struct blk_register *blk = base;
+    switch(address) {
+    case 0x0:
+        return BLK_ID;
+    case 0x4:
+        return (uint32_t)blk_capacity(blk);
+    case 0x8:
+        return (uint32_t)(blk_capacity(blk) >> 32);
+    case 0xc:
+        return blk->CTRL;
+    case 0x10:
+        return blk->IER;
+    case 0x14:
+        return __atomic_load_n(&blk->ISR, __ATOMIC_RELAXED);
+    case 0x20:
+        return blk->BASE;
+    case 0x24:
+        return blk->SIZE;
+    case 0x28:
+        return blk->HEAD;
+    case 0x2c:
+        return blk->TAIL;
+    case 0x30:
+        return __atomic_load_n(&blk->reads, __ATOMIC_RELAXED);
+    case 0x34:
+        return __atomic_load_n(&blk->writes, __ATOMIC_RELAXED);
+    case 0x38:
+        return __atomic_load_n(&blk->flushes, __ATOMIC_RELAXED);
+    case 0x3c:
+        return __atomic_load_n(&blk->discards, __ATOMIC_RELAXED);
+    case 0x40:
+        return __atomic_load_n(&blk->errors, __ATOMIC_RELAXED);
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void blk_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct blk_register *blk = base;
+    switch(address) {
+    case 0xc:
+        if(data & BLK_CTRL_RESET) {
+            blk_drain(blk);
+            blk->HEAD = blk->TAIL = 0;
+            blk->ISR = 0;
+            data = 0;
+        }
+        blk->CTRL = data;
+        blk_fetch(blk);
+        break;
+    case 0x10:
+        __atomic_store_n(&blk->IER, data, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&blk->ISR, __ATOMIC_RELAXED) & data)
+            irq_raise(blk->irq_req, blk->interrupt_id);
+        break;
+    case 0x14:
+        __atomic_fetch_and(&blk->ISR, ~data, __ATOMIC_RELAXED);
+        break;
+    case 0x20:
+        blk->BASE = data & ~(sizeof(struct blk_desc_t) - 1);
+        break;
+    case 0x24:
+        if(data & (data - 1)) {
+            ERROR_PRINTF("blk ring size %u is not a power of two\n", data);
+            break;
+        }
+        blk->SIZE = data;
+        break;
+    case 0x2c:
+        //doorbell
+        if(blk->SIZE) {
+            blk->TAIL = data & (blk->SIZE - 1);
+            blk_fetch(blk);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+void blk_show(struct blk_register *blk)
+{
+    DEBUG_PRINTF("blk %llu sectors, ctrl 0x%x, isr 0x%x, ring 0x%08x/%u head %u tail %u\n",
+     (unsigned long long)blk_capacity(blk), blk->CTRL, blk->ISR, blk->BASE, blk->SIZE, blk->HEAD, blk->TAIL);
+    DEBUG_PRINTF("blk %u reads, %u writes, %u flushes, %u discards, %u errors\n",
+     blk->reads, blk->writes, blk->flushes, blk->discards, blk->errors);
+#ifdef FS_MMAP_MODE
+    image_show(&blk->fs->img);
+#endif
+}
+
+/*******************************blk******************************************/
+/*******************************dma******************************************/
+/*
+ * Copy engine, descriptor chains are run by the host.
+ *  0x00 ID        read-only, DMA_ID
+ *  0x04 CTRL      write DMA_CTRL_START to run the chain at DESC
+ *  0x08 DESC      first descriptor
+ *  0x0c IER       DMA_INT_* enable
+ *  0x10 ISR       DMA_INT_* status, write 1 to clear
+ *  0x14 CUR       read-only, descriptor run last
+ *  0x20-0x2c      read-only, chains, descriptors, bytes, errors
+ * A chain runs on the cpu thread while CTRL is written, so it is
+ * complete when the store returns and the interrupt follows at once.
+ * Addresses are physical and decoded like accesses of the cpu: RAM
+ * and the romfs window are copied with memmove, other devices are
+ * read and written a word at a time, or a byte when not aligned. A
+ * fixed address is a data register, e.g. a uart fifo, and is accessed
+ * by byte unless the descriptor asks for words.
+ */
+
+#define DMA_ID   (0x444d4131)  /* "DMA1" */
+
+
+static inline struct dma_desc_t *dma_desc(struct dma_register *dma, uint32_t address)
+{
+    if(address & (sizeof(struct dma_desc_t) - 1) ||
+     address >= MEM_SIZE || sizeof(struct dma_desc_t) > MEM_SIZE - address)
+        return NULL;
+    return (struct dma_desc_t *)(dma->mem->mem + address);
+}
+
+
+static struct peripheral_link_t *dma_link(struct dma_register *dma, uint32_t address)
+{
+    struct peripheral_extern_t *bus = dma->bus;
+    for(int i = 0; i < bus->number; i++) {
+        struct peripheral_link_t *l = &bus->link[i];
+        if(l->read && (address & l->mask) == l->prefix)
+            return l;
+    }
+    return NULL;
+}
+
+
+/* host pointer to address, *len is cut to the bytes that follow it */
+static uint8_t *dma_ptr(struct dma_register *dma, struct peripheral_link_t *l, uint32_t address,
+ uint32_t *len, int write)
+{
+    uint32_t off = address - l->prefix;
+    if(l->reg_base == dma->mem) {
+        if(*len > MEM_SIZE - off)
+            *len = MEM_SIZE - off;
+        return dma->mem->mem + off;
+    }
+#ifdef FS_MMAP_MODE
+    if(l->reg_base == dma->fs && off < dma->fs->len) {
+        uint64_t n = IMAGE_BLOCK_SIZE - (off & (IMAGE_BLOCK_SIZE - 1));
+        if(n > dma->fs->len - off)
+            n = dma->fs->len - off;
+        if(*len > n)
+            *len = n;
+        return image_ptr(&dma->fs->img, off, write);
+    }
+#endif
+    return NULL;
+}
+
+
+/* return: 0 done, -1 address not decoded */
+static int dma_copy(struct dma_register *dma, const struct dma_desc_t *desc)
+{
+    uint32_t src = desc->src;
+    uint32_t dst = desc->dst;
+    uint32_t len = desc->len;
+    while(len) {
+        struct peripheral_link_t *ls = dma_link(dma, src);
+        struct peripheral_link_t *ld = dma_link(dma, dst);
+        uint32_t n = len;
+        uint8_t *s = NULL, *d = NULL;
+        if(!ls || !ld)
+            return -1;
+        if(!(desc->flags & DMA_DESC_SRC_FIXED))
+            s = dma_ptr(dma, ls, src, &n, 0);
+        if(!(desc->flags & DMA_DESC_DST_FIXED))
+            d = dma_ptr(dma, ld, dst, &n, 1);
+        if(s && d) {
+            memmove(d, s, n);
+#ifdef FS_MMAP_MODE
+        } else if(d && ls->reg_base == dma->fs && !(desc->flags & DMA_DESC_SRC_FIXED) &&
+         src - ls->prefix < dma->fs->len) {
+            //compressed image, n is cut to the block
+            if(image_read(&dma->fs->img, d, n, src - ls->prefix) < 0)
+                return -1;
+#endif
+        } else {
+            uint8_t mask = ((src | dst) & 3) || len < 4 ? 0 : 3;
+            if((desc->flags & (DMA_DESC_SRC_FIXED | DMA_DESC_DST_FIXED)) && !(desc->flags & DMA_DESC_WORD))
+                mask = 0;
+            uint32_t data = ls->read(ls->reg_base, src - ls->prefix);
+            n = mask + 1;
+            //the cpu hands a byte store over zero extended
+            ld->write(ld->reg_base, dst - ld->prefix, mask ? data : data & 0xff, mask);
+            d = NULL;
+        }
+        if(d && ld->reg_base == dma->mem)
+            memory_set_dirty(dma->mem, dst, n);
+        if(!(desc->flags & DMA_DESC_SRC_FIXED))
+            src += n;
+        if(!(desc->flags & DMA_DESC_DST_FIXED))
+            dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* from cpu thread, run the chain at DESC to its end or to a bad descriptor */
+static void dma_run(struct dma_register *dma)
+{
+    uint32_t address = dma->DESC;
+    uint32_t isr = DMA_INT_DONE;
+    uint32_t count = 0;
+
+    dma->is_busy = 1;
+    dma->chains++;
+    while(address) {
+        struct dma_desc_t *desc = dma_desc(dma, address);
+        struct dma_desc_t d;
+        dma->CUR = address;
+        if(!desc || ++count > DMA_CHAIN_MAX) {
+            ERROR_PRINTF("dma descriptor 0x%x err\n", address);
+            isr |= DMA_INT_ERROR;
+            break;
+        }
+        //the copy may overwrite the descriptor
+        d = *desc;
+        int r = dma->bus ? dma_copy(dma, &d) : -1;
+        desc->flags = (desc->flags & ~DMA_DESC_ERROR) | DMA_DESC_DONE | (r < 0 ? DMA_DESC_ERROR : 0);
+        memory_set_dirty(dma->mem, address, sizeof(struct dma_desc_t));
+        dma->descs++;
+        if(r < 0) {
+            isr |= DMA_INT_ERROR;
+            break;
+        }
+        dma->bytes += d.len;
+        address = d.next;
+    }
+    if(isr & DMA_INT_ERROR)
+        dma->errors++;
+    dma->CTRL &= ~DMA_CTRL_START;
+    dma->is_busy = 0;
+    dma->ISR |= isr;
+    if(dma->IER & isr)
+        irq_raise(dma->irq_req, dma->interrupt_id);
+}
+
+
+uint32_t dma_reset(void *base)
+{
+    struct dma_register *dma = base;
+    dma->is_busy = 0;
+    dma->CTRL = 0;
+    dma->DESC = 0;
+    dma->IER = 0;
+    dma->ISR = 0;
+    dma->CUR = 0;
+    DEBUG_PRINTF("dma interrupt id: %d\n", dma->interrupt_id);
+    return 1;
+}
+
+
+uint32_t dma_read(void *base, uint32_t address)
+{
+    struct dma_register *dma = base;
+    switch(address) {
+    case 0x0:
+        return DMA_ID;
+    case 0x4:
+        return dma->CTRL;
+    case 0x8:
+        return dma->DESC;
+    case 0xc:
+        return dma->IER;
+    case 0x10:
+        return dma->ISR;
+    case 0x14:
+        return dma->CUR;
+    case 0x20:
+        return dma->chains;
+    case 0x24:
+        return dma->descs;
+    case 0x28:
+        return (uint32_t)dma->bytes;
+    case 0x2c:
+        return dma->errors;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void dma_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct dma_register *dma = base;
+    switch(address) {
+    case 0x4:
+        //a chain writing to the engine itself does not start another one
+        if((data & DMA_CTRL_START) && !dma->is_busy) {
+            dma->CTRL = data;
+            dma_run(dma);
+        }
+        break;
+    case 0x8:
+        if(!dma->is_busy)
+            dma->DESC = data;
+        break;
+    case 0xc:
+        dma->IER = data;
+        if(dma->ISR & data)
+            irq_raise(dma->irq_req, dma->interrupt_id);
+        break;
+    case 0x10:
+        dma->ISR &= ~data;
+        break;
+    default:
+        break;
+    }
+}
+
+
+void dma_show(struct dma_register *dma)
+{
+    DEBUG_PRINTF("dma isr 0x%x, desc 0x%08x, cur 0x%08x\n", dma->ISR, dma->DESC, dma->CUR);
+    DEBUG_PRINTF("dma %u chains, %u descriptors, %llu bytes, %u errors\n",
+     dma->chains, dma->descs, (unsigned long long)dma->bytes, dma->errors);
+}
+
+/*******************************dma******************************************/
+/*******************************crypto******************************************/
+/*
+ * Crypto coprocessor, requests are computed by host threads.
+ *  0x00 ID        read-only, CRYPTO_ID
+ *  0x04 CAPS      read-only, bit n set for CRYPTO_OP n
+ *  0x0c CTRL      CRYPTO_CTRL_*
+ *  0x10 IER       CRYPTO_INT_* enable
+ *  0x14 ISR       CRYPTO_INT_* status, write 1 to clear
+ *  0x20-0x2c      BASE, SIZE, HEAD, TAIL
+ *  0x30-0x3c      read-only, ops, bytes, errors, tag mismatches
+ * The ring is an array of struct crypto_desc_t in RAM, it works as the
+ * blk ring: the device takes descriptors from HEAD and hands each one
+ * to the pool at once, a request sets CRYPTO_DESC_DONE when it is
+ * complete. The host computes with AES-NI, PCLMULQDQ and SHA-NI when
+ * it has them, see crypto.c.
+ */
+
+#define CRYPTO_ID     (0x43525931)  /* "CRY1" */
+#define CRYPTO_CAPS   ((1 << (CRYPTO_OP_CRC32 + 1)) - 1)
+
+struct crypto_req_t {
+    struct iopool_work_t work;
+    struct crypto_register *c;
+    uint32_t address;         //descriptor
+    struct crypto_desc_t desc;
+};
+
+
+/* an empty buffer may have any address */
+static inline uint8_t *crypto_ram(struct crypto_register *c, uint32_t address, uint32_t len)
+{
+    if(!len)
+        return c->mem->mem;
+    if(address >= MEM_SIZE || len > MEM_SIZE - address)
+        return NULL;
+    return c->mem->mem + address;
+}
+
+
+/* from pool thread, return: CRYPTO_DESC_* */
+static uint16_t crypto_aes(struct crypto_register *c, struct crypto_desc_t *d,
+ const uint8_t *src, uint8_t *dst)
+{
+    struct aes_key_t k;
+    uint8_t *key = crypto_ram(c, d->key, d->key_len);
+    uint8_t *iv, *aad, *tag;
+    uint32_t iv_len = AES_BLOCK_SIZE;
+    uint16_t flags = 0;
+
+    if(!key || aes_setkey(&k, key, d->key_len) < 0)
+        return CRYPTO_DESC_ERROR;
+    if(d->op == CRYPTO_OP_AES_GCM_ENC || d->op == CRYPTO_OP_AES_GCM_DEC)
+        iv_len = d->iv_len ? d->iv_len : 12;
+    iv = crypto_ram(c, d->iv, iv_len);
+    if(!iv)
+        return CRYPTO_DESC_ERROR;
+    switch(d->op) {
+    case CRYPTO_OP_AES_CBC_ENC:
+    case CRYPTO_OP_AES_CBC_DEC:
+        if(d->len & (AES_BLOCK_SIZE - 1)) {
+            flags = CRYPTO_DESC_ERROR;
+            break;
+        }
+        if(d->op == CRYPTO_OP_AES_CBC_ENC)
+            aes_cbc_encrypt(&k, iv, src, dst, d->len);
+        else
+            aes_cbc_decrypt(&k, iv, src, dst, d->len);
+        memory_set_dirty(c->mem, d->iv, AES_BLOCK_SIZE);
+        break;
+    case CRYPTO_OP_AES_CTR:
+        aes_ctr(&k, iv, src, dst, d->len);
+        memory_set_dirty(c->mem, d->iv, AES_BLOCK_SIZE);
+        break;
+    default:
+        aad = crypto_ram(c, d->aad, d->aad_len);
+        tag = crypto_ram(c, d->tag, GCM_TAG_SIZE);
+        if(!aad || !tag) {
+            flags = CRYPTO_DESC_ERROR;
+            break;
+        }
+        if(aes_gcm(&k, iv, iv_len, aad, d->aad_len, src, dst, d->len, tag,
+         d->op == CRYPTO_OP_AES_GCM_DEC) < 0)
+            flags = CRYPTO_DESC_BADTAG;
+        if(d->op == CRYPTO_OP_AES_GCM_ENC)
+            memory_set_dirty(c->mem, d->tag, GCM_TAG_SIZE);
+        break;
+    }
+    memset(&k, 0, sizeof(k));
+    return flags;
+}
+
+
+static void crypto_complete(struct crypto_req_t *req, uint16_t flags)
+{
+    struct crypto_register *c = req->c;
+    struct crypto_desc_t *desc = (struct crypto_desc_t *)(c->mem->mem + req->address);
+    if(req->desc.op == CRYPTO_OP_CRC32 && !(flags & CRYPTO_DESC_ERROR))
+        desc->crc = req->desc.crc;
+    __atomic_store_n(&desc->flags, flags | CRYPTO_DESC_DONE, __ATOMIC_RELEASE);
+    memory_set_dirty(c->mem, req->address, sizeof(struct crypto_desc_t));
+    if(flags & CRYPTO_DESC_ERROR)
+        __atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+    if(flags & CRYPTO_DESC_BADTAG)
+        __atomic_fetch_add(&c->auth_failures, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&c->ISR, CRYPTO_INT_DONE, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&c->IER, __ATOMIC_RELAXED) & CRYPTO_INT_DONE)
+        irq_raise(c->irq_req, c->interrupt_id);
+    free(req);
+}
+
+
+/* from pool thread */
+static void crypto_work(struct iopool_work_t *w)
+{
+    struct crypto_req_t *req = (struct crypto_req_t *)w;
+    struct crypto_register *c = req->c;
+    struct crypto_desc_t *d = &req->desc;
+    uint8_t *src = crypto_ram(c, d->src, d->len);
+    uint8_t *dst = NULL;
+    uint16_t flags = CRYPTO_DESC_ERROR;
+
+    memory_host_begin(c->mem);
+    switch(d->op) {
+    case CRYPTO_OP_AES_CBC_ENC:
+    case CRYPTO_OP_AES_CBC_DEC:
+    case CRYPTO_OP_AES_CTR:
+    case CRYPTO_OP_AES_GCM_ENC:
+    case CRYPTO_OP_AES_GCM_DEC:
+        dst = crypto_ram(c, d->dst, d->len);
+        if(src && dst) {
+            flags = crypto_aes(c, d, src, dst);
+            memory_set_dirty(c->mem, d->dst, d->len);
+        }
+        break;
+    case CRYPTO_OP_SHA1:
+        dst = crypto_ram(c, d->dst, SHA1_DIGEST_SIZE);
+        if(src && dst) {
+            sha1(src, d->len, dst);
+            memory_set_dirty(c->mem, d->dst, SHA1_DIGEST_SIZE);
+            flags = 0;
+        }
+        break;
+    case CRYPTO_OP_SHA256:
+        dst = crypto_ram(c, d->dst, SHA256_DIGEST_SIZE);
+        if(src && dst) {
+            sha256(src, d->len, dst);
+            memory_set_dirty(c->mem, d->dst, SHA256_DIGEST_SIZE);
+            flags = 0;
+        }
+        break;
+    case CRYPTO_OP_CRC32:
+        if(src) {
+            d->crc = crc32_ieee(d->crc, src, d->len);
+            flags = 0;
+        }
+        break;
+    default:
+        break;
+    }
+    __atomic_fetch_add(&c->ops, 1, __ATOMIC_RELAXED);
+    if(!(flags & CRYPTO_DESC_ERROR))
+        __atomic_fetch_add(&c->bytes, d->len, __ATOMIC_RELAXED);
+    crypto_complete(req, flags);
+    memory_host_end(c->mem);
+}
+
+
+/* from cpu thread, hand the descriptors from HEAD to TAIL to the pool */
+static void crypto_fetch(struct crypto_register *c)
+{
+    while((c->CTRL & CRYPTO_CTRL_EN) && c->SIZE && c->HEAD != c->TAIL) {
+        uint32_t address = c->BASE + c->HEAD * sizeof(struct crypto_desc_t);
+        struct crypto_req_t *req;
+        if(!crypto_ram(c, address, sizeof(struct crypto_desc_t))) {
+            ERROR_PRINTF("crypto ring 0x%x err\n", c->BASE);
+            c->CTRL &= ~CRYPTO_CTRL_EN;
+            return;
+        }
+        req = malloc(sizeof(struct crypto_req_t));
+        if(!req) {
+            ERROR_PRINTF("crypto request alloc err\n");
+            return;
+        }
+        req->work.fn = crypto_work;
+        req->c = c;
+        req->address = address;
+        memcpy(&req->desc, c->mem->mem + address, sizeof(struct crypto_desc_t));
+        c->HEAD = (c->HEAD + 1) & (c->SIZE - 1);
+        if(c->pool.is_run)
+            iopool_submit(&c->pool, &req->work);
+        else
+            crypto_complete(req, CRYPTO_DESC_ERROR);
+    }
+}
+
+
+uint32_t crypto_reset(void *base)
+{
+    struct crypto_register *c = base;
+    c->CTRL = 0;
+    c->IER = 0;
+    c->ISR = 0;
+    c->BASE = c->SIZE = 0;
+    c->HEAD = c->TAIL = 0;
+    if(iopool_init(&c->pool, "crypto", CRYPTO_THREADS) < 0)
+        return 0;
+    DEBUG_PRINTF("crypto interrupt id: %d, host %s\n", c->interrupt_id, crypto_accel());
+    return 1;
+}
+
+
+void crypto_exit(int s, void *base)
+{
+    struct crypto_register *c = base;
+    iopool_exit(&c->pool);
+}
+
+
+/* the pool threads do not survive fork(), requests were drained by crypto_exit */
+int crypto_fork_child(void *base)
+{
+    struct crypto_register *c = base;
+    return iopool_init(&c->pool, "crypto", CRYPTO_THREADS);
+}
+
+
+/* from cpu thread, wait for the requests in flight */
+void crypto_drain(struct crypto_register *c)
+{
+    if(c->pool.is_run)
+        iopool_drain(&c->pool);
+}
+
+
+uint32_t crypto_read(void *base, uint32_t address)
+{
+    struct crypto_register *c = base;
+    switch(address) {
+    case 0x0:
+        return CRYPTO_ID;
+    case 0x4:
+        return CRYPTO_CAPS;
+    case 0xc:
+        return c->CTRL;
+    case 0x10:
+        return c->IER;
+    case 0x14:
+        return __atomic_load_n(&c->ISR, __ATOMIC_RELAXED);
+    case 0x20:
+        return c->BASE;
+    case 0x24:
+        return c->SIZE;
+    case 0x28:
+        return c->HEAD;
+    case 0x2c:
+        return c->TAIL;
+    case 0x30:
+        return __atomic_load_n(&c->ops, __ATOMIC_RELAXED);
+    case 0x34:
+        return (uint32_t)__atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    case 0x38:
+        return __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+    case 0x3c:
+        return __atomic_load_n(&c->auth_failures, __ATOMIC_RELAXED);
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void crypto_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct crypto_register *c = base;
+    switch(address) {
+    case 0xc:
+        if(data & CRYPTO_CTRL_RESET) {
+            crypto_drain(c);
+            c->HEAD = c->TAIL = 0;
+            c->ISR = 0;
+            data = 0;
+        }
+        c->CTRL = data;
+        crypto_fetch(c);
+        break;
+    case 0x10:
+        __atomic_store_n(&c->IER, data, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&c->ISR, __ATOMIC_RELAXED) & data)
+            irq_raise(c->irq_req, c->interrupt_id);
+        break;
+    case 0x14:
+        __atomic_fetch_and(&c->ISR, ~data, __ATOMIC_RELAXED);
+        break;
+    case 0x20:
+        c->BASE = data & ~(sizeof(struct crypto_desc_t) - 1);
+        break;
+    case 0x24:
+        if(data & (data - 1)) {
+            ERROR_PRINTF("crypto ring size %u is not a power of two\n", data);
+            break;
+        }
+        c->SIZE = data;
+        break;
+    case 0x2c:
+        //doorbell
+        if(c->SIZE) {
+            c->TAIL = data & (c->SIZE - 1);
+            crypto_fetch(c);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+void crypto_show(struct crypto_register *c)
+{
+    DEBUG_PRINTF("crypto host %s, ctrl 0x%x, isr 0x%x, ring 0x%08x/%u head %u tail %u\n",
+     crypto_accel(), c->CTRL, c->ISR, c->BASE, c->SIZE, c->HEAD, c->TAIL);
+    DEBUG_PRINTF("crypto %u ops, %llu bytes, %u errors, %u tag mismatches\n",
+     c->ops, (unsigned long long)c->bytes, c->errors, c->auth_failures);
+}
+
+/*******************************crypto******************************************/
+/*******************************rng******************************************/
+/*
+ * Entropy source backed by the host getrandom().
+ *  0x00 ID        read-only, RNG_ID
+ *  0x04 DATA      read-only, a random word on every read
+ *  0x08 CTRL      write RNG_CTRL_FILL to fill LEN bytes at ADDR
+ *  0x0c ADDR      fill address in RAM
+ *  0x10 LEN       fill length in bytes
+ *  0x14 IER       RNG_INT_* enable
+ *  0x18 ISR       RNG_INT_* status, write 1 to clear
+ *  0x20-0x28      read-only, bytes, fills, errors
+ * DATA reads are served from a small pool of host bytes, so a driver
+ * polling one word at a time (Linux timeriomem_rng) costs no system
+ * call per read. A fill runs on the cpu thread while CTRL is written
+ * and completes with an interrupt, like the DMA engine.
+ */
+
+#define RNG_ID   (0x524e4731)  /* "RNG1" */
+
+
+/* return: 0 done, -1 host error */
+static int rng_source(struct rng_register *rng, uint8_t *buf, uint32_t len)
+{
+    while(len) {
+#ifdef USE_GETRANDOM_SUPPORT
+        ssize_t n = getrandom(buf, len, 0);
+#else
+        ssize_t n = read(rng->fd, buf, len);
+#endif
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            ERROR_PRINTF("rng source err\n");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static uint32_t rng_data(struct rng_register *rng)
+{
+    uint32_t data = 0;
+    if(rng->pool_len < sizeof(data)) {
+        if(rng_source(rng, rng->pool, RNG_POOL_SIZE) < 0) {
+            rng->errors++;
+            return 0;
+        }
+        rng->pool_len = RNG_POOL_SIZE;
+    }
+    rng->pool_len -= sizeof(data);
+    memcpy(&data, rng->pool + rng->pool_len, sizeof(data));
+    //a byte is never handed out twice
+    memset(rng->pool + rng->pool_len, 0, sizeof(data));
+    rng->bytes += sizeof(data);
+    return data;
+}
+
+
+static void rng_fill(struct rng_register *rng)
+{
+    uint32_t isr = RNG_INT_DONE;
+    if(rng->ADDR >= MEM_SIZE || rng->LEN > MEM_SIZE - rng->ADDR ||
+     rng_source(rng, rng->mem->mem + rng->ADDR, rng->LEN) < 0) {
+        isr |= RNG_INT_ERROR;
+        rng->errors++;
+    } else {
+        memory_set_dirty(rng->mem, rng->ADDR, rng->LEN);
+        rng->bytes += rng->LEN;
+    }
+    rng->fills++;
+    rng->CTRL &= ~RNG_CTRL_FILL;
+    rng->ISR |= isr;
+    if(rng->IER & isr)
+        irq_raise(rng->irq_req, rng->interrupt_id);
+}
+
+
+uint32_t rng_reset(void *base)
+{
+    struct rng_register *rng = base;
+    rng->CTRL = 0;
+    rng->ADDR = 0;
+    rng->LEN = 0;
+    rng->IER = 0;
+    rng->ISR = 0;
+    rng->pool_len = 0;
+    rng->fd = -1;
+#ifndef USE_GETRANDOM_SUPPORT
+    rng->fd = open("/dev/urandom", O_RDONLY);
+    if(rng->fd < 0) {
+        ERROR_PRINTF("rng open /dev/urandom err\n");
+        return 0;
+    }
+#endif
+    DEBUG_PRINTF("rng interrupt id: %d\n", rng->interrupt_id);
+    return 1;
+}
+
+
+void rng_exit(int s, void *base)
+{
+    struct rng_register *rng = base;
+    if(rng->fd >= 0) {
+        close(rng->fd);
+        rng->fd = -1;
+    }
+}
+
+
+/* clones must not hand out the bytes pooled by the template */
+int rng_fork_child(void *base)
+{
+    struct rng_register *rng = base;
+    memset(rng->pool, 0, sizeof(rng->pool));
+    rng->pool_len = 0;
+    return 0;
+}
+
+
+uint32_t rng_read(void *base, uint32_t address)
+{
+    struct rng_register *rng = base;
+    switch(address) {
+    case 0x0:
+        return RNG_ID;
+    case 0x4:
+        return rng_data(rng);
+    case 0x8:
+        return rng->CTRL;
+    case 0xc:
+        return rng->ADDR;
+    case 0x10:
+        return rng->LEN;
+    case 0x14:
+        return rng->IER;
+    case 0x18:
+        return rng->ISR;
+    case 0x20:
+        return (uint32_t)rng->bytes;
+    case 0x24:
+        return rng->fills;
+    case 0x28:
+        return rng->errors;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void rng_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct rng_register *rng = base;
+    switch(address) {
+    case 0x8:
+        rng->CTRL = data;
+        if(data & RNG_CTRL_FILL)
+            rng_fill(rng);
+        break;
+    case 0xc:
+        rng->ADDR = data;
+        break;
+    case 0x10:
+        rng->LEN = data;
+        break;
+    case 0x14:
+        rng->IER = data;
+        if(rng->ISR & data)
+            irq_raise(rng->irq_req, rng->interrupt_id);
+        break;
+    case 0x18:
+        rng->ISR &= ~data;
+        break;
+    default:
+        break;
+    }
+}
+
+
+void rng_show(struct rng_register *rng)
+{
+    DEBUG_PRINTF("rng isr 0x%x, %llu bytes, %u fills, %u errors\n",
+     rng->ISR, (unsigned long long)rng->bytes, rng->fills, rng->errors);
+}
+
+/*******************************rng******************************************/
+/*******************************share******************************************/
+/*
+ * Host directory shared over 9P2000.L, served by a host thread.
+ *  0x00 ID        read-only, SHARE_ID
+ *  0x04 MSIZE     read-only, largest 9P message, see P9_MSIZE_MAX
+ *  0x0c CTRL      SHARE_CTRL_*
+ *  0x10 IER       SHARE_INT_* enable
+ *  0x14 ISR       SHARE_INT_* status, write 1 to clear
+ *  0x20-0x2c      BASE, SIZE, HEAD, TAIL
+ *  0x30-0x34      read-only, requests, errors
+ * The ring is an array of struct share_desc_t in RAM and works as the
+ * blk ring. A descriptor points to a T-message and to a buffer for the
+ * R-message, Tread data goes from the host file straight into that
+ * buffer and Twrite data straight from the T-message to the file. The
+ * protocol is served by p9.c, by a single pool thread so that requests
+ * complete in ring order.
+ */
+
+#define SHARE_ID   (0x39505331)  /* "9PS1" */
+
+struct share_req_t {
+    struct iopool_work_t work;
+    struct share_register *share;
+    uint32_t address;         //descriptor
+    struct share_desc_t desc;
+};
+
+
+static inline uint8_t *share_ram(struct share_register *share, uint32_t address, uint32_t len)
+{
+    if(!len || address >= MEM_SIZE || len > MEM_SIZE - address)
+        return NULL;
+    return share->mem->mem + address;
+}
+
+
+static void share_complete(struct share_req_t *req, uint16_t flags, uint32_t resp_len)
+{
+    struct share_register *share = req->share;
+    struct share_desc_t *desc = (struct share_desc_t *)(share->mem->mem + req->address);
+    if(!(flags & SHARE_DESC_ERROR))
+        desc->resp_len = resp_len;
+    __atomic_store_n(&desc->flags, flags | SHARE_DESC_DONE, __ATOMIC_RELEASE);
+    memory_set_dirty(share->mem, req->address, sizeof(struct share_desc_t));
+    __atomic_fetch_add(&share->requests, 1, __ATOMIC_RELAXED);
+    if(flags & SHARE_DESC_ERROR)
+        __atomic_fetch_add(&share->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&share->ISR, SHARE_INT_DONE, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&share->IER, __ATOMIC_RELAXED) & SHARE_INT_DONE)
+        irq_raise(share->irq_req, share->interrupt_id);
+    free(req);
+}
+
+
+/* from pool thread */
+static void share_work(struct iopool_work_t *w)
+{
+    struct share_req_t *req = (struct share_req_t *)w;
+    struct share_register *share = req->share;
+    struct share_desc_t *d = &req->desc;
+    uint8_t *tmsg = share_ram(share, d->req, d->req_len);
+    uint8_t *rmsg = share_ram(share, d->resp, d->resp_len);
+    int len = -1;
+
+    memory_host_begin(share->mem);
+    if(tmsg && rmsg)
+        len = p9_request(&share->p9, tmsg, d->req_len, rmsg, d->resp_len);
+    if(len < 0) {
+        share_complete(req, SHARE_DESC_ERROR, 0);
+    } else {
+        memory_set_dirty(share->mem, d->resp, len);
+        share_complete(req, 0, len);
+    }
+    memory_host_end(share->mem);
+}
+
+
+/* from cpu thread, hand the descriptors from HEAD to TAIL to the pool */
+static void share_fetch(struct share_register *share)
+{
+    while((share->CTRL & SHARE_CTRL_EN) && share->SIZE && share->HEAD != share->TAIL) {
+        uint32_t address = share->BASE + share->HEAD * sizeof(struct share_desc_t);
+        struct share_req_t *req;
+        if(!share_ram(share, address, sizeof(struct share_desc_t))) {
+            ERROR_PRINTF("share ring 0x%x err\n", share->BASE);
+            share->CTRL &= ~SHARE_CTRL_EN;
+            return;
+        }
+        req = malloc(sizeof(struct share_req_t));
+        if(!req) {
+            ERROR_PRINTF("share request alloc err\n");
+            return;
+        }
+        req->work.fn = share_work;
+        req->share = share;
+        req->address = address;
+        memcpy(&req->desc, share->mem->mem + address, sizeof(struct share_desc_t));
+        share->HEAD = (share->HEAD + 1) & (share->SIZE - 1);
+        if(share->pool.is_run)
+            iopool_submit(&share->pool, &req->work);
+        else
+            share_complete(req, SHARE_DESC_ERROR, 0);
+    }
+}
+
+
+uint32_t share_reset(void *base)
+{
+    struct share_register *share = base;
+    share->CTRL = 0;
+    share->IER = 0;
+    share->ISR = 0;
+    share->BASE = share->SIZE = 0;
+    share->HEAD = share->TAIL = 0;
+    if(!share->root)
+        return 0;
+    if(p9_open(&share->p9, share->root) < 0)
+        return 0;
+    if(iopool_init(&share->pool, "share", SHARE_THREADS) < 0) {
+        p9_close(&share->p9);
+        return 0;
+    }
+    DEBUG_PRINTF("share interrupt id: %d, %s\n", share->interrupt_id, share->root);
+    return 1;
+}
+
+
+/* open fids stay, a clone goes on with them */
+void share_exit(int s, void *base)
+{
+    struct share_register *share = base;
+    iopool_exit(&share->pool);
+}
+
+
+/* the pool thread does not survive fork(), requests were drained by share_exit */
+int share_fork_child(void *base)
+{
+    struct share_register *share = base;
+    if(!share->p9.root)
+        return 0;
+    return iopool_init(&share->pool, "share", SHARE_THREADS);
+}
+
+
+/* from cpu thread, wait for the requests in flight */
+void share_drain(struct share_register *share)
+{
+    if(share->pool.is_run)
+        iopool_drain(&share->pool);
+}
+
+
+uint32_t share_read(void *base, uint32_t address)
+{
+    struct share_register *share = base;
+    switch(address) {
+    case 0x0:
+        return SHARE_ID;
+    case 0x4:
+        return P9_MSIZE_MAX;
+    case 0xc:
+        return share->CTRL;
+    case 0x10:
+        return share->IER;
+    case 0x14:
+        return __atomic_load_n(&share->ISR, __ATOMIC_RELAXED);
+    case 0x20:
+        return share->BASE;
+    case 0x24:
+        return share->SIZE;
+    case 0x28:
+        return share->HEAD;
+    case 0x2c:
+        return share->TAIL;
+    case 0x30:
+        return __atomic_load_n(&share->requests, __ATOMIC_RELAXED);
+    case 0x34:
+        return __atomic_load_n(&share->errors, __ATOMIC_RELAXED);
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void share_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct share_register *share = base;
+    switch(address) {
+    case 0xc:
+        if(data & SHARE_CTRL_RESET) {
+            share_drain(share);
+            //the pool thread is idle
+            p9_reset(&share->p9);
+            share->HEAD = share->TAIL = 0;
+            share->ISR = 0;
+            data = 0;
+        }
+        share->CTRL = data;
+        share_fetch(share);
+        break;
+    case 0x10:
+        __atomic_store_n(&share->IER, data, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&share->ISR, __ATOMIC_RELAXED) & data)
+            irq_raise(share->irq_req, share->interrupt_id);
+        break;
+    case 0x14:
+        __atomic_fetch_and(&share->ISR, ~data, __ATOMIC_RELAXED);
+        break;
+    case 0x20:
+        share->BASE = data & ~(sizeof(struct share_desc_t) - 1);
+        break;
+    case 0x24:
+        if(data & (data - 1)) {
+            ERROR_PRINTF("share ring size %u is not a power of two\n", data);
+            break;
+        }
+        share->SIZE = data;
+        break;
+    case 0x2c:
+        //doorbell
+        if(share->SIZE) {
+            share->TAIL = data & (share->SIZE - 1);
+            share_fetch(share);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+void share_show(struct share_register *share)
+{
+    DEBUG_PRINTF("share %s, ctrl 0x%x, isr 0x%x, ring 0x%08x/%u head %u tail %u\n",
+     share->p9.root ? share->p9.root : "none", share->CTRL, share->ISR,
+     share->BASE, share->SIZE, share->HEAD, share->TAIL);
+    DEBUG_PRINTF("share %u requests, %u errors, %u fids, %llu bytes read, %llu bytes written, %u 9P errors\n",
+     share->requests, share->errors, share->p9.fid_count,
+     (unsigned long long)share->p9.bytes_read, (unsigned long long)share->p9.bytes_written,
+     share->p9.errors);
+}
+
+/*******************************share******************************************/
+/*******************************power******************************************/
+/*
+ * Power off device, ends the run with a status for the host.
+ *  0x00 ID        read-only, POWER_ID
+ *  0x04 EXIT      write the exit status of the emulator, low 8 bits
+ * A bare-metal test writes its result to EXIT instead of printing it
+ * for a script to scrape, Linux powers off through syscon-poweroff.
+ */
+
+#define POWER_ID   (0x50575231)  /* "PWR1" */
+
+
+uint32_t power_reset(void *base)
+{
+    struct power_register *power = base;
+    if(!power->poweroff_cb)
+        return 0;
+    return 1;
+}
+
+
+uint32_t power_read(void *base, uint32_t address)
+{
+    switch(address) {
+    case 0x0:
+        return POWER_ID;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+void power_write(void *base, uint32_t address, uint32_t data, uint8_t mask)
+{
+    struct power_register *power = base;
+    switch(address) {
+    case 0x4:
+        power->poweroff_cb(data & 0xff);
+        break;
+    default:
+        break;
+    }
+}
+
+/*******************************power******************************************/
 /*****************************END OF FILE***************************/
@@ -26,20 +26,28 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <config.h>
+#include <iopool.h>
+#include <image.h>
+#include <p9.h>
 
 
 #ifndef MEM_SIZE
 #define MEM_SIZE   (1 << 25)  //32M
 #endif
 
+#define MEM_PAGE_SHIFT   (12)
+#define MEM_PAGE_SIZE    (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_NUMBER  (MEM_SIZE >> MEM_PAGE_SHIFT)
+
 #define UART_NUMBER    (2)
 
 
-#ifdef FS_MMAP_MODE
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#endif
+
+struct loop_t;
+struct peripheral_extern_t;
 
 /* return: 0 false ,1 true */
 struct charwr_interface {
@@ -49,17 +57,65 @@ struct charwr_interface {
     uint8_t ( *read)(void);
     uint8_t ( *writeable)(void);
     uint8_t ( *write)(uint8_t ch);
+    /* optional burst access, return: bytes moved, NULL falls back to read/write */
+    uint32_t ( *read_buf)(uint8_t *buf, uint32_t len);
+    uint32_t ( *write_buf)(const uint8_t *buf, uint32_t len);
+};
+
+/*
+ * packet backend of the nic, callbacks run in the nic->loop thread,
+ * frames are ethernet frames without FCS
+ */
+struct nic_register;
+struct netdev_interface {
+    uint8_t ( *init)(struct nic_register *nic);
+    void ( *exit)(void);
+    //guest to host, return: 0 sent, -1 dropped
+    int ( *send)(const uint8_t *buf, int len);
+    /* optional, the host fills the checksum from csum_start at csum_start + csum_offset,
+     * NULL makes the nic fill it before send */
+    int ( *send_csum)(const uint8_t *buf, int len, uint16_t csum_start, uint16_t csum_offset);
+};
+
+/*
+ * First page of a shared RAM file, RAM follows at header_size.
+ * Tools may map the file read-only while the machine runs.
+ */
+#define MEM_SHM_MAGIC     (0x52524d41)  /* "AMRR" */
+#define MEM_SHM_VERSION   (1)
+struct memory_shm_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t page_size;
+    uint32_t ram_base;       //guest physical address of RAM
+    uint32_t ram_size;
+    uint32_t pid;
+    uint32_t reserved;
+    uint32_t cp15[16];       //cp15[1] control, cp15[2] TTB, cp15[3] domain
 };
 
 struct peripheral_t {
-    uint8_t *mem;
+    struct memory_t {
+        //predefined start
+        char *shm_name;
+        //predefined end
+        uint8_t *mem;
+        int shm_fd;
+        uint8_t shm_private;
+        struct memory_shm_header_t *shm;
+        //dirty page bitmap, valid while dirty_log is set
+        uint8_t dirty_log;
+        uint32_t dirty[MEM_PAGE_NUMBER / 32];
+        //held shared by threads other than the cpu while they write RAM
+        pthread_rwlock_t host_lock;
+    }mem;
 
     struct fs_t {
         char *filename;
+        uint64_t len;
 #ifdef FS_MMAP_MODE
-        int fd;
-        uint8_t *map;
-        uint32_t len;
+        struct image_t img;  //raw image or overlay
 #else
         FILE *fp;
 #endif
@@ -70,6 +126,9 @@ struct peripheral_t {
         uint32_t PND; //Indicate the interrupt request status
     }intc;
 
+    //interrupt requests of devices, latched until taken by the intc
+    uint32_t irq_req;
+
     struct timer_register {
         //predefined start
         uint8_t is_run;
@@ -85,8 +144,9 @@ struct peripheral_t {
 
     struct uart_register {
         //predefined start
-        int ( *interface_register_cb)(const struct charwr_interface **interface);
+        int ( *interface_register_cb)(const struct charwr_interface **interface, struct loop_t *lo);
         uint32_t interrupt_id;
+        struct loop_t *loop; //thread of the backend
         //predefined end
         const struct charwr_interface *interface;
 
@@ -104,7 +164,13 @@ struct peripheral_t {
 #define UART_IIR_THRI       0x02 /* Transmitter holding register empty */
 #define UART_IIR_RDI        0x04 /* Receiver data interrupt */
 #define UART_IIR_RLSI       0x06 /* Receiver line status interrupt */
+#define UART_IIR_RX_TIMEOUT 0x0c /* Receiver data timeout interrupt */
+#define UART_IIR_FIFO_ENABLED 0xc0 /* 16550 fifos enabled */
         uint32_t FCR; //FIFO Control Register
+#define UART_FCR_ENABLE_FIFO  0x01 /* Enable the FIFO */
+#define UART_FCR_CLEAR_RCVR   0x02 /* Clear the RCVR FIFO */
+#define UART_FCR_CLEAR_XMIT   0x04 /* Clear the XMIT FIFO */
+#define UART_FCR_TRIGGER_MASK 0xC0 /* Mask for the FIFO trigger range */
         uint32_t LCR; //Line Control Register, 3
 #define UART_LCR_DLAB       0x80 /* Divisor latch access bit */
 #define UART_LCR_SBC        0x40 /* Set break control */
@@ -147,18 +213,342 @@ struct peripheral_t {
 #define UART_MSR_ANY_DELTA  0x0F /* Any of the delta bits! */
         uint32_t SCR;
         uint32_t RBR;
+
+        /* 16550 fifos, from cpu thread, 16, 64 or 256 bytes */
+#define UART_FIFO_SIZE      (16)
+        uint8_t rx_fifo[UART_FIFO_SIZE];
+        uint8_t tx_fifo[UART_FIFO_SIZE];
+        uint32_t rx_head;
+        uint32_t rx_count;
+        uint32_t tx_count;
+        uint32_t rx_idle;       //user_event calls since rx fifo last changed
+        uint32_t poll_cnt;
+        uint8_t thre_pending;   //tx fifo ran empty, not acknowledged yet
     }uart[UART_NUMBER];
+
+    struct balloon_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        //predefined end
+
+        uint32_t TARGET; //pages the host asks the guest to give up
+        uint32_t ACTUAL; //pages the guest has given up
+        uint32_t ADDR;   //free page report address
+        uint32_t ISR;
+#define BALLOON_ISR_TARGET  0x01 /* TARGET changed */
+        uint32_t discarded;
+    }balloon;
+
+    struct nic_register {
+        //predefined start
+        int ( *interface_register_cb)(const struct netdev_interface **interface, struct loop_t *lo);
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        struct loop_t *loop; //thread of the backend
+        //predefined end
+        const struct netdev_interface *interface;
+        pthread_mutex_t lock;
+
+        uint32_t CTRL;
+#define NIC_CTRL_RX_EN      0x01 /* Receive enable */
+#define NIC_CTRL_TX_EN      0x02 /* Transmit enable */
+#define NIC_CTRL_RESET      0x80 /* Reset rings and moderation state */
+        uint32_t IER; //Interrupt Enable Register
+        uint32_t ISR; //Interrupt Status Register, write 1 to clear
+#define NIC_INT_RX          0x01 /* Frames received */
+#define NIC_INT_TX          0x02 /* Frames sent */
+        uint32_t ITR; //Interrupt moderation, [31:16] delay in us, [15:0] frames
+        struct nic_ring {
+            uint32_t BASE; //descriptor ring address, 16 byte aligned
+            uint32_t SIZE; //descriptors, power of two
+            uint32_t HEAD; //next descriptor of the device
+            uint32_t TAIL; //first descriptor not given to the device
+        }tx, rx;
+        uint8_t mac[6];
+
+        uint32_t rx_pending; //frames since the last rx interrupt
+        uint64_t rx_first;   //time of the first pending frame, us
+        uint32_t rx_frames;
+        uint32_t tx_frames;
+        uint32_t rx_dropped;
+#define NIC_FRAME_MAX       (2048)
+        uint8_t tx_buf[NIC_FRAME_MAX];
+    }nic;
+
+    struct blk_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        struct fs_t *fs;
+        //predefined end
+        struct iopool_t pool;
+
+        uint32_t CTRL;
+#define BLK_CTRL_EN         0x01 /* Fetch requests */
+#define BLK_CTRL_RESET      0x80 /* Wait for requests in flight, reset the ring */
+        uint32_t IER; //Interrupt Enable Register
+        uint32_t ISR; //Interrupt Status Register, write 1 to clear
+#define BLK_INT_DONE        0x01 /* Requests completed */
+        uint32_t BASE; //descriptor ring address, 32 byte aligned
+        uint32_t SIZE; //descriptors, power of two
+        uint32_t HEAD; //next descriptor of the device
+        uint32_t TAIL; //first descriptor not given to the device
+
+        uint32_t reads;
+        uint32_t writes;
+        uint32_t flushes;
+        uint32_t discards;
+        uint32_t errors;
+    }blk;
+
+    struct dma_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        struct fs_t *fs;
+        struct peripheral_extern_t *bus; //address decoding of the cpu
+        //predefined end
+        uint8_t is_busy;
+
+        uint32_t CTRL;
+#define DMA_CTRL_START      0x01 /* Run the chain at DESC, cleared when done */
+        uint32_t DESC; //first descriptor address, 32 byte aligned
+        uint32_t IER;  //Interrupt Enable Register
+        uint32_t ISR;  //Interrupt Status Register, write 1 to clear
+#define DMA_INT_DONE        0x01 /* Chain completed */
+#define DMA_INT_ERROR       0x02 /* Chain stopped at a bad descriptor */
+        uint32_t CUR;  //descriptor run last
+
+        uint32_t chains;
+        uint32_t descs;
+        uint64_t bytes;
+        uint32_t errors;
+    }dma;
+
+    struct crypto_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        //predefined end
+        struct iopool_t pool;
+
+        uint32_t CTRL;
+#define CRYPTO_CTRL_EN      0x01 /* Fetch requests */
+#define CRYPTO_CTRL_RESET   0x80 /* Wait for requests in flight, reset the ring */
+        uint32_t IER; //Interrupt Enable Register
+        uint32_t ISR; //Interrupt Status Register, write 1 to clear
+#define CRYPTO_INT_DONE     0x01 /* Requests completed */
+        uint32_t BASE; //descriptor ring address, 64 byte aligned
+        uint32_t SIZE; //descriptors, power of two
+        uint32_t HEAD; //next descriptor of the device
+        uint32_t TAIL; //first descriptor not given to the device
+
+        uint32_t ops;
+        uint64_t bytes;
+        uint32_t errors;
+        uint32_t auth_failures;
+    }crypto;
+
+    struct rng_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        //predefined end
+        int fd;             //random source without getrandom()
+#define RNG_POOL_SIZE       (256)
+        uint8_t pool[RNG_POOL_SIZE]; //host random bytes for DATA reads
+        uint32_t pool_len;  //bytes left, taken from the end
+
+        uint32_t CTRL;
+#define RNG_CTRL_FILL       0x01 /* Fill LEN bytes at ADDR, cleared when done */
+        uint32_t ADDR;
+        uint32_t LEN;
+        uint32_t IER; //Interrupt Enable Register
+        uint32_t ISR; //Interrupt Status Register, write 1 to clear
+#define RNG_INT_DONE        0x01 /* Fill completed */
+#define RNG_INT_ERROR       0x02 /* Fill out of RAM or host error */
+
+        uint64_t bytes;
+        uint32_t fills;
+        uint32_t errors;
+    }rng;
+
+    struct share_register {
+        //predefined start
+        uint32_t interrupt_id;
+        uint32_t *irq_req;
+        struct memory_t *mem;
+        const char *root;   //shared host directory
+        //predefined end
+        struct iopool_t pool;
+        struct p9_t p9;     //used by the pool thread only, while it runs
+
+        uint32_t CTRL;
+#define SHARE_CTRL_EN       0x01 /* Fetch requests */
+#define SHARE_CTRL_RESET    0x80 /* Wait for requests in flight, reset the ring, clunk all fids */
+        uint32_t IER; //Interrupt Enable Register
+        uint32_t ISR; //Interrupt Status Register, write 1 to clear
+#define SHARE_INT_DONE      0x01 /* Requests completed */
+        uint32_t BASE; //descriptor ring address, 32 byte aligned
+        uint32_t SIZE; //descriptors, power of two
+        uint32_t HEAD; //next descriptor of the device
+        uint32_t TAIL; //first descriptor not given to the device
+
+        uint32_t requests;
+        uint32_t errors;
+    }share;
+
+    struct power_register {
+        //predefined start
+        void (*poweroff_cb)(int status); //from cpu thread, ends the run
+        //predefined end
+    }power;
+};
+
+/* nic descriptor in guest RAM, little endian */
+struct nic_desc_t {
+    uint32_t addr;        //buffer address
+    uint16_t len;         //buffer length, rx: frame length on completion
+    uint16_t flags;
+#define NIC_DESC_DONE       0x0001 /* Completed by the device */
+#define NIC_DESC_CSUM       0x0002 /* tx: fill checksum of csum_start, at csum_start + csum_offset */
+#define NIC_DESC_CSUM_VALID 0x0004 /* rx: checksums are known to be good */
+#define NIC_DESC_ERROR      0x0008 /* rx: frame truncated, tx: bad buffer */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint32_t reserved;
+};
+
+/*
+ * block request descriptor in guest RAM, little endian, a request is
+ * one descriptor or a chain linked by BLK_DESC_NEXT, sector and cmd
+ * are taken from the first one, completion order is not guaranteed
+ */
+struct blk_desc_t {
+    uint32_t addr;        //buffer address
+    uint32_t len;         //buffer length in bytes, discard: bytes to discard
+    uint32_t sector;      //512 byte sector, low
+    uint32_t sector_hi;   //512 byte sector, high
+    uint16_t cmd;
+#define BLK_CMD_READ        0
+#define BLK_CMD_WRITE       1
+#define BLK_CMD_FLUSH       2 /* writes completed before are on disk */
+#define BLK_CMD_DISCARD     3 /* range reads as zero afterwards */
+    uint16_t flags;
+#define BLK_DESC_DONE       0x0001 /* Completed by the device */
+#define BLK_DESC_NEXT       0x0002 /* Buffer continues in the next descriptor */
+#define BLK_DESC_ERROR      0x0008 /* Bad request, buffer or host I/O error */
+    uint32_t reserved[3];
+};
+
+#define BLK_SECTOR_SHIFT    (9)
+#define BLK_SEG_MAX         (32)
+#define BLK_IO_THREADS      (4)
+
+/*
+ * dma descriptor in guest RAM, little endian, physical addresses,
+ * a chain is linked by next and ends at next == 0
+ */
+struct dma_desc_t {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t len;         //bytes
+    uint32_t next;        //next descriptor, 32 byte aligned, 0 ends the chain
+    uint32_t flags;
+#define DMA_DESC_DONE       0x0001 /* Completed by the device */
+#define DMA_DESC_ERROR      0x0008 /* Bad descriptor or address, the chain stops */
+#define DMA_DESC_SRC_FIXED  0x0010 /* src is a device register, not incremented */
+#define DMA_DESC_DST_FIXED  0x0020 /* dst is a device register, not incremented */
+#define DMA_DESC_WORD       0x0040 /* fixed registers are accessed by word, not by byte */
+    uint32_t reserved[3];
+};
+
+#define DMA_CHAIN_MAX       (65536) /* descriptors per start, stops a looped chain */
+
+/*
+ * crypto request descriptor in guest RAM, little endian, one request
+ * per descriptor, completion order is not guaranteed
+ */
+struct crypto_desc_t {
+    uint32_t src;         //input
+    uint32_t dst;         //output, hash: digest
+    uint32_t len;         //input bytes, AES-CBC: multiple of 16
+    uint32_t key;         //AES key
+    uint32_t iv;          //CBC: 16 byte iv, CTR: 16 byte counter, both updated, GCM: nonce
+    uint32_t aad;         //GCM additional data
+    uint32_t aad_len;
+    uint32_t tag;         //GCM 16 byte tag, written by encrypt, checked by decrypt
+    uint16_t op;
+#define CRYPTO_OP_AES_CBC_ENC   0
+#define CRYPTO_OP_AES_CBC_DEC   1
+#define CRYPTO_OP_AES_CTR       2
+#define CRYPTO_OP_AES_GCM_ENC   3
+#define CRYPTO_OP_AES_GCM_DEC   4
+#define CRYPTO_OP_SHA1          5
+#define CRYPTO_OP_SHA256        6
+#define CRYPTO_OP_CRC32         7
+    uint16_t flags;
+#define CRYPTO_DESC_DONE    0x0001 /* Completed by the device */
+#define CRYPTO_DESC_ERROR   0x0008 /* Bad op, key length or buffer */
+#define CRYPTO_DESC_BADTAG  0x0010 /* GCM tag mismatch, dst is cleared */
+    uint8_t key_len;      //16, 24 or 32
+    uint8_t iv_len;       //GCM nonce bytes, 0 for 12
+    uint16_t reserved0;
+    uint32_t crc;         //CRC32: initial value, result on completion
+    uint32_t reserved[5];
 };
 
+#define CRYPTO_THREADS      (2)
+
+/*
+ * share request descriptor in guest RAM, little endian, one 9P
+ * T-message per descriptor, requests complete in ring order
+ */
+struct share_desc_t {
+    uint32_t req;         //T-message
+    uint32_t req_len;     //buffer length, the message is its size[4] field
+    uint32_t resp;        //R-message buffer
+    uint32_t resp_len;    //buffer length, R-message length on completion
+    uint16_t flags;
+#define SHARE_DESC_DONE     0x0001 /* Completed by the device */
+#define SHARE_DESC_ERROR    0x0008 /* Bad buffer or message header, no R-message */
+    uint16_t reserved0;
+    uint32_t reserved[3];
+};
+
+/* one thread, 9P state is not shared */
+#define SHARE_THREADS       (1)
+
+static inline void irq_raise(uint32_t *irq_req, uint32_t id)
+{
+    __atomic_fetch_or(irq_req, 1U << id, __ATOMIC_RELEASE);
+}
+
 #define  register_set(r,b,v)  do{ if(v) {r |= 1 << (b);} else {r &= ~(1 << (b));} }while(0)
 
 void memory_exit(int s, void *base);
 uint32_t memory_reset(void *base);
 uint32_t memory_read(void *base, uint32_t address);
 void memory_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void memory_dirty_log(struct memory_t *m, uint8_t enable);
+void memory_set_dirty(struct memory_t *m, uint32_t address, uint32_t len);
+int memory_get_dirty(struct memory_t *m, uint32_t page);
+void memory_discard(struct memory_t *m, uint32_t address, uint32_t len);
+void memory_host_begin(struct memory_t *m);
+void memory_host_end(struct memory_t *m);
+int memory_host_trylock(struct memory_t *m);
+int memory_fork_child(void *base);
 
 void fs_exit(int s, void *base);
 uint32_t fs_reset(void *base);
+int fs_fork_child(void *base);
 uint32_t fs_read(void *base, uint32_t address);
 void fs_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
 
@@ -171,17 +561,76 @@ uint32_t user_event(struct peripheral_t *base, uint8_t type);
 
 void tim_exit(int s, void *base);
 uint32_t tim_reset(void *base);
+int tim_fork_child(void *base);
 uint32_t tim_read(void *base, uint32_t address);
 void tim_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
 
 void uart_8250_exit(int s, void *base);
+int uart_8250_fork_child(void *base);
 void uart_8250_register(struct uart_register *uart, const struct charwr_interface *interface);
 uint32_t uart_8250_reset(void *base);
 uint32_t uart_8250_read(void *base, uint32_t address);
 void uart_8250_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
 
+uint32_t balloon_reset(void *base);
+uint32_t balloon_read(void *base, uint32_t address);
+void balloon_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void balloon_set_target(struct balloon_register *b, uint32_t pages);
+void balloon_show(struct balloon_register *b);
+
 uint8_t uart_8250_rw_enable(void);
 uint8_t uart_8250_rw_disable(void);
+int uart_null_register(const struct charwr_interface **interface, struct loop_t *lo);
+
+void nic_exit(int s, void *base);
+uint32_t nic_reset(void *base);
+int nic_fork_child(void *base);
+uint32_t nic_read(void *base, uint32_t address);
+void nic_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+int nic_can_receive(struct nic_register *nic);
+int nic_receive(struct nic_register *nic, const uint8_t *buf, int len, uint16_t flags);
+int nic_checksum(uint8_t *buf, int len, uint16_t start, uint16_t offset);
+void nic_show(struct nic_register *nic);
+
+void blk_exit(int s, void *base);
+uint32_t blk_reset(void *base);
+int blk_fork_child(void *base);
+void blk_drain(struct blk_register *blk);
+uint32_t blk_read(void *base, uint32_t address);
+void blk_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void blk_show(struct blk_register *blk);
+
+uint32_t dma_reset(void *base);
+uint32_t dma_read(void *base, uint32_t address);
+void dma_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void dma_show(struct dma_register *dma);
+
+void crypto_exit(int s, void *base);
+uint32_t crypto_reset(void *base);
+int crypto_fork_child(void *base);
+void crypto_drain(struct crypto_register *c);
+uint32_t crypto_read(void *base, uint32_t address);
+void crypto_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void crypto_show(struct crypto_register *c);
+
+void rng_exit(int s, void *base);
+uint32_t rng_reset(void *base);
+int rng_fork_child(void *base);
+uint32_t rng_read(void *base, uint32_t address);
+void rng_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void rng_show(struct rng_register *rng);
+
+void share_exit(int s, void *base);
+uint32_t share_reset(void *base);
+int share_fork_child(void *base);
+void share_drain(struct share_register *share);
+uint32_t share_read(void *base, uint32_t address);
+void share_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
+void share_show(struct share_register *share);
+
+uint32_t power_reset(void *base);
+uint32_t power_read(void *base, uint32_t address);
+void power_write(void *base, uint32_t address, uint32_t data, uint8_t mask);
 
 
 #endif
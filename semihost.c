@@ -0,0 +1,617 @@
+/*
+ * semihost.c of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <semihost.h>
+#include <console.h>
+
+#define LOG_NAME   "semihost"
+#define DEBUG_PRINTF(...)     printf("\033[0;32m" LOG_NAME "\033[0m: " __VA_ARGS__)
+#define ERROR_PRINTF(...)     printf("\033[1;31m" LOG_NAME "\033[0m: " __VA_ARGS__)
+
+/*
+ * Semihosting calls of the ARM specification, the way bare-metal
+ * libraries (newlib rdimon, picolibc) reach the host. Buffers are
+ * guest virtual addresses, translated a 1K page at a time, and data
+ * moves between RAM and the host file with no copy in between, so a
+ * program prints or loads a whole buffer per SWI. Handles 1, 2 and 3
+ * are the host stdin, stdout and stderr, ":tt" opens them. The stdio
+ * console owns stdin, guest reads of it come from the console fifo.
+ */
+
+#define SYS_OPEN             0x01
+#define SYS_CLOSE            0x02
+#define SYS_WRITEC           0x03
+#define SYS_WRITE0           0x04
+#define SYS_WRITE            0x05
+#define SYS_READ             0x06
+#define SYS_READC            0x07
+#define SYS_ISERROR          0x08
+#define SYS_ISTTY            0x09
+#define SYS_SEEK             0x0a
+#define SYS_FLEN             0x0c
+#define SYS_REMOVE           0x0e
+#define SYS_RENAME           0x0f
+#define SYS_CLOCK            0x10
+#define SYS_TIME             0x11
+#define SYS_ERRNO            0x13
+#define SYS_GET_CMDLINE      0x15
+#define SYS_HEAPINFO         0x16
+#define SYS_EXIT             0x18
+#define SYS_EXIT_EXTENDED    0x20
+#define SYS_ELAPSED          0x30
+#define SYS_TICKFREQ         0x31
+
+#define ADP_STOPPED_APPLICATION_EXIT   0x20026
+
+/* ":semihosting-features", SH_EXT_EXIT_EXTENDED and SH_EXT_STDOUT_STDERR */
+static const uint8_t semihost_features[] = { 'S', 'H', 'F', 'B', 0x03 };
+
+#define SEMIHOST_PAGE        (1024)    /* smallest ARMv4 page */
+#define SEMIHOST_TICK_HZ     (1000000)
+
+struct semihost_file_t {
+    int fd;                   //-1 free
+    const uint8_t *data;      //read-only file in memory, fd is unused
+    uint32_t len;
+    uint32_t pos;
+};
+
+struct semihost_t {
+    struct memory_t *mem;
+    const char *cmdline;
+    struct timespec start;
+    int err;                  //host errno of the last failed call
+    struct semihost_file_t file[SEMIHOST_FILES]; //by handle, 0 is never handed out
+
+    uint32_t calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+static struct semihost_t semihost;
+
+
+/*
+ * semihost_ram: host pointer to guest virtual address, valid up to the
+ * end of its page or len, *chunk is that length, return: NULL fault or
+ * not RAM
+ */
+static uint8_t *semihost_ram(struct armv4_cpu_t *cpu, uint32_t vaddr, uint32_t len,
+ uint8_t wr, uint32_t *chunk)
+{
+    uint32_t paddr, n = SEMIHOST_PAGE - (vaddr & (SEMIHOST_PAGE - 1));
+    if(mmu_translate(cpu, vaddr, wr, &paddr) < 0 || paddr >= MEM_SIZE)
+        return NULL;
+    if(n > len)
+        n = len;
+    *chunk = n;
+    return semihost.mem->mem + paddr;
+}
+
+
+/* return: 0 done, -1 fault */
+static int semihost_copy_from(struct armv4_cpu_t *cpu, void *buf, uint32_t vaddr, uint32_t len)
+{
+    uint8_t *dst = buf;
+    while(len) {
+        uint32_t n;
+        uint8_t *p = semihost_ram(cpu, vaddr, len, 0, &n);
+        if(!p)
+            return -1;
+        memcpy(dst, p, n);
+        dst += n;
+        vaddr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int semihost_copy_to(struct armv4_cpu_t *cpu, uint32_t vaddr, const void *buf, uint32_t len)
+{
+    const uint8_t *src = buf;
+    while(len) {
+        uint32_t n, paddr;
+        uint8_t *p = semihost_ram(cpu, vaddr, len, 1, &n);
+        if(!p)
+            return -1;
+        memcpy(p, src, n);
+        paddr = p - semihost.mem->mem;
+        memory_set_dirty(semihost.mem, paddr, n);
+        src += n;
+        vaddr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* argument block of words at r1 */
+static int semihost_args(struct armv4_cpu_t *cpu, uint32_t *arg, int count)
+{
+    return semihost_copy_from(cpu, arg, register_read(cpu, 1), count * sizeof(uint32_t));
+}
+
+
+/* name of len bytes, return: 0 done, -1 fault or too long */
+static int semihost_string(struct armv4_cpu_t *cpu, char *s, uint32_t vaddr, uint32_t len)
+{
+    if(len >= PATH_MAX || semihost_copy_from(cpu, s, vaddr, len) < 0)
+        return -1;
+    s[len] = '\0';
+    return 0;
+}
+
+
+static struct semihost_file_t *semihost_file(uint32_t handle)
+{
+    if(handle == 0 || handle >= SEMIHOST_FILES)
+        return NULL;
+    if(semihost.file[handle].fd < 0 && !semihost.file[handle].data)
+        return NULL;
+    return &semihost.file[handle];
+}
+
+
+static int semihost_handle_new(void)
+{
+    int i;
+    for(i = 4; i < SEMIHOST_FILES; i++) {
+        if(semihost.file[i].fd < 0 && !semihost.file[i].data)
+            return i;
+    }
+    return -1;
+}
+
+
+/* [name, mode, len], mode 0-11 is fopen() "r", "rb", "r+", "r+b", "w", ..., "a+b" */
+static int32_t semihost_open(struct armv4_cpu_t *cpu)
+{
+    static const int flags[3] = {
+        O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND,
+    };
+    char name[PATH_MAX];
+    uint32_t arg[3];
+    int handle, o;
+
+    if(semihost_args(cpu, arg, 3) < 0 || arg[1] > 11 ||
+     semihost_string(cpu, name, arg[0], arg[2]) < 0) {
+        semihost.err = EINVAL;
+        return -1;
+    }
+    if(strcmp(name, ":tt") == 0) {
+        //stdin, stdout or stderr by mode
+        return arg[1] / 4 + 1;
+    }
+    handle = semihost_handle_new();
+    if(handle < 0) {
+        semihost.err = EMFILE;
+        return -1;
+    }
+    if(strcmp(name, ":semihosting-features") == 0) {
+        if(arg[1] / 4) {
+            semihost.err = EACCES;
+            return -1;
+        }
+        semihost.file[handle].data = semihost_features;
+        semihost.file[handle].len = sizeof(semihost_features);
+        semihost.file[handle].pos = 0;
+        return handle;
+    }
+    o = flags[arg[1] / 4];
+    if(arg[1] & 2) {
+        //"+" modes
+        o = (o & ~O_WRONLY) | O_RDWR;
+    }
+    semihost.file[handle].fd = open(name, o | O_CLOEXEC, 0644);
+    if(semihost.file[handle].fd < 0) {
+        semihost.err = errno;
+        return -1;
+    }
+    return handle;
+}
+
+
+static int32_t semihost_close(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    uint32_t arg[1];
+
+    if(semihost_args(cpu, arg, 1) < 0 || !(f = semihost_file(arg[0]))) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    if(arg[0] < 4)
+        return 0; //stdin, stdout and stderr stay open
+    if(f->fd >= 0)
+        close(f->fd);
+    f->fd = -1;
+    f->data = NULL;
+    return 0;
+}
+
+
+/*
+ * stdin and stdout share O_NONBLOCK with the console, a call waits for
+ * the fd instead of failing with EAGAIN
+ */
+static ssize_t semihost_fd_io(int fd, void *p, size_t n, int wr)
+{
+    for(;;) {
+        ssize_t r = wr ? write(fd, p, n) : read(fd, p, n);
+        if(r >= 0 || (errno != EINTR && errno != EAGAIN))
+            return r;
+        if(errno == EAGAIN) {
+            struct pollfd pfd = {
+                .fd = fd,
+                .events = wr ? POLLOUT : POLLIN,
+            };
+            poll(&pfd, 1, -1);
+        }
+    }
+}
+
+
+/* the stdio console drains stdin, the guest gets the bytes from it */
+static ssize_t semihost_fd_read(int fd, void *p, size_t n)
+{
+    if(fd == STDIN_FILENO) {
+        int r = console_stdin_read(p, n);
+        if(r >= 0)
+            return r;
+    }
+    return semihost_fd_io(fd, p, n, 0);
+}
+
+
+/* [handle, buf, len], return: bytes not written */
+static int32_t semihost_write(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    uint32_t arg[3];
+
+    if(semihost_args(cpu, arg, 3) < 0 || !(f = semihost_file(arg[0])) || f->data) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    if(f->fd <= STDERR_FILENO)
+        fflush(stdout);
+    while(arg[2]) {
+        uint32_t n;
+        ssize_t r;
+        uint8_t *p = semihost_ram(cpu, arg[1], arg[2], 0, &n);
+        if(!p) {
+            semihost.err = EFAULT;
+            break;
+        }
+        r = semihost_fd_io(f->fd, p, n, 1);
+        if(r <= 0) {
+            semihost.err = errno;
+            break;
+        }
+        semihost.bytes_written += r;
+        arg[1] += r;
+        arg[2] -= r;
+    }
+    return arg[2];
+}
+
+
+/* [handle, buf, len], return: bytes not read, len at end of file */
+static int32_t semihost_read(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    uint32_t arg[3];
+
+    if(semihost_args(cpu, arg, 3) < 0 || !(f = semihost_file(arg[0]))) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    if(f->data) {
+        uint32_t n = f->len - f->pos;
+        if(n > arg[2])
+            n = arg[2];
+        if(semihost_copy_to(cpu, arg[1], f->data + f->pos, n) < 0) {
+            semihost.err = EFAULT;
+            return arg[2];
+        }
+        f->pos += n;
+        return arg[2] - n;
+    }
+    while(arg[2]) {
+        uint32_t n;
+        ssize_t r;
+        uint8_t *p = semihost_ram(cpu, arg[1], arg[2], 1, &n);
+        if(!p) {
+            semihost.err = EFAULT;
+            break;
+        }
+        r = semihost_fd_read(f->fd, p, n);
+        if(r < 0)
+            semihost.err = errno;
+        if(r <= 0)
+            break;
+        memory_set_dirty(semihost.mem, p - semihost.mem->mem, r);
+        semihost.bytes_read += r;
+        arg[1] += r;
+        arg[2] -= r;
+        //a console returns a line at a time
+        if(r < n && (f->fd == STDIN_FILENO || isatty(f->fd)))
+            break;
+    }
+    return arg[2];
+}
+
+
+static int32_t semihost_seek(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    uint32_t arg[2];
+
+    if(semihost_args(cpu, arg, 2) < 0 || !(f = semihost_file(arg[0]))) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    if(f->data) {
+        if(arg[1] > f->len) {
+            semihost.err = EINVAL;
+            return -1;
+        }
+        f->pos = arg[1];
+        return 0;
+    }
+    if(lseek(f->fd, arg[1], SEEK_SET) < 0) {
+        semihost.err = errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int32_t semihost_flen(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    struct stat st;
+    uint32_t arg[1];
+
+    if(semihost_args(cpu, arg, 1) < 0 || !(f = semihost_file(arg[0]))) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    if(f->data)
+        return f->len;
+    if(fstat(f->fd, &st) < 0) {
+        semihost.err = errno;
+        return -1;
+    }
+    return st.st_size > INT32_MAX ? -1 : (int32_t)st.st_size;
+}
+
+
+static int32_t semihost_istty(struct armv4_cpu_t *cpu)
+{
+    struct semihost_file_t *f;
+    uint32_t arg[1];
+
+    if(semihost_args(cpu, arg, 1) < 0 || !(f = semihost_file(arg[0]))) {
+        semihost.err = EBADF;
+        return -1;
+    }
+    return !f->data && isatty(f->fd);
+}
+
+
+/* SYS_REMOVE [name, len], SYS_RENAME [old, len, new, len] */
+static int32_t semihost_remove(struct armv4_cpu_t *cpu, int rename_to)
+{
+    char name[PATH_MAX], to[PATH_MAX];
+    uint32_t arg[4];
+    int ret;
+
+    if(semihost_args(cpu, arg, rename_to ? 4 : 2) < 0 ||
+     semihost_string(cpu, name, arg[0], arg[1]) < 0 ||
+     (rename_to && semihost_string(cpu, to, arg[2], arg[3]) < 0)) {
+        semihost.err = EINVAL;
+        return -1;
+    }
+    ret = rename_to ? rename(name, to) : unlink(name);
+    if(ret < 0)
+        semihost.err = errno;
+    return ret;
+}
+
+
+static uint64_t semihost_elapsed_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - semihost.start.tv_sec) * 1000000ULL +
+     (ts.tv_nsec - semihost.start.tv_nsec) / 1000;
+}
+
+
+/* [buf, len], len is updated to the string length */
+static int32_t semihost_cmdline(struct armv4_cpu_t *cpu)
+{
+    uint32_t arg[2];
+    uint32_t len = strlen(semihost.cmdline);
+
+    if(semihost_args(cpu, arg, 2) < 0 || len >= arg[1] ||
+     semihost_copy_to(cpu, arg[0], semihost.cmdline, len + 1) < 0) {
+        semihost.err = EINVAL;
+        return -1;
+    }
+    arg[1] = len;
+    if(semihost_copy_to(cpu, register_read(cpu, 1) + 4, &arg[1], 4) < 0)
+        return -1;
+    return 0;
+}
+
+
+static void semihost_exit(int status)
+{
+    fflush(stdout);
+    DEBUG_PRINTF("exit %d\n", status);
+    exit(status);
+}
+
+
+int semihost_init(struct memory_t *m, const char *cmdline)
+{
+    int i;
+    memset(&semihost, 0, sizeof(semihost));
+    semihost.mem = m;
+    semihost.cmdline = cmdline ? cmdline : "";
+    for(i = 0; i < SEMIHOST_FILES; i++)
+        semihost.file[i].fd = -1;
+    semihost.file[1].fd = STDIN_FILENO;
+    semihost.file[2].fd = STDOUT_FILENO;
+    semihost.file[3].fd = STDERR_FILENO;
+    clock_gettime(CLOCK_MONOTONIC, &semihost.start);
+    return 0;
+}
+
+
+int semihost_swi(struct armv4_cpu_t *cpu)
+{
+    uint32_t op = register_read(cpu, 0);
+    uint32_t arg[2];
+    int32_t ret = -1;
+    uint8_t ch;
+
+    if((cpu->decoder.instruction_word & 0xffffff) != SEMIHOST_SWI)
+        return 0;
+    semihost.calls++;
+    switch(op) {
+    case SYS_OPEN:
+        ret = semihost_open(cpu);
+        break;
+    case SYS_CLOSE:
+        ret = semihost_close(cpu);
+        break;
+    case SYS_WRITEC:
+        if(semihost_copy_from(cpu, &ch, register_read(cpu, 1), 1) == 0) {
+            fflush(stdout);
+            ret = semihost_fd_io(STDOUT_FILENO, &ch, 1, 1) == 1 ? 0 : -1;
+        }
+        break;
+    case SYS_WRITE0:
+        fflush(stdout);
+        for(arg[0] = register_read(cpu, 1);; arg[0]++) {
+            if(semihost_copy_from(cpu, &ch, arg[0], 1) < 0 || !ch)
+                break;
+            if(semihost_fd_io(STDOUT_FILENO, &ch, 1, 1) != 1)
+                break;
+        }
+        ret = 0;
+        break;
+    case SYS_WRITE:
+        ret = semihost_write(cpu);
+        break;
+    case SYS_READ:
+        ret = semihost_read(cpu);
+        break;
+    case SYS_READC:
+        ret = semihost_fd_read(STDIN_FILENO, &ch, 1) == 1 ? ch : -1;
+        break;
+    case SYS_ISERROR:
+        ret = semihost_args(cpu, arg, 1) == 0 && (int32_t)arg[0] < 0;
+        break;
+    case SYS_ISTTY:
+        ret = semihost_istty(cpu);
+        break;
+    case SYS_SEEK:
+        ret = semihost_seek(cpu);
+        break;
+    case SYS_FLEN:
+        ret = semihost_flen(cpu);
+        break;
+    case SYS_REMOVE:
+        ret = semihost_remove(cpu, 0);
+        break;
+    case SYS_RENAME:
+        ret = semihost_remove(cpu, 1);
+        break;
+    case SYS_CLOCK:
+        ret = semihost_elapsed_us() / 10000;
+        break;
+    case SYS_TIME:
+        ret = time(NULL);
+        break;
+    case SYS_ERRNO:
+        ret = semihost.err;
+        break;
+    case SYS_GET_CMDLINE:
+        ret = semihost_cmdline(cpu);
+        break;
+    case SYS_HEAPINFO:
+        {
+            //zeros: the program keeps the heap and stack of its link script
+            uint32_t info[4] = {0, };
+            if(semihost_args(cpu, arg, 1) == 0 &&
+             semihost_copy_to(cpu, arg[0], info, sizeof(info)) == 0)
+                ret = 0;
+        }
+        break;
+    case SYS_EXIT:
+        semihost_exit(register_read(cpu, 1) == ADP_STOPPED_APPLICATION_EXIT ? 0 : 1);
+        break;
+    case SYS_EXIT_EXTENDED:
+        if(semihost_args(cpu, arg, 2) < 0)
+            semihost_exit(1);
+        semihost_exit(arg[0] == ADP_STOPPED_APPLICATION_EXIT ? (int)arg[1] : 1);
+        break;
+    case SYS_ELAPSED:
+        {
+            uint64_t us = semihost_elapsed_us();
+            uint32_t ticks[2] = { us, us >> 32 };
+            if(semihost_copy_to(cpu, register_read(cpu, 1), ticks, sizeof(ticks)) == 0)
+                ret = 0;
+        }
+        break;
+    case SYS_TICKFREQ:
+        ret = SEMIHOST_TICK_HZ;
+        break;
+    default:
+        ERROR_PRINTF("unsupported operation 0x%x\n", op);
+        semihost.err = ENOSYS;
+        break;
+    }
+    register_write(cpu, 0, ret);
+    return 1;
+}
+
+
+void semihost_show(void)
+{
+    DEBUG_PRINTF("%u calls, %llu bytes read, %llu bytes written, last errno %d\n",
+     semihost.calls, (unsigned long long)semihost.bytes_read,
+     (unsigned long long)semihost.bytes_written, semihost.err);
+}
+
+/*****************************END OF FILE***************************/
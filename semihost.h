@@ -0,0 +1,42 @@
+/*
+ * semihost.h of arm_emulator
+ * Copyright (C) 2019-2020  hxdyxd <hxdyxd@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _SEMIHOST_H_
+#define _SEMIHOST_H_
+
+#include <stdint.h>
+#include <armv4.h>
+#include <peripheral.h>
+
+/* ARM semihosting, "swi 0x123456", r0 operation, r1 argument */
+#define SEMIHOST_SWI         (0x123456)
+#define SEMIHOST_FILES       (64)      /* open handles */
+
+/* cmdline: returned by SYS_GET_CMDLINE, return: 0 done, -1 error */
+int semihost_init(struct memory_t *m, const char *cmdline);
+/*
+ * semihost_swi: from cpu thread, serve the SWI just decoded if it is
+ * a semihosting call, the result is in r0 and the program goes on
+ * without entering SVC mode, SYS_EXIT ends the emulator,
+ * return: 1 served, 0 another SWI
+ */
+int semihost_swi(struct armv4_cpu_t *cpu);
+void semihost_show(void);
+
+#endif
+/*****************************END OF FILE***************************/
@@ -17,23 +17,14 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include <slip.h>
-#include <sys/time.h>
-#include <sys/select.h>
-
-/* Blockable */
-static inline void send_char(struct __kfifo *fifo, int ch, uint8_t *is_run)
-{
-    while(__kfifo_in(fifo, &ch, 1) == 0 && *is_run) {
-        struct timeval timeout = {
-            .tv_sec = 0,
-            .tv_usec = 20,
-        };
-        select(0, NULL, NULL, NULL, &timeout);
-    }
-}
-
-
-#define FIFO_OUT_CHAR_PEEK(f,c,l)  __kfifo_out_peek_one(f,c,l)
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#define USE_X86_AVX2_SCAN
+#endif
 
 
 
@@ -44,66 +35,179 @@ static inline void send_char(struct __kfifo *fifo, int ch, uint8_t *is_run)
 #define ESC_ESC         0335    /* ESC ESC_ESC means ESC data byte */
 
 
-void slip_send_packet(struct __kfifo *fifo, uint8_t *buf, int len, uint8_t *is_run)
+/* append to the packet being decoded, a long packet is dropped up to the next END */
+static inline void slip_decode_put(struct slip_decoder_t *dec, uint8_t *buf, int len,
+    const uint8_t *src, int n)
+{
+    if(dec->skip)
+        return;
+    if(dec->len + n > len) {
+        dec->skip = 1;
+        dec->dropped++;
+        return;
+    }
+    memcpy(buf + dec->len, src, n);
+    dec->len += n;
+}
+
+#ifdef USE_X86_AVX2_SCAN
+/* -1 not probed yet, the build targets plain x86_64, AVX2 is taken when the host cpu has it */
+static int8_t has_avx2 = -1;
+
+static int slip_probe_avx2(void)
+{
+    unsigned int a, b, c, d;
+    int avx2 = 0;
+    //the os must save the ymm registers too
+    if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE)) {
+        __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        if((a & 0x6) == 0x6 && __get_cpuid_count(7, 0, &a, &b, &c, &d))
+            avx2 = (b & bit_AVX2) ? 1 : 0;
+    }
+    __atomic_store_n(&has_avx2, avx2, __ATOMIC_RELAXED);
+    return avx2;
+}
+
+static __attribute__((target("avx2"))) int slip_scan_avx2(const uint8_t *buf, int len)
+{
+    const __m256i end32 = _mm256_set1_epi8((char)END);
+    const __m256i esc32 = _mm256_set1_epi8((char)ESC);
+    int i = 0;
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, end32),
+            _mm256_cmpeq_epi8(v, esc32)));
+        if(m)
+            return i + __builtin_ctz(m);
+    }
+    for(; i < len; i++) {
+        if(buf[i] == END || buf[i] == ESC)
+            break;
+    }
+    return i;
+}
+#endif
+
+/* return: offset of the first END or ESC byte, len if there is none */
+static inline int slip_scan(const uint8_t *buf, int len)
+{
+    int i = 0;
+#ifdef USE_X86_AVX2_SCAN
+    int avx2 = __atomic_load_n(&has_avx2, __ATOMIC_RELAXED);
+    if(avx2 < 0)
+        avx2 = slip_probe_avx2();
+    //short runs are not worth the call
+    if(avx2 && len >= 64)
+        return slip_scan_avx2(buf, len);
+#endif
+#if defined(__SSE2__)
+    const __m128i end16 = _mm_set1_epi8((char)END);
+    const __m128i esc16 = _mm_set1_epi8((char)ESC);
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        uint32_t m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, end16),
+            _mm_cmpeq_epi8(v, esc16)));
+        if(m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    for(; i < len; i++) {
+        if(buf[i] == END || buf[i] == ESC)
+            break;
+    }
+    return i;
+}
+
+/* return: length of the encoded packet, at most 2 * len + 2 */
+static int slip_encode(uint8_t *out, const uint8_t *buf, int len)
 {
+    uint8_t *p = out;
     /* send an initial END character to flush out any data that may
      * have accumulated in the receiver due to line noise
      */
-    send_char(fifo, END, is_run);
-
-    /* for each byte in the packet, send the appropriate character
-     * sequence
-    */
-    while(len--) {
-        switch(*buf) {
-        /* if it's the same code as an END character, we send a
-         * special two character code so as not to make the
-         * receiver think we sent an END */
-        case END:
-            send_char(fifo, ESC, is_run);
-            send_char(fifo, ESC_END, is_run);
-            break;
+    *p++ = END;
 
-        /* if it's the same code as an ESC character,
-        * we send a special two character code so as not
-        * to make the receiver think we sent an ESC
-        */
-        case ESC:
-            send_char(fifo, ESC, is_run);
-            send_char(fifo, ESC_ESC, is_run);
+    while(len) {
+        /* bytes other than END and ESC go out as they are */
+        int run = slip_scan(buf, len);
+        memcpy(p, buf, run);
+        p += run;
+        buf += run;
+        len -= run;
+        if(!len)
             break;
 
-        /* otherwise, we just send the character
-        */
-        default:
-            send_char(fifo, *buf, is_run);
-        }
-
+        /* an END or ESC data byte is sent as a two character code
+         * so the receiver does not take it for a frame boundary
+         */
+        *p++ = ESC;
+        *p++ = (*buf == END) ? ESC_END : ESC_ESC;
         buf++;
+        len--;
     }
 
     /* tell the receiver that we're done sending the packet */
-    send_char(fifo, END, is_run);
+    *p++ = END;
+    return p - out;
 }
 
-int slip_recv_poll(struct __kfifo *fifo, uint8_t *buf, int len)
+
+/*
+ * slip_send_flush: move backlog bytes into the fifo,
+ * return: 1 bytes still wait for the guest, 0 backlog empty
+ */
+int slip_send_flush(struct slip_encoder_t *enc, struct __kfifo *fifo)
 {
-    uint8_t ch;
-    int fifo_out = 0;
-    int received = 0;
-    while(FIFO_OUT_CHAR_PEEK(fifo, &ch, fifo_out+1) == fifo_out+1) {
-        fifo_out++;
-        switch(ch) {
-        case END:
-            if(received) {
-                fifo->out += fifo_out;
-                return received;
-            } else {
-                break;
-            }
-        case ESC:
-            if(FIFO_OUT_CHAR_PEEK(fifo, &ch, fifo_out+1) == fifo_out+1) {
-                fifo_out++;
+    uint32_t pos = enc->pos;
+    if(pos != enc->len) {
+        pos += __kfifo_in(fifo, enc->buf + pos, enc->len - pos);
+        __atomic_store_n(&enc->pos, pos, __ATOMIC_RELAXED);
+    }
+    return pos != enc->len;
+}
+
+
+/*
+ * slip_send_packet: never blocks, what the fifo cannot take waits in
+ * the backlog for slip_send_flush,
+ * return: 0 queued, -1 dropped, backlog full
+ */
+int slip_send_packet(struct slip_encoder_t *enc, struct __kfifo *fifo, const uint8_t *buf, int len)
+{
+    if(!slip_send_flush(enc, fifo)) {
+        enc->pos = enc->len = 0;
+    } else if(SLIP_BACKLOG_SIZE - enc->len < 2 * len + 2) {
+        memmove(enc->buf, enc->buf + enc->pos, enc->len - enc->pos);
+        enc->len -= enc->pos;
+        enc->pos = 0;
+    }
+    if(SLIP_BACKLOG_SIZE - enc->len < 2 * len + 2) {
+        enc->dropped++;
+        return -1;
+    }
+    __atomic_store_n(&enc->len, enc->len + slip_encode(enc->buf + enc->len, buf, len), __ATOMIC_RELAXED);
+    slip_send_flush(enc, fifo);
+    return 0;
+}
+
+/*
+ * slip_recv_poll: decode whatever the fifo holds into buf, the partial
+ * packet stays in buf and dec between calls, so both must be the same
+ * until a packet is returned,
+ * return: length of a complete packet, 0 none yet
+ */
+int slip_recv_poll(struct slip_decoder_t *dec, struct __kfifo *fifo, uint8_t *buf, int len)
+{
+    void *data;
+    unsigned int n;
+    while((n = __kfifo_out_linear(fifo, &data)) != 0) {
+        const uint8_t *s = data;
+        unsigned int i = 0;
+        while(i < n) {
+            int run = 1;
+            if(dec->esc) {
+                uint8_t ch = s[i];
+                dec->esc = 0;
                 switch(ch) {
                 case ESC_END:
                     ch = END;
@@ -112,18 +216,25 @@ int slip_recv_poll(struct __kfifo *fifo, uint8_t *buf, int len)
                     ch = ESC;
                     break;
                 }
+                slip_decode_put(dec, buf, len, &ch, 1);
+            } else if(s[i] == ESC) {
+                dec->esc = 1;
+            } else if(s[i] == END) {
+                if(dec->len && !dec->skip) {
+                    int received = dec->len;
+                    dec->len = 0;
+                    __kfifo_out_commit(fifo, i + 1);
+                    return received;
+                }
+                dec->len = 0;
+                dec->skip = 0;
             } else {
-                return 0;
-            }
-        default:
-            if(received < len) {
-                buf[received++] = ch;
-            } else {
-                //long packet
-                fifo->out += fifo_out;
-                return received;
+                run = slip_scan(s + i, n - i);
+                slip_decode_put(dec, buf, len, s + i, run);
             }
+            i += run;
         }
+        __kfifo_out_commit(fifo, n);
     }
     return 0;
 }
@@ -22,8 +22,36 @@
 #include <kfifo.h>
 #include <stdint.h>
 
-void slip_send_packet(struct __kfifo *fifo, uint8_t *buf, int len, uint8_t *is_run);
-int slip_recv_poll(struct __kfifo *fifo, uint8_t *buf, int len);
+/* end of packet, the receiver has a whole packet to decode */
+#define SLIP_END        (0300)
+
+/* encoded bytes the fifo had no room for, from the loop thread */
+#define SLIP_BACKLOG_SIZE   (16384)
+struct slip_encoder_t {
+    uint8_t buf[SLIP_BACKLOG_SIZE];
+    uint32_t pos;       //first byte not in the fifo yet
+    uint32_t len;       //end of the encoded bytes
+    uint32_t dropped;   //packets dropped, backlog full
+};
+
+/* the guest has not taken every byte yet, safe from the cpu thread */
+static inline int slip_send_pending(struct slip_encoder_t *enc)
+{
+    return __atomic_load_n(&enc->pos, __ATOMIC_RELAXED) != __atomic_load_n(&enc->len, __ATOMIC_RELAXED);
+}
+
+int slip_send_packet(struct slip_encoder_t *enc, struct __kfifo *fifo, const uint8_t *buf, int len);
+int slip_send_flush(struct slip_encoder_t *enc, struct __kfifo *fifo);
+
+/* packet being decoded, from the loop thread */
+struct slip_decoder_t {
+    int len;            //bytes decoded so far
+    uint8_t esc;        //last byte was ESC
+    uint8_t skip;       //packet too long, dropping up to END
+    uint32_t dropped;   //packets dropped, too long
+};
+
+int slip_recv_poll(struct slip_decoder_t *dec, struct __kfifo *fifo, uint8_t *buf, int len);
 
 #endif
 /*****************************END OF FILE***************************/
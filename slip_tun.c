@@ -38,12 +38,26 @@
 #include <linux/if_tun.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 //struct ifreq ifr;
 #include <linux/if.h>
+#include <linux/virtio_net.h>
 
 
 #define BUF_SIZE      (1800)
 #define FIFO_SIZE     (4096)
+/* a frame read from the tap, behind its vnet header */
+#define FRAME_SIZE    (sizeof(struct virtio_net_hdr) + NIC_FRAME_MAX)
+
+#define TUN_QUEUE_MAX (8)
+/* packets read per queue and wakeup, the loop comes back for the rest */
+#define TUN_BURST     (64)
+
+struct slip_tun_t;
+struct tun_queue_t {
+    struct loop_fd_t lfd;
+    struct slip_tun_t *t;
+};
 
 struct slip_tun_t {
     struct __kfifo send;
@@ -51,13 +65,26 @@ struct slip_tun_t {
     struct __kfifo recv;
     uint8_t recv_fifo_buf[FIFO_SIZE];
 
-    int idx;
-    int fd;
-    uint32_t recv_time_cnt;
-    uint8_t buf[BUF_SIZE];
+    //IFF_MULTI_QUEUE fds of one interface, the kernel spreads flows over them
+    struct tun_queue_t queue[TUN_QUEUE_MAX];
+    int queues;
+    int fd;             //queue 0, guest to host
+    uint8_t vnet_hdr;   //frames carry a struct virtio_net_hdr
+    uint8_t buf[FRAME_SIZE];
+    //packets waiting for room in the send fifo
+    struct slip_encoder_t enc;
+    //packet being decoded into slip_buf, kept across iterations
+    struct slip_decoder_t dec;
+    uint8_t slip_buf[BUF_SIZE];
+    //tap frames go to the nic instead of the slip fifo
+    struct nic_register *nic;
+    struct loop_t *loop;
 };
 
-static struct slip_tun_t slip_tun;
+static struct slip_tun_t slip_tun = {
+    .queues = 1,
+    .fd = -1,
+};
 
 static int net_tun_init(struct slip_tun_t *t);
 static int net_tun_exit(struct slip_tun_t *t);
@@ -82,14 +109,24 @@ static void slip_tun_exit(void)
 /* Non-blockable */
 static uint8_t slip_tun_readable(void)
 {
-    return (slip_tun.send.in != slip_tun.send.out);
+    return kfifo_len(&slip_tun.send) != 0;
+}
+
+/* Non-blockable */
+static uint32_t slip_tun_read_buf(uint8_t *buf, uint32_t len)
+{
+    len = __kfifo_out(&slip_tun.send, buf, len);
+    //the tun fd is parked while the backlog is full, wake the loop once half is free
+    if(len && slip_send_pending(&slip_tun.enc) && kfifo_unused(&slip_tun.send) >= FIFO_SIZE / 2)
+        loop_notify(slip_tun.loop);
+    return len;
 }
 
 /* Non-blockable */
 static uint8_t slip_tun_read(void)
 {
-    uint8_t ch;
-    __kfifo_out(&slip_tun.send, &ch, 1);
+    uint8_t ch = 0;
+    slip_tun_read_buf(&ch, 1);
     return ch;
 }
 
@@ -106,13 +143,68 @@ static uint8_t slip_tun_writeable(void)
 static uint8_t slip_tun_write(uint8_t ch)
 {
     __kfifo_in(&slip_tun.recv, &ch, 1);
+    if(ch == SLIP_END)
+        loop_notify(slip_tun.loop);
     return 0;
 }
 
+/* Non-blockable */
+static uint32_t slip_tun_write_buf(const uint8_t *buf, uint32_t len)
+{
+    len = __kfifo_in(&slip_tun.recv, buf, len);
+    if(memchr(buf, SLIP_END, len))
+        loop_notify(slip_tun.loop);
+    return len;
+}
+
+static uint8_t slip_tun_netdev_init(struct nic_register *nic)
+{
+    slip_tun.nic = nic;
+    return slip_tun_init();
+}
+
+static int slip_tun_netdev_send_hdr(const struct virtio_net_hdr *hdr, const uint8_t *buf, int len)
+{
+    struct iovec iov[2] = {
+        { .iov_base = (void *)hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = (void *)buf, .iov_len = len },
+    };
+    int n = slip_tun.vnet_hdr ? 2 : 1;
+    int wlen;
+    if(n == 2)
+        len += sizeof(*hdr);
+    do {
+        wlen = writev(slip_tun.fd, &iov[2 - n], n);
+    } while(wlen < 0 && errno == EINTR);
+    return (wlen == len) ? 0 : -1;
+}
+
+static int slip_tun_netdev_send(const uint8_t *buf, int len)
+{
+    struct virtio_net_hdr hdr = {
+        .flags = 0,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    return slip_tun_netdev_send_hdr(&hdr, buf, len);
+}
+
+/* the host kernel, or the nic under the tap, fills the checksum */
+static int slip_tun_netdev_send_csum(const uint8_t *buf, int len, uint16_t csum_start, uint16_t csum_offset)
+{
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+        .csum_start = csum_start,
+        .csum_offset = csum_offset,
+    };
+    return slip_tun_netdev_send_hdr(&hdr, buf, len);
+}
+
 
 /***********************extern end*******************************/
 
-static int tun_alloc(int flags)
+/* name is empty for a new interface, and filled with its name */
+static int tun_alloc(char *name, int flags)
 {
     struct ifreq ifr;
     int fd, err;
@@ -125,63 +217,101 @@ static int tun_alloc(int flags)
 
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = flags;
+    memcpy(ifr.ifr_name, name, IFNAMSIZ);
 
     if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
         close(fd);
         ERROR_PRINTF("ioctl fd = %d err\n", fd);
         return err;
     }
+    memcpy(name, ifr.ifr_name, IFNAMSIZ);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 
     DEBUG_PRINTF("open tun/tap device: %s for reading...\n", ifr.ifr_name);
     return fd;
 }
 
+static void slip_tun_queues_mod(struct slip_tun_t *t, int events)
+{
+    for(int i = 0; i < t->queues; i++)
+        loop_mod_fd(t->loop, &t->queue[i].lfd, events);
+}
+
 static void slip_tun_prepare_callback(void *opaque)
 {
     struct slip_tun_t *t = (struct slip_tun_t *)opaque;
-    int events = POLLIN;
-    if(t->recv.in != t->recv.out) {
-        events |= POLLOUT;
-        loop_set_timeout(&loop_default, 0);
-        t->recv_time_cnt = loop_get_clock_ms(&loop_default);
-    } else {
-        if(loop_get_clock_ms(&loop_default) - t->recv_time_cnt >= 2) {
-            loop_set_timeout(&loop_default, 1);
-        } else {
-            loop_set_timeout(&loop_default, 0);
-        }
+    if(t->nic) {
+        //frames stay in the kernel until the guest has rx buffers
+        slip_tun_queues_mod(t, nic_can_receive(t->nic) ? POLLIN : 0);
+        return;
+    }
+    //packets stay in the kernel until the guest drained the backlog
+    slip_tun_queues_mod(t, slip_send_flush(&t->enc, &t->send) ? 0 : POLLIN);
+
+    int rlen = slip_recv_poll(&t->dec, &t->recv, t->slip_buf, BUF_SIZE);
+    if(rlen) {
+        int wlen;
+        do {
+            wlen = write(t->fd, t->slip_buf, rlen);
+        } while(wlen < 0 && errno == EINTR);
+        //more packets may be queued behind this one
+        loop_set_timeout(t->loop, 0);
     }
-    t->idx = loop_add_poll(&loop_default, t->fd, events);
 }
 
-static void slip_tun_poll_callback(void *opaque)
+/* a tap frame to the nic, checksums left partial by the host are completed here */
+static void slip_tun_nic_receive(struct slip_tun_t *t, uint8_t *buf, int len)
 {
-    struct slip_tun_t *t = (struct slip_tun_t *)opaque;
-    int revents = loop_get_revents(&loop_default, t->idx);
-    if(revents & POLLIN) {
-        int total_len = read(t->fd, t->buf, BUF_SIZE);
-        if (total_len < 0) {
-            ERROR_PRINTF("Reading from interface error\n");
+    uint16_t flags = 0;
+    if(t->vnet_hdr) {
+        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)buf;
+        if(len < (int)sizeof(*hdr) || hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE)
             return;
+        buf += sizeof(*hdr);
+        len -= sizeof(*hdr);
+        if(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            //a frame the checksum does not fit in is left to the guest
+            if(nic_checksum(buf, len, hdr->csum_start, hdr->csum_offset) == 0)
+                flags = NIC_DESC_CSUM_VALID;
+        } else if(hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            flags = NIC_DESC_CSUM_VALID;
         }
-        
-        slip_send_packet(&t->send, t->buf, total_len, &LOOP_IS_RUN(&loop_default));
     }
-    if(revents & POLLOUT) {
-        int rlen = slip_recv_poll(&t->recv, t->buf, BUF_SIZE);
-        if(rlen) {
-            int wlen;
-            do {
-                wlen = write(t->fd, t->buf, rlen);
-            } while(wlen < 0 && wlen == EINTR);
+    nic_receive(t->nic, buf, len, flags);
+}
+
+/*
+ * a tun fd gives one packet per read(), drain up to TUN_BURST of them
+ * while the guest can take them, a parked queue is re-armed by prepare
+ */
+static void slip_tun_fd_callback(void *opaque, int revents)
+{
+    struct tun_queue_t *q = (struct tun_queue_t *)opaque;
+    struct slip_tun_t *t = q->t;
+    if(!(revents & POLLIN))
+        return;
+    for(int i = 0; i < TUN_BURST; i++) {
+        if(t->nic ? !nic_can_receive(t->nic) : slip_send_pending(&t->enc)) {
+            loop_mod_fd(t->loop, &q->lfd, 0);
+            return;
         }
+        int total_len = read(q->lfd.fd, t->buf, t->nic ? FRAME_SIZE : BUF_SIZE);
+        if (total_len < 0) {
+            if(errno != EAGAIN && errno != EINTR)
+                ERROR_PRINTF("Reading from interface error\n");
+            return;
+        }
+        if(t->nic)
+            slip_tun_nic_receive(t, t->buf, total_len);
+        else
+            slip_send_packet(&t->enc, &t->send, t->buf, total_len);
     }
 }
 
 
 static const struct loopcb_t loop_slip_tun_cb = {
     .prepare = slip_tun_prepare_callback,
-    .poll = slip_tun_poll_callback,
+    .poll = NULL,
     .timer = NULL,
     .opaque = &slip_tun,
 };
@@ -189,28 +319,82 @@ static const struct loopcb_t loop_slip_tun_cb = {
 
 static int net_tun_init(struct slip_tun_t *t)
 {
+    char name[IFNAMSIZ] = "";
     /* Flags: IFF_TUN   - TUN device (no Ethernet headers)
      *        IFF_TAP   - TAP device
      *        IFF_NO_PI - Do not provide packet information
+     *        IFF_VNET_HDR - Frames start with a struct virtio_net_hdr
+     *        IFF_MULTI_QUEUE - Each open of the name adds a queue
+     * The nic carries ethernet frames, slip carries ip packets.
      */
-    t->fd = tun_alloc(IFF_TUN | IFF_NO_PI);
-    if (t->fd < 0)
-        goto err0;
-
-    loop_register(&loop_default, &loop_slip_tun_cb);
+    int flags = (t->nic ? IFF_TAP | IFF_VNET_HDR : IFF_TUN) | IFF_NO_PI;
+    if(t->queues > 1)
+        flags |= IFF_MULTI_QUEUE;
+    t->vnet_hdr = !!(flags & IFF_VNET_HDR);
+
+    for(int i = 0; i < t->queues; i++) {
+        struct tun_queue_t *q = &t->queue[i];
+        q->t = t;
+        q->lfd.fd = tun_alloc(name, flags);
+        if(q->lfd.fd < 0)
+            goto err0;
+        q->lfd.events = POLLIN;
+        q->lfd.cb = slip_tun_fd_callback;
+        q->lfd.opaque = q;
+        if(loop_add_fd(t->loop, &q->lfd) < 0) {
+            close(q->lfd.fd);
+            q->lfd.fd = -1;
+            goto err0;
+        }
+    }
+    t->fd = t->queue[0].lfd.fd;
+    loop_register(t->loop, &loop_slip_tun_cb);
+    /* partial checksums pass both ways, the nic cannot take
+     * large segments so TSO is left off and the host segments
+     */
+    if(t->vnet_hdr && ioctl(t->fd, TUNSETOFFLOAD, TUN_F_CSUM) < 0)
+        ERROR_PRINTF("%s checksum offload err\n", name);
+    if(t->queues > 1)
+        DEBUG_PRINTF("%s: %d queues\n", name, t->queues);
     return 0;
 
 err0:
+    net_tun_exit(t);
     return -1;
 }
 
 static int net_tun_exit(struct slip_tun_t *t)
 {
-    if(t->fd >= 0) {
-        close(t->fd);
-        return 0;
+    int ret = -1;
+    for(int i = 0; i < t->queues; i++) {
+        struct tun_queue_t *q = &t->queue[i];
+        if(q->t && q->lfd.fd >= 0) {
+            loop_del_fd(t->loop, &q->lfd);
+            close(q->lfd.fd);
+            q->lfd.fd = -1;
+            ret = 0;
+        }
     }
-    return -1;
+    t->fd = -1;
+    return ret;
+}
+
+/* -n tun,queues=<n> */
+int slip_tun_options(const char *opts)
+{
+    while(opts && *opts) {
+        int n;
+        if(sscanf(opts, "queues=%d", &n) == 1 && n > 0 && n <= TUN_QUEUE_MAX) {
+            slip_tun.queues = n;
+        } else {
+            ERROR_PRINTF("unknown tun option %s, queues=1..%d\n", opts, TUN_QUEUE_MAX);
+            return -1;
+        }
+        opts = strchr(opts, ',');
+        if(opts)
+            opts++;
+    }
+    return 0;
 }
 
 
@@ -246,6 +430,38 @@ static uint8_t slip_tun_write(uint8_t ch)
 {
     return 0;
 }
+
+static uint32_t slip_tun_read_buf(uint8_t *buf, uint32_t len)
+{
+    return 0;
+}
+
+static uint32_t slip_tun_write_buf(const uint8_t *buf, uint32_t len)
+{
+    return len;
+}
+
+static uint8_t slip_tun_netdev_init(struct nic_register *nic)
+{
+    ERROR_PRINTF("tap is not supported in this build\n");
+    return 1;
+}
+
+static int slip_tun_netdev_send(const uint8_t *buf, int len)
+{
+    return -1;
+}
+
+static int slip_tun_netdev_send_csum(const uint8_t *buf, int len, uint16_t csum_start, uint16_t csum_offset)
+{
+    return -1;
+}
+
+int slip_tun_options(const char *opts)
+{
+    ERROR_PRINTF("tap is not supported in this build\n");
+    return -1;
+}
 #endif /* USE_TUN_SUPPORT */
 
 
@@ -256,12 +472,33 @@ const static struct charwr_interface tun_interface = {
     .read = slip_tun_read,
     .writeable = slip_tun_writeable,
     .write = slip_tun_write,
+    .read_buf = slip_tun_read_buf,
+    .write_buf = slip_tun_write_buf,
 };
 
-int slip_tun_register(const struct charwr_interface **interface)
+int slip_tun_register(const struct charwr_interface **interface, struct loop_t *lo)
 {
+#ifdef USE_TUN_SUPPORT
+    slip_tun.loop = lo;
+#endif
     *interface = &tun_interface;
     return 0;
 }
 
+const static struct netdev_interface tun_netdev_interface = {
+    .init = slip_tun_netdev_init,
+    .exit = slip_tun_exit,
+    .send = slip_tun_netdev_send,
+    .send_csum = slip_tun_netdev_send_csum,
+};
+
+int slip_tun_netdev_register(const struct netdev_interface **interface, struct loop_t *lo)
+{
+#ifdef USE_TUN_SUPPORT
+    slip_tun.loop = lo;
+#endif
+    *interface = &tun_netdev_interface;
+    return 0;
+}
+
 /*****************************END OF FILE***************************/
@@ -22,7 +22,9 @@
 #include <stdint.h>
 #include <peripheral.h>
 
-int slip_tun_register(const struct charwr_interface **interface);
+int slip_tun_register(const struct charwr_interface **interface, struct loop_t *lo);
+int slip_tun_netdev_register(const struct netdev_interface **interface, struct loop_t *lo);
+int slip_tun_options(const char *opts);
 
 
 #endif
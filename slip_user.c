@@ -48,9 +48,17 @@ struct slip_user_t {
     struct __kfifo recv;
     uint8_t recv_buf[FIFO_SIZE];
 
-    uint32_t recv_time_cnt;
     Slirp *slirp;
     uint8_t slip_out_buf[BUF_SIZE];
+    //packets waiting for room in the send fifo
+    struct slip_encoder_t enc;
+    //packet being decoded into slip_out_buf
+    struct slip_decoder_t dec;
+    //host sockets were added to this iteration's poll set
+    uint8_t polled;
+    //frames go to the nic instead of the slip fifo
+    struct nic_register *nic;
+    struct loop_t *loop;
 };
 
 
@@ -77,13 +85,22 @@ static void slip_user_exit(void)
 
 static uint8_t slip_user_readable(void)
 {
-    return (slip_user.send.in != slip_user.send.out);
+    return kfifo_len(&slip_user.send) != 0;
+}
+
+static uint32_t slip_user_read_buf(uint8_t *buf, uint32_t len)
+{
+    len = __kfifo_out(&slip_user.send, buf, len);
+    //the loop parks host sockets while the backlog is full, wake it once half is free
+    if(len && slip_send_pending(&slip_user.enc) && kfifo_unused(&slip_user.send) >= FIFO_SIZE / 2)
+        loop_notify(slip_user.loop);
+    return len;
 }
 
 static uint8_t slip_user_read(void)
 {
-    uint8_t ch;
-    __kfifo_out(&slip_user.send, &ch, 1);
+    uint8_t ch = 0;
+    slip_user_read_buf(&ch, 1);
     return ch;
 }
 
@@ -98,6 +115,28 @@ static uint8_t slip_user_writeable(void)
 static uint8_t slip_user_write(uint8_t ch)
 {
     __kfifo_in(&slip_user.recv, &ch, 1);
+    if(ch == SLIP_END)
+        loop_notify(slip_user.loop);
+    return 0;
+}
+
+static uint32_t slip_user_write_buf(const uint8_t *buf, uint32_t len)
+{
+    len = __kfifo_in(&slip_user.recv, buf, len);
+    if(memchr(buf, SLIP_END, len))
+        loop_notify(slip_user.loop);
+    return len;
+}
+
+static uint8_t slip_user_netdev_init(struct nic_register *nic)
+{
+    slip_user.nic = nic;
+    return slip_user_init();
+}
+
+static int slip_user_netdev_send(const uint8_t *buf, int len)
+{
+    slirp_input(slip_user.slirp, buf, len);
     return 0;
 }
 
@@ -208,7 +247,7 @@ static int slirp_ip_input(struct slip_user_t *u, const void *buf, size_t len)
     uint8_t *ip_pkt = (uint8_t *)buf + ETH_HLEN;
     int ip_pkt_len = len - ETH_HLEN;
 
-    slip_send_packet(&u->send, ip_pkt, ip_pkt_len, &LOOP_IS_RUN(&loop_default));
+    slip_send_packet(&u->enc, &u->send, ip_pkt, ip_pkt_len);
     return len;
 }
 
@@ -217,6 +256,11 @@ static ssize_t net_slirp_send_packet(const void *buf, size_t len, void *opaque)
     struct slip_user_t *u = (struct slip_user_t *)opaque;
     const uint8_t *pkt = buf;
     int proto = (((uint16_t)pkt[12]) << 8) + pkt[13];
+    if(u->nic) {
+        //slirp only emits frames with valid checksums
+        nic_receive(u->nic, buf, len, NIC_DESC_CSUM_VALID);
+        return len;
+    }
     switch(proto) {
     case ETH_P_ARP:
         return slirp_arp_input(u, buf, len);
@@ -238,24 +282,28 @@ static void net_slirp_guest_error(const char *msg, void *opaque)
 
 static int64_t net_slirp_clock_get_ns(void *opaque)
 {
-    return (int64_t)loop_get_clock_ms(&loop_default)*1000;
+    struct slip_user_t *u = opaque;
+    return loop_get_clock_ns(u->loop);
 }
 
 static void *net_slirp_timer_new(SlirpTimerCb cb, void *cb_opaque, void *opaque)
 {
-    ERROR_PRINTF("timer_new stub\n");
-    return NULL;
+    struct slip_user_t *u = opaque;
+    return loop_timer_new(u->loop, cb, cb_opaque);
 }
 
 static void net_slirp_timer_free(void *timer, void *opaque)
 {
-    ERROR_PRINTF("timer_free stub\n");
+    struct slip_user_t *u = opaque;
+    loop_timer_free(u->loop, timer);
 }
 
+/* expire_timer is in ms of the clock_get_ns clock */
 static void net_slirp_timer_mod(void *timer, int64_t expire_timer,
                                 void *opaque)
 {
-    ERROR_PRINTF("timer_mod stub\n");
+    struct slip_user_t *u = opaque;
+    loop_timer_mod(u->loop, timer, expire_timer * 1000000);
 }
 
 static void net_slirp_register_poll_fd(int fd, void *opaque)
@@ -288,6 +336,7 @@ static const SlirpCb slirp_cb = {
 
 static int add_poll(int fd, int events, void *opaque)
 {
+    struct slip_user_t *u = opaque;
     int poll_events = 0;
 
     if (events & SLIRP_POLL_IN) {
@@ -306,12 +355,13 @@ static int add_poll(int fd, int events, void *opaque)
         poll_events |= POLLHUP;
     }
 
-    return loop_add_poll(&loop_default, fd, poll_events);
+    return loop_add_poll(u->loop, fd, poll_events);
 }
 
 static int get_revents(int idx, void *opaque)
 {
-    int revents = loop_get_revents(&loop_default, idx);
+    struct slip_user_t *u = opaque;
+    int revents = loop_get_revents(u->loop, idx);
 
     int ret = 0;
     if (revents & POLLIN) {
@@ -335,27 +385,34 @@ static int get_revents(int idx, void *opaque)
 static void prepare_callback(void *opaque)
 {
     struct slip_user_t *u = opaque;
-    uint32_t timeout = 0;
-    slirp_pollfds_fill(u->slirp, &timeout, add_poll, u);
-    
-    int rlen = slip_recv_poll(&u->recv, u->slip_out_buf + ETH_HLEN, BUF_SIZE - ETH_HLEN);
+    uint32_t timeout = UINT32_MAX;
+
+    /* leave host sockets unread while the guest cannot take more,
+     * tcp windows then push back on the peers instead of us dropping
+     */
+    if(u->nic ? nic_can_receive(u->nic) : !slip_send_flush(&u->enc, &u->send)) {
+        //slirp lowers timeout while its tcp fast/slow timers are pending
+        slirp_pollfds_fill(u->slirp, &timeout, add_poll, u);
+        u->polled = 1;
+    } else {
+        u->polled = 0;
+    }
+    loop_set_timeout(u->loop, timeout);
+
+    int rlen = slip_recv_poll(&u->dec, &u->recv, u->slip_out_buf + ETH_HLEN, BUF_SIZE - ETH_HLEN);
     if(rlen) {
         slirp_ip_send(u, rlen);
-        loop_set_timeout(&loop_default, 0);
-        u->recv_time_cnt = loop_get_clock_ms(&loop_default);
-    } else {
-        if(loop_get_clock_ms(&loop_default) - u->recv_time_cnt >= 2) {
-            loop_set_timeout(&loop_default, 1);
-        } else {
-            loop_set_timeout(&loop_default, 0);
-        }
+        //more packets may be queued behind this one
+        loop_set_timeout(u->loop, 0);
     }
 }
 
 static void poll_callback(void *opaque)
 {
     struct slip_user_t *u = opaque;
-    slirp_pollfds_poll(u->slirp, 0, get_revents, u);
+    //poll indexes are stale unless fill ran this iteration
+    if(u->polled)
+        slirp_pollfds_poll(u->slirp, 0, get_revents, u);
 }
 
 static void timer_callback(void *opaque)
@@ -392,7 +449,7 @@ static int net_slirp_init(struct slip_user_t *u)
     if(!u->slirp)
         goto err;
 
-    loop_register(&loop_default, &loop_slip_user_cb);
+    loop_register(u->loop, &loop_slip_user_cb);
     return 0;
 
 err:
@@ -537,6 +594,27 @@ static uint8_t slip_user_write(uint8_t ch)
 {
     return 0;
 }
+
+static uint32_t slip_user_read_buf(uint8_t *buf, uint32_t len)
+{
+    return 0;
+}
+
+static uint32_t slip_user_write_buf(const uint8_t *buf, uint32_t len)
+{
+    return len;
+}
+
+static uint8_t slip_user_netdev_init(struct nic_register *nic)
+{
+    ERROR_PRINTF("slirp is not supported in this build\n");
+    return 1;
+}
+
+static int slip_user_netdev_send(const uint8_t *buf, int len)
+{
+    return -1;
+}
 #endif /* USE_SLIRP_SUPPORT */
 
 static const struct charwr_interface slip_user_interface = {
@@ -546,12 +624,32 @@ static const struct charwr_interface slip_user_interface = {
     .read = slip_user_read,
     .writeable = slip_user_writeable,
     .write = slip_user_write,
+    .read_buf = slip_user_read_buf,
+    .write_buf = slip_user_write_buf,
 };
 
-int slip_user_register(const struct charwr_interface **interface)
+int slip_user_register(const struct charwr_interface **interface, struct loop_t *lo)
 {
+#ifdef USE_SLIRP_SUPPORT
+    slip_user.loop = lo;
+#endif
     *interface = &slip_user_interface;
     return 0;
 }
 
+static const struct netdev_interface slip_user_netdev_interface = {
+    .init = slip_user_netdev_init,
+    .exit = slip_user_exit,
+    .send = slip_user_netdev_send,
+};
+
+int slip_user_netdev_register(const struct netdev_interface **interface, struct loop_t *lo)
+{
+#ifdef USE_SLIRP_SUPPORT
+    slip_user.loop = lo;
+#endif
+    *interface = &slip_user_netdev_interface;
+    return 0;
+}
+
 /**************************END OF FILE*****************************/
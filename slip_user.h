@@ -22,7 +22,8 @@
 #include <stdint.h>
 #include <peripheral.h>
 
-int slip_user_register(const struct charwr_interface **interface);
+int slip_user_register(const struct charwr_interface **interface, struct loop_t *lo);
+int slip_user_netdev_register(const struct netdev_interface **interface, struct loop_t *lo);
 int slip_user_hostfwd(const char *redir_str);
 
 #endif